@@ -21,206 +21,79 @@
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
-#include <ctype.h>
-#include <curl/curl.h>
 
 #include "METARmap.h"
 #include "matrix.h"
+#include "fetch.h"
+#include "metarindex.h"
+#include "metardecode.h"
+#include "history.h"
+#include "columns.h"
+#include "metrics.h"
 
-// this website returns the xml of the metar
-// Curl Callback used by GetData
-static size_t
-WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
-{
-  size_t realsize = size * nmemb;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-
-  char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-  if(ptr == NULL) {
-    /* out of memory! */
-    printf("not enough memory (realloc returned NULL)\n");
-    return 0;
-  }
-
-  mem->memory = ptr;
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = 0;
-
-  return realsize;
-}
-
-struct MemoryStruct getData(char *url)
-{
-  CURL *curl_handle;
-  CURLcode res;
-
-  struct curl_slist * pheaders = NULL;
-  struct MemoryStruct chunk;
-
-  chunk.memory = malloc(1);  /* will be grown as needed by the realloc above */
-  chunk.size = 0;    /* no data at this point */
-
-  curl_global_init(CURL_GLOBAL_ALL);
-
-  /* init the curl session */
-  curl_handle = curl_easy_init();
-
-  /* specify URL to get */
-  curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-
-  /* send all data to this function  */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-
-  /* we pass our 'chunk' struct to the callback function */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-
-  /* some servers don't like requests that are made without a user-agent
-     field, so we provide one */
-  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent-rpi/1.0");
-
-  /* get it! */
-  res = curl_easy_perform(curl_handle);
-
-  /* check for errors */
-  if(res != CURLE_OK) {
-    fprintf(stderr, "curl_easy_perform() failed: %s\n",
-            curl_easy_strerror(res));
-  }
-  else {
-    /*
-     * Now, our chunk.memory points to a memory block that is chunk.size
-     * bytes big and contains the remote file.
-     *
-     * We will do something nice with it!
-     */
-
-  }
+char GetFlightCategory(const struct TextView *pFlightCat) {
 
-  /* cleanup curl stuff */
-  curl_easy_cleanup(curl_handle);
-
-//  Remember that caller will be responsible for freeing up this memory
-
-  /* we're done with libcurl, so clean it up */
-  curl_global_cleanup();
-
-  return chunk;
+	if(pFlightCat->ptr == NULL || pFlightCat->len == 0)
+		return 'E';
 
+	return pFlightCat->ptr[0];  // the first letter is all we need
 }
 
-char GetVisibility(char *sRawData)
+// days since 1970-01-01 for a date in the proleptic Gregorian calendar, no
+// timezone or table lookups - see Howard Hinnant's days_from_civil
+static long long DaysFromCivil(int y, int m, int d)
 {
-    char cCond = 'E';  // set to Error
-
-    // Visibility should always end with "SM"
-    // If no visibility, I will assume unlimited for now but may change that. Thanks, non-standard RPH.
-    char *sStartPos = strstr(sRawData, "CALM");
-    if (sStartPos == NULL) {
-	sStartPos = strstr(sRawData, "KT");
-	if (sStartPos != NULL) {
-	    sStartPos += 3;
-	} else {
-	    cCond = 'E';
-	}
-    } else {
-	sStartPos += 5;
-    }
-    if(sStartPos != NULL) {
-	char *sEndPos = strstr(sStartPos, "SM");
-	if (sEndPos == NULL) {
-	    cCond = 'E';
-	} else {
-	    char *cSlashLoc = strchr(sStartPos, '/');   // low ifr will always be a partial mile eg 1/2
-	    if (cSlashLoc == NULL || cSlashLoc - sStartPos > 2) { // the slash needs to be next "number" else could be 1 1/2
-		if (isdigit(sStartPos[1])) { // ie a 2-digit number, which is VFR
-		    cCond = 'V';
-		} else {
-		    int iDist = sStartPos[0] - '0'; // convert to an integer
-		    if (iDist > 5)
-			cCond = 'V';
-		    else if (iDist >= 3)
-			cCond = 'M';
-		    else cCond = 'I';
-		}
-	    }
-	}
-    } else {
-	printf("Error - no wind so unsure where to find visibility\n");
-    }
-
-return cCond;
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;				// [0, 399]
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;	// [0, 365]
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;	// [0, 146096]
+    return era * 146097 + doe - 719468;
 }
 
-char GetSkyCondition(char *sRawData)
+// n digits at p as a number, -1 if any of them isn't one
+static int Digits(const char *p, int n)
 {
-	char cCond = 'V'; 	// default is  VFR. Only presence of BKN or OVC will change cCond
-	char sCeilingHt[4];
-
-	// We only care about ceiling (lowest of) BKN (broken) or OVC (overcast)
-	char *sSkyCond = strstr(sRawData, "BKN");
-	if (sSkyCond == NULL)
-		sSkyCond = strstr(sRawData, "OVC");
-
-	if (sSkyCond != NULL) {
-		sSkyCond += 3;
-		strncpy(sCeilingHt, sSkyCond, 3);
-		int iHeight = atoi(sCeilingHt);
-		if (iHeight < 5)
-			cCond = 'L';
-		else if (iHeight < 10)
-			cCond = 'I';
-		else if (iHeight <= 30)
-			cCond = 'M';
-
-	}
-	return cCond;
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+	unsigned d = (unsigned char)p[i] - '0';
+	if (d > 9)
+	    return -1;
+	v = v * 10 + d;
+    }
+    return v;
 }
 
-char GetFlightCategory(char *sFlightCat) {
+// observation_time is always YYYY-MM-DDTHH:MM:SSZ in UTC, so pick the fields out by position
+int ObsTimeToEpoch(const struct TextView *pObsTime, time_t *pEpoch)
+{
+    const char *p = pObsTime->ptr;
 
-	if(sFlightCat == NULL)
-		return 'E';
+    if (p == NULL || pObsTime->len < 19 || p[4] != '-' || p[7] != '-' || p[10] != 'T'
+	|| p[13] != ':' || p[16] != ':')
+	return FALSE;
 
-	char sCat[5];
+    int y = Digits(p, 4), mon = Digits(p + 5, 2), d = Digits(p + 8, 2);
+    int h = Digits(p + 11, 2), min = Digits(p + 14, 2), sec = Digits(p + 17, 2);
+    if (y < 0 || mon < 1 || mon > 12 || d < 1 || d > 31 || h < 0 || h > 23 || min < 0 || min > 59
+	|| sec < 0 || sec > 60)
+	return FALSE;
 
-	char *sSkyCond = sFlightCat + 17;
-	char cCond = sSkyCond[0];
-	printf("%c", cCond);  // the first letter is all we need
-	fflush(stdout);
-	return cCond;
+    *pEpoch = (time_t)(DaysFromCivil(y, mon, d) * 86400 + h * 3600 + min * 60 + sec);
+    return TRUE;
 }
 
-char IsMetarCurrent(char *sRawData)
+// tNow is UTC epoch seconds, looked up once per refresh by the caller
+char IsMetarCurrent(const struct TextView *pObsTime, time_t tNow)
 {
-    #define METAR_BUFFER_LEN 20
-
-    char metar_buffer[METAR_BUFFER_LEN +1 ];
-    char nowtime_buffer[METAR_BUFFER_LEN +1 ];
-
-    time_t tNow;
     time_t tMetar;
 
-    struct tm stMetarTime;
-    struct tm *stNowInfo;
-    if (sRawData == NULL)
+    if (!ObsTimeToEpoch(pObsTime, &tMetar))
 	return FALSE;
-    time(&tNow);
-    stNowInfo = gmtime( &tNow);
-
-    sRawData += strlen("<observation_time>"); 	// get past the <observation_time> tag
-    strncpy(metar_buffer, sRawData, METAR_BUFFER_LEN);
-    metar_buffer[METAR_BUFFER_LEN] = 0;
 
-    memset(&stMetarTime, 0, sizeof(stMetarTime));
-    strptime(metar_buffer, "%Y-%m-%dT%H:%M:%S", &stMetarTime);
-    tMetar = mktime(&stMetarTime);
-    tNow = mktime(stNowInfo);
-
-    double dDiff = difftime(tNow, tMetar);
-
-    if(dDiff > (90.0* 60.0)) {// more than 90 minutes old -- we're not using this for decicion making but want up to date data
-	printf("METAR data out of date %.0f seconds\n", dDiff);
+    long long diff = (long long)tNow - tMetar;
+    if (diff > stale_minutes * 60LL) {// too old -- we're not using this for decicion making but want up to date data
+	printf("METAR data out of date %lld seconds\n", diff);
 	return FALSE;
     }
 
@@ -228,283 +101,306 @@ char IsMetarCurrent(char *sRawData)
 	return TRUE;
 }
 
-char ParseTheData(char *sAirportCode, struct MemoryStruct sAirportData)
+// pRec is this airport's record from the MetarIndex, NULL if it wasn't in the response
+char ParseTheData(const char *sAirportCode, const struct MetarRecord *pRec, time_t tNow)
 {
     char cCond = 'L';
-    char cVis = 'L';
-    char cSky = 'L';
-    char sSearchStr[16];
-    char *sThisAirportData;
+    struct MetarObs obs;
 
-    sprintf(sSearchStr, "<raw_text>%4s", sAirportCode);
-
-    sThisAirportData = strstr(sAirportData.memory, sSearchStr);
-    if (sThisAirportData == NULL) {
+    if (pRec == NULL) {
+	metrics.stationsMissing++;
 	printf("%s data not reporting \n", sAirportCode);
 	return 'E'; //Error airport not reporting
     }
 
-    char *sAirportEnd = strstr(sThisAirportData, "</METAR>");
-
-    char *sRawData = strstr(sThisAirportData, "<raw_text>");
-
-    char *sFlightCat = strstr(sThisAirportData, "<flight_category>");
-    if (sFlightCat > sAirportEnd)
-	sFlightCat = NULL;
-
-    char *sDateTime =  strstr(sThisAirportData, "<observation_time>");
-    if(sDateTime > sAirportEnd)
-	sAirportEnd = NULL;
-
-    if (IsMetarCurrent(sDateTime) == FALSE) { // Wx data expired
+    if (IsMetarCurrent(&pRec->observation_time, tNow) == FALSE) { // Wx data expired
+	    metrics.stationsStale++;
 	    cCond = 'E';
     } else {
-	    if (sFlightCat != NULL)      //  the tag at <flight_category> exists
-		cCond = GetFlightCategory(sFlightCat);
-	    else {
-		    cCond = 'E';
-		    cVis = GetVisibility(sRawData);
-		    cSky = GetSkyCondition(sRawData);
-		    if (cSky == 'L' || cVis == 'L')
-			    cCond = 'L';
-		    else if (cSky == 'I' || cVis == 'I')
-			    cCond = 'I';
-		    else if (cSky == 'M' || cVis == 'M')
-			    cCond = 'M';
-		    else if (cSky == 'V' || cVis == 'V')
-			    cCond = 'V';
-	    }
-
+	    metrics.stationsFound++;
+	    if (pRec->flight_category.ptr != NULL)      //  the tag at <flight_category> exists
+		cCond = GetFlightCategory(&pRec->flight_category);
+	    else if (MetarDecode(pRec->raw_text.ptr, pRec->raw_text.len, &obs))
+		cCond = MetarCategory(&obs);
+	    else
+		cCond = 'E';	// nothing in the report to go on
     }
 
     return(cCond);
 }
 
-int NumRecsInHistory(FILE *fDay)
-{
-    // function always returns you to the beginning of the file
-    // seek to the end of the file, see how far that was, then rewind back to the beginning
-    fseek(fDay, 0L, SEEK_END);
-    long int file_size = ftell(fDay);
-    long int reclen = REC_LEN;
-    long int numrecs = file_size/reclen;
-    rewind(fDay);
-
-    return (int)numrecs;
-}
-
-void Replay(void)
+// One set of fetch contexts for the life of the process so the daemon reuses its connections
+static struct FetchBatch wxBatch;
+static int wxFetchReady = FALSE;
+static struct FetchSource wxSource;	// from wx_source, set up with the fetch contexts
+static char **sBatchUrls;		// one request per batch, FETCH_MAX_URL+1 each
+static int numBatches;
+static char *sLastRecord;	// what we built from the last full response, led_count long
+static int haveLastRecord = FALSE;
+static struct History liveHistory;	// opened on the first refresh, kept by the daemon
+static int historyReady = FALSE;
+static struct Columns liveColumns;	// the same records a station to a column, for stats
+static int columnsReady = FALSE;
+static struct StationTable stationTable;	// perfect hash of our airports, built by LoadAirports
+static struct MetarIndex wxIndex;
+
+// the airport list is read once per process; the daemon keeps it for every refresh
+static struct stAirport *stAirports;
+static int numAirportsInFile = -1;	// -1 until AirportList.dat has been read
+
+int LoadAirports(void)
 {
-    #define REC_LEN (LED_COUNT*3)+1	// 3 for each led plus '\n'
-    char historyFileName[16];
-
-    if (test_mode == TRUE)
-	strcpy(historyFileName, "daytest.dat");
-    else
-	strcpy(historyFileName, "day.dat");
+    int iEOF;
+    int maxAirports = 0;
+    struct stAirport stAirport;
 
-    FILE *fDay = fopen(historyFileName, "r");
-    if (fDay == NULL) {
-	fprintf(stderr, "Can't do replay right now. File not available %d\n", errno);
-	return;
+    FILE *fAirports = fopen("AirportList.dat", "r");
+    if(fAirports == NULL) {
+	    printf("oops. Where da file?\n");
+	    return 0;
     }
 
-    int num_recs_to_play = NumRecsInHistory(fDay);
-    if (num_replay_hours * HISTORY_RECS_PER_HOUR < num_recs_to_play)
-	num_recs_to_play = num_replay_hours * HISTORY_RECS_PER_HOUR;
-
-    /* ****************************************************************************************
-     * No matter how many recs we replay, we want to do it over the course of a minute or less.
-     * In the future, we may allow the user to change this, but for now, it's a minute, which
-     * means that we want to make our sleep interval a function of the number of recs that we
-     * are displaying.
-     * 5 frames per seconds is one day (now 288 recs). usleep with 1000000 is one second
-     * *****************************************************************************************/
-    long int interval;
-
-    if (num_recs_to_play < 60) {
-	interval = SLOWEST_WE_GO;
-    } else {
-	if (test_mode == TRUE)
-	    interval = 500000l / (long int)(num_recs_to_play / 60);	// go fast for test
-	else
-	    interval = 1000000l / (long int)(num_recs_to_play / 60);
+    // as many airports as the file has, the led count decides which ones we light
+    numAirportsInFile = 0;
+    while (1) {
+	iEOF = fscanf(fAirports, "%4s %d", stAirport.sAirportCode, &stAirport.iLedNo);
+	if(iEOF < 2) { // end of file
+		break;
+	}
+	stAirport.cCond = 'E';
+	stAirport.tObserved = 0;
+	if (stAirport.iLedNo < 0 || stAirport.iLedNo >= led_count) {
+	    printf("%s is on led %d, past our %d leds\n", stAirport.sAirportCode, stAirport.iLedNo, led_count);
+	    continue;   // don't handle airports past our number of leds
+	}
+	if (numAirportsInFile == maxAirports) {
+	    maxAirports = maxAirports ? maxAirports * 2 : 64;
+	    struct stAirport *pGrown = realloc(stAirports, sizeof(struct stAirport) * maxAirports);
+	    if (pGrown == NULL)
+		break;
+	    stAirports = pGrown;
+	}
+	stAirports[numAirportsInFile++] = stAirport;
     }
 
-    if (interval > SLOWEST_WE_GO)
-	interval = SLOWEST_WE_GO;
-
-    char sPeriodicData[num_recs_to_play][REC_LEN+1]; // the length of a record plus null term
-    memset(sPeriodicData, 0, num_recs_to_play*(REC_LEN+1));
-    char sSumRec[4];
+    fclose(fAirports);
 
-    int iColorIndex;
+    sLastRecord = malloc(led_count);
+    if (sLastRecord == NULL)
+	return 0;
 
-    // loop thru the first num_recs_to_play in file and read into memory in reverse order
-    for (int i = 1; i < num_recs_to_play+1; i++) {		//1-based makes more sense when starting at the end
-	if (running == 0)
-	    break;
-	if (fread(sPeriodicData[num_recs_to_play-i], REC_LEN, 1, fDay) < 1)
-	    break; 	// end of file
-	sPeriodicData[num_recs_to_play-i][REC_LEN] = 0;
+    if (!StationTableBuild(&stationTable, stAirports, numAirportsInFile)
+	|| !MetarIndexInit(&wxIndex, &stationTable)) {
+	fprintf(stderr, "can't index the airport list\n");
+	return 0;
     }
-    fclose(fDay);
 
-    for (int i = 0; i < num_recs_to_play; i++) {		//loop through all metar map recs
-	if (running == 0)
-	    break;
-	printf(".");
-	fflush(stdout);
-	for (int j = 0; j < LED_COUNT; j++) {
-    	    char cCond = sPeriodicData[i][(j*3)+2];
-	    switch(cCond) {
-		case 'I':
-		    iColorIndex = IFR;
-		    break;
-	        case 'V':
-		    iColorIndex = VFR;
-		    break;
-	        case 'M':
-		    iColorIndex = MVFR;
-		    break;
-		case 'L':
-		    iColorIndex = LIFR;
-		    break;
-		default:
-		    iColorIndex = NO_AIRPORT_DATA;
-		    break;
-		}
-	    SetMatrixPixel(j, iColorIndex);
-	}
-
-	matrix_render();
-	usleep(interval);
-    }
+    return numAirportsInFile;
+}
 
-    // blink the lights so we'll know that replay is done
-    clear_ledstring();
+// the airport list, read the first time it's wanted
+int GetAirports(const struct stAirport **ppAirports)
+{
+    if (numAirportsInFile < 0 && LoadAirports() == 0)
+	return 0;
+    *ppAirports = stAirports;
+    return numAirportsInFile;
+}
 
-    usleep(1000000 / 5);  //  1/5 of a second for the blink
-    matrix_render();
+// Split our stations into requests no longer than FETCH_MAX_URL. A recorded
+// response already has its stations, that is one request and its url changes
+// every refresh.
+static int BuildBatchUrls(void)
+{
+    int maxBatches = 1;
+    size_t baseLen = strlen(wxSource.sBase);
 
-    printf("X\n");
+    if (wxSource.type == SOURCE_HTTP) {
+	if (baseLen + sizeof(((struct stAirport *)0)->sAirportCode) + 3 > FETCH_MAX_URL) {
+	    fprintf(stderr, "weather source %s is too long\n", wx_source);
+	    return 0;
+	}
+	maxBatches = numAirportsInFile > 0 ? numAirportsInFile : 1;
+    }
+    sBatchUrls = malloc(sizeof(char *) * maxBatches);
+    if (sBatchUrls == NULL)
+	return 0;
+
+    numBatches = 0;
+    for (int i = 0; i < numAirportsInFile || numBatches == 0; i++) {
+	int isHttp = (wxSource.type == SOURCE_HTTP && i < numAirportsInFile);
+
+	if (numBatches == 0
+	    || (isHttp && strlen(sBatchUrls[numBatches-1]) + strlen(stAirports[i].sAirportCode) + 3 > FETCH_MAX_URL)) {
+	    sBatchUrls[numBatches] = malloc(FETCH_MAX_URL + 1);
+	    if (sBatchUrls[numBatches] == NULL)
+		return 0;
+	    strcpy(sBatchUrls[numBatches], wxSource.type == SOURCE_HTTP ? wxSource.sBase : "");
+	    numBatches++;
+	}
+	if (!isHttp)
+	    break;
+	strcat(sBatchUrls[numBatches-1], stAirports[i].sAirportCode);
+	strcat(sBatchUrls[numBatches-1], "%20");
+    }
+    return numBatches;
+}
 
+static void FreeBatchUrls(void)
+{
+    for (int i = 0; i < numBatches; i++)
+	free(sBatchUrls[i]);
+    free(sBatchUrls);
+    sBatchUrls = NULL;
+    numBatches = 0;
 }
 
 int LiveMetarMap(void)
 {
-    char cWxReqString[1024];
-    int iEOF;
-    struct stAirport stAirports[LED_COUNT];
-    int numAirportsInFile = 0;
-    char sSumRec[4];
-    int iColorIndex = NO_AIRPORT_DATA;
-    char sPeriodicData[REC_LEN+1]; // the length of a record plus null term
+    char sRecord[led_count]; // category for each led, this refresh's history record
 
-    memset(sPeriodicData, 0, REC_LEN+1);
+    if (numAirportsInFile < 0 && LoadAirports() == 0)
+	return 0;
 
-    FILE *fAirports = fopen("AirportList.dat", "r");
-    if(fAirports == NULL) {
-	    printf("oops. Where da file?\n");
+    if (!wxFetchReady) {
+	if (FetchSourceInit(&wxSource, wx_source) != FETCH_OK)
 	    return 0;
+	if (BuildBatchUrls() == 0 || FetchBatchInit(&wxBatch, numBatches, fetch_parallel) != FETCH_OK) {
+	    FreeBatchUrls();
+	    FetchSourceFree(&wxSource);
+	    return 0;
+	}
+	wxFetchReady = TRUE;
     }
 
-    strcpy(cWxReqString, AIRPTSTR);
+    if (wxSource.type != SOURCE_HTTP && FetchSourceUrl(&wxSource, sBatchUrls[0], FETCH_MAX_URL + 1) != FETCH_OK) {
+	fprintf(stderr, "weather source %s is too long\n", wx_source);
+	return 0;
+    }
 
-    // read the file and build the string for the call to aviation wx
-    for (int i = 0; i < LED_COUNT; i++) {
-	iEOF = fscanf(fAirports, "%4s %d",stAirports[i].sAirportCode, &stAirports[i].iLedNo);
-	if(iEOF < 0) { // end of file
-		break;
+    for (int i = 0; i < numBatches; i++)
+	printf("Passing this req %s\n", sBatchUrls[i]);
+    int iFetch = FetchBatchRun(&wxBatch, sBatchUrls);  // read all the wx data
+    FetchBatchPrintStats(&wxBatch);
+
+    metrics.refreshes++;
+    metrics.lastRefresh = time(NULL);
+    metrics.fetchBatches = numBatches;
+    metrics.fetchSecondsLast = wxBatch.tWallUs / 1e6;
+    metrics.fetchSecondsTotal += metrics.fetchSecondsLast;
+    for (int i = 0; i < numBatches; i++) {
+	metrics.fetchWireBytes += wxBatch.fetches[i].stats.iWireBytes;
+	metrics.fetchBodyBytes += wxBatch.fetches[i].stats.iBodyBytes;
+    }
+    if (iFetch == FETCH_ERROR)
+	metrics.fetchErrors++;
+    else if (iFetch == FETCH_NOT_MODIFIED)
+	metrics.fetchNotModified++;
+    double tParse = MetricsNow();
+
+    // initialize the record with all 'E's
+    memset(sRecord, 'E', led_count);
+
+    // Nothing new on the server - skip the parse and put the last picture back up,
+    // less the METARs that have gone out of date since. Without a whole last picture
+    // (a batch failed last time) the retained bodies are parsed again instead
+    time_t tNow = time(NULL);
+    int skipParse = (iFetch == FETCH_NOT_MODIFIED && haveLastRecord);
+    if (skipParse) {
+	printf("weather not modified since last refresh\n");
+	memcpy(sRecord, sLastRecord, led_count);
+	for (int i = 0; i < numAirportsInFile; i++) {
+	    if (stAirports[i].cCond == 'E' || tNow - stAirports[i].tObserved <= stale_minutes * 60LL)
+		continue;
+	    printf("%s METAR data out of date %lld seconds\n", stAirports[i].sAirportCode,
+		   (long long)(tNow - stAirports[i].tObserved));
+	    metrics.stationsFound--;
+	    metrics.stationsStale++;
+	    stAirports[i].cCond = 'E';
+	    sRecord[stAirports[i].iLedNo] = 'E';
 	}
-	strcat(cWxReqString, stAirports[i].sAirportCode);
-	strcat(cWxReqString, "%20");
-
-	numAirportsInFile++;
+	for (int j = 0; j < led_count; j++)
+	    SetMatrixCategory(j, sRecord[j]);
     }
 
-    fclose(fAirports);
-
-    printf("Passing this req %s\n", cWxReqString);
-    struct MemoryStruct wxChunk = getData(cWxReqString);  // read all the wx data
-
-    // initialize the sPeriodicData rec with all 'E's
-    memset(sPeriodicData, 0, REC_LEN);
-    for (int i = 0; i < LED_COUNT; i++) {
-	sprintf(sSumRec, "%02d%c", i, 'E');
-	strcat(sPeriodicData, sSumRec);
+    // one pass over each response to find every airport's record. A batch that
+    // wasn't modified goes in from what it sent last time, one that failed
+    // leaves its airports showing no data
+    int numFailed = 0;
+    if (!skipParse) {
+	metrics.stationsFound = metrics.stationsMissing = metrics.stationsStale = 0;
+	MetarIndexReset(&wxIndex);
+	for (int i = 0; i < numBatches; i++) {
+	    if (wxBatch.results[i] == FETCH_ERROR || wxBatch.bodies[i].memory == NULL)
+		numFailed++;
+	    else
+		MetarIndexAdd(&wxIndex, wxBatch.bodies[i].memory, wxBatch.bodies[i].size);
+	}
+	printf("%d METARs in %d responses, %d for our airports\n", wxIndex.numRecords,
+	       numBatches - numFailed, wxIndex.numMatched);
     }
 
     // Loop thru the airports, read the wx, light the LEDs and build daily periodic rec
-    for (int i = 0; i < numAirportsInFile; i++) {
-	if (stAirports[i].iLedNo >= width) {
-	    continue;   // don't handle airports past our number of leds
-	}
-
-	char cCond = ParseTheData(stAirports[i].sAirportCode, wxChunk);
-	switch(cCond) {
-	    case 'I':
-		iColorIndex = IFR;
-		break;
-
-	    case 'V':
-		iColorIndex = VFR;
-		break;
-
-	    case 'M':
-		iColorIndex = MVFR;
-		break;
-
-	    case 'L':
-		iColorIndex = LIFR;
-		break;
-
-	    default:
-		iColorIndex = NO_AIRPORT_DATA;
-		break;
-	    }
-
-	SetMatrixPixel(stAirports[i].iLedNo,iColorIndex);
-	sprintf(sSumRec, "%02d%c", stAirports[i].iLedNo, cCond);
-	memcpy(&sPeriodicData[stAirports[i].iLedNo*3], sSumRec, strlen(sSumRec));
-	sPeriodicData[REC_LEN-1] = '\n';
-	sPeriodicData[REC_LEN] = 0;
+    for (int i = 0; i < numAirportsInFile && !skipParse; i++) {
+	const struct MetarRecord *pRec = MetarIndexFind(&wxIndex, stAirports[i].sAirportCode);
+	char cCond = ParseTheData(stAirports[i].sAirportCode, pRec, tNow);
+	SetMatrixCategory(stAirports[i].iLedNo, cCond);
+	sRecord[stAirports[i].iLedNo] = cCond;
+	stAirports[i].cCond = cCond;
+	if (pRec == NULL || !ObsTimeToEpoch(&pRec->observation_time, &stAirports[i].tObserved))
+	    stAirports[i].tObserved = 0;
     }
 
-    FILE *fNewDay = fopen("newday.dat", "w");
-    fprintf(fNewDay, "%s", sPeriodicData);
-
-    char historyFileName[16];
-    if (test_mode == TRUE)
-	strcpy(historyFileName, "daytest.dat");
-    else
-	strcpy(historyFileName, "day.dat");
-
-    // read the history file (day.dat) and append all of the recs to our new file until max recs is reached
-    FILE *fDay = fopen(historyFileName, "r");
-    if(fDay != NULL) {
-	int numrecs = NumRecsInHistory(fDay);
-	if ( numrecs >= MAX_HISTORY_RECS) {
-	    numrecs = MAX_HISTORY_RECS -1;
-	    printf("history file full - roll one off so save %d\n", numrecs);
-	}
-	for (int i = 0; i < numrecs; i++) {
-	    if (fread(&sPeriodicData, REC_LEN, 1, fDay) < 1)
-		break; 	// end of file
-	    sPeriodicData[REC_LEN] = 0;
-	    fprintf(fNewDay, "%s", sPeriodicData);
-	}
-	fclose(fDay);
-    }
-    fclose(fNewDay);
+    metrics.parseSecondsLast = MetricsNow() - tParse;
+    metrics.parseSecondsTotal += metrics.parseSecondsLast;
 
-    // copy newday to day
-    if (rename("newday.dat", historyFileName) != 0) { // error returned
-	fprintf(stderr, "can't copy over the newday file\n");
-	printf("can't copy over the newday file\n");
+    if (!skipParse && iFetch != FETCH_ERROR) {
+	memcpy(sLastRecord, sRecord, led_count);
+	haveLastRecord = (numFailed == 0);	// only a whole picture can stand in for the next one
     }
 
-    free (wxChunk.memory);
+    // add this refresh to the history ring - one slot and the header get written
+    if (!historyReady)
+	historyReady = HistoryOpen(&liveHistory, HistoryFileName(), HistorySegmentsFor(led_count), led_count, TRUE);
+    if (historyReady) {
+	double tHistory = MetricsNow();
+	uint64_t bytesBefore = liveHistory.bytesWritten;
+	HistoryAppend(&liveHistory, sRecord, tNow);
+	metrics.historySecondsLast = MetricsNow() - tHistory;
+	metrics.historySecondsTotal += metrics.historySecondsLast;
+	metrics.historyBytes += liveHistory.bytesWritten - bytesBefore;
+
+	// and whatever the column store hasn't got, usually just this one
+	if (!columnsReady)
+	    columnsReady = ColumnsOpen(&liveColumns, ColumnsFileName(), TRUE);
+	if (columnsReady)
+	    ColumnsSync(&liveColumns, &liveHistory, stAirports, numAirportsInFile);
+    } else
+	fprintf(stderr, "can't record history this time\n");
+
+    return 1;
 }
 
-
+void FinishLiveMetarMap(void)
+{
+    if (wxFetchReady) {
+	FetchBatchCleanup(&wxBatch);
+	FetchSourceFree(&wxSource);
+	FreeBatchUrls();
+    }
+    wxFetchReady = FALSE;
+    if (historyReady)
+	HistoryClose(&liveHistory);
+    historyReady = FALSE;
+    if (columnsReady)
+	ColumnsClose(&liveColumns);
+    columnsReady = FALSE;
+    MetarIndexFree(&wxIndex);
+    StationTableFree(&stationTable);
+    free(stAirports);
+    free(sLastRecord);
+    stAirports = NULL;
+    sLastRecord = NULL;
+    haveLastRecord = FALSE;
+    numAirportsInFile = -1;
+}
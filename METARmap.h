@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "ws2811.h"
 
 #define AIRPTSTR   "https://www.aviationweather.gov/adds/dataserver_current/httpparam?dataSource=metars&requestType=retrieve&format=xml&hoursBeforeNow=5&mostRecentForEachStation=true&stationString="
@@ -21,14 +23,18 @@
 #define MVFR 5
 #define NO_AIRPORT_DATA 2
 
- // these 3 are for replay and work together
-#define HISTORY_RECS_PER_DAY 288
-#define HISTORY_RECS_PER_HOUR 12
-#define MAX_REPLAY_DAYS 10    
+ // these are for replay and work together
+#define MAX_REPLAY_DAYS 180	// what fits in the packed history ring, see history.h
 #define SLOWEST_WE_GO (1000000 / 5)  //  1/5 of a second
-#define MAX_HISTORY_RECS HISTORY_RECS_PER_DAY * MAX_REPLAY_DAYS
+#define MAX_SMOOTH_FRAMES 30	// in-between frames per record when fading
+
+#define REC_LEN (LED_COUNT*3)+1	// legacy day.dat: 3 for each led plus '\n' 
 
-#define REC_LEN (LED_COUNT*3)+1	// 3 for each led plus '\n' 
+// daemon mode: one process, refreshing on an internal timer
+#define REFRESH_INTERVAL_SECS 300	// same 5 minutes the crontab used
+#define STALE_MINUTES 90		// a METAR older than this shows as no data
+#define NIGHT_START_HOUR 21		// local time, lights off at 21:00 with no Brightness.dat
+#define NIGHT_END_HOUR 6		// and back on at 06:00
 
 #define SEM_PERMISSIONS S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH
 extern const char *semName;
@@ -37,8 +43,15 @@ extern int num_replay_hours;
 extern int clear_on_exit;
 extern int replay_mode;
 extern int night_mode;
+extern int daemon_mode;
+extern int smooth_frames;
+extern time_t replay_from;	// 0 for the last num_replay_hours
+extern time_t replay_to;	// 0 for up to the newest record
 extern int test_mode;
 extern int free_the_semaphore;
+extern char wx_source[1024];
+extern int fetch_parallel;
+extern int stale_minutes;
 extern volatile uint8_t running;
 extern ws2811_led_t dotcolors[];
 
@@ -47,6 +60,8 @@ extern ws2811_led_t dotcolors[];
 struct stAirport {
     char sAirportCode[5];
     int iLedNo;
+    char cCond;			// category from the last refresh, 'E' until there is one
+    time_t tObserved;		// when that was observed, 0 if we don't know
 };
 
 // This structure is used by GetData 
@@ -55,10 +70,13 @@ struct MemoryStruct {
   size_t size;
 };
 
-struct MemoryStruct getData(char *url);
-int ReadWeatherData(char *cWxString);
-char ParseTheData(char *sAirportCode, struct MemoryStruct sAirportData);
-int NumRecsInHistory(FILE *fDay);
+struct MetarRecord;
+struct TextView;
+int ObsTimeToEpoch(const struct TextView *pObsTime, time_t *pEpoch);
+char ParseTheData(const char *sAirportCode, const struct MetarRecord *pRec, time_t tNow);
+int LoadAirports(void);
+int GetAirports(const struct stAirport **ppAirports);
 void Replay(void);
 int LiveMetarMap(void);
+void FinishLiveMetarMap(void);
 
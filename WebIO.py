@@ -1,10 +1,28 @@
 import RPi.GPIO as GPIO
 import os
+import socket
 import subprocess
 from http.server import BaseHTTPRequestHandler, HTTPServer
 
 host_name = '10.10.10.99' # my Raspberry Pi IP add ress 
 host_port = 8000
+control_socket = '/run/metarmap.sock' # where METARmap -D takes commands
+
+def send_command(command):
+	""" Hand a command to the running METARmap -D. False if it isn't running
+	    as a daemon, so the caller can fall back on the scripts
+	"""
+	try:
+		s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		s.settimeout(2)
+		s.connect(control_socket)
+		s.sendall((command + '\n').encode('utf-8'))
+		reply = s.makefile().readline().strip()
+		s.close()
+	except OSError:
+		return False
+	print("{} -> {}".format(command, reply))
+	return reply.startswith('ok')
 
 class MyServer(BaseHTTPRequestHandler):
 	""" A special implementation of BaseHTTPRequestHander for reading data from
@@ -32,10 +50,11 @@ class MyServer(BaseHTTPRequestHandler):
 			<h1>Welcome to Fahle home Automation page</h1>
 			<p>Current GPU temperature is {}</p>
 			<form action="/" method="POST">
-				<label style="50px;width:200px;font-size:large" for="hours">Hours to replay (1 to 240):</label>
-				<input style="height:50px;width:200px;font-size:large" type="number" id="hours" name="hours" min="1" max="240">
+				<label style="50px;width:200px;font-size:large" for="hours">Hours to replay (1 to 4320):</label>
+				<input style="height:50px;width:200px;font-size:large" type="number" id="hours" name="hours" min="1" max="4320">
 				<input style="height:50px;width:200px;font-size:large" type="submit" name="submit" value="Ok">
 				<input style="height:50px;width:200px;font-size:large" type="submit" name="submit" value="Clear">
+				<input style="height:50px;width:200px;font-size:large" type="submit" name="submit" value="On">
 			</form>
 			</body>
 			</html>
@@ -54,9 +73,14 @@ class MyServer(BaseHTTPRequestHandler):
 		hours_data = hours_data.split("=")[1] #only keep the value
 		print("Hours to repeat {}".format(hours_data)) #put out the hours so we know
 		if submit_data == 'Ok':
-			subprocess.call(['sh', './replay.sh', hours_data])
+			if not send_command('replay ' + hours_data):
+				subprocess.call(['sh', './replay.sh', hours_data])
+		elif submit_data == 'On':
+			if not send_command('on'):
+				subprocess.call(['sh', './refresh.sh'])
 		else:
-			subprocess.call(['sh', './lightsoff.sh'])
+			if not send_command('off'):
+				subprocess.call(['sh', './lightsoff.sh'])
 			
 		print("LED is {}".format(submit_data))
 		self._redirect('/') # Redirect back to the root url
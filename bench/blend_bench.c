@@ -0,0 +1,60 @@
+/**********************************************************************
+* Filename    : blend_bench.c
+* Description : How many crossfade frames a second BlendFrames can make
+*
+* make bench, then compare the numbers between boards and builds.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ws2811.h"
+#include "blend.h"
+
+#define BENCH_SECONDS 0.5
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void BenchBlend(int count)
+{
+    ws2811_led_t *from = malloc(sizeof(ws2811_led_t) * count);
+    ws2811_led_t *to = malloc(sizeof(ws2811_led_t) * count);
+    ws2811_led_t *out = malloc(sizeof(ws2811_led_t) * count);
+    uint32_t check = 0;
+    long frames = 0;
+
+    srand(count);
+    for (int i = 0; i < count; i++) {
+	from[i] = rand() & 0x00ffffff;
+	to[i] = rand() & 0x00ffffff;
+    }
+
+    double tStart = Now();
+    double tEnd;
+    do {
+	for (int k = 0; k < 64; k++, frames++) {
+	    BlendFrames(out, from, to, count, (uint32_t)(frames & (BLEND_ONE - 1)));
+	    check += out[frames % count];
+	}
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+
+    printf("blend leds=%d frames_per_sec=%.0f ns_per_led=%.2f check=%u\n", count,
+	   frames / (tEnd - tStart), (tEnd - tStart) * 1e9 / ((double)frames * count), check);
+    free(from);
+    free(to);
+    free(out);
+}
+
+int main(void)
+{
+    BenchBlend(50);
+    BenchBlend(1000);
+    return 0;
+}
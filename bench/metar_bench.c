@@ -0,0 +1,520 @@
+/**********************************************************************
+* Filename    : metar_bench.c
+* Description : The refresh and replay hot paths on synthetic data -
+*               parsing a response, writing and reading history,
+*               per station stats and sending frames
+*
+* Each bench runs in its own child so peak_rss_kb is that bench's alone.
+* One line per result, name then key=value pairs, so runs from different
+* builds and boards can be diffed or fed to a script. Everything is done
+* in a scratch directory under /tmp and the framebuffer output, so no Pi
+* is needed.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "METARmap.h"
+#include "metarindex.h"
+#include "metardecode.h"
+#include "history.h"
+#include "columns.h"
+#include "stats.h"
+#include "matrix.h"
+#include "output.h"
+#include "replay.h"
+
+#define BENCH_SECONDS 0.5
+#define BENCH_RECS_PER_DAY (24 * 3600 / REFRESH_INTERVAL_SECS)
+#define BENCH_EPOCH 1700000000	// when the made up records start, a refresh apart
+
+// what main.c would own
+int width = WIDTH;
+int height = HEIGHT;
+int led_count = LED_COUNT;
+int strip = WS2811_STRIP_RGB;
+int dma = 10;
+int gpio = 18;
+int gpio2 = 0;
+int count2 = 0;
+int invert = 0;
+int num_replay_hours = 4;
+int clear_on_exit = 0;
+int replay_mode = 0;
+time_t replay_from = 0;
+time_t replay_to = 0;
+int night_mode = 0;
+int daemon_mode = 0;
+int smooth_frames = 0;
+int test_mode = 0;
+int free_the_semaphore = 0;
+int stale_minutes = STALE_MINUTES;
+char wx_source[1024] = AIRPTSTR;
+int fetch_parallel = 4;
+volatile uint8_t running = 1;
+
+static const char sCategories[] = "VVVVVMMIIL";
+static FILE *fResults;	// stdout from before the library's chatter was sent away
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long PeakRssKb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// frames go to the framebuffer, replay compiles against the matrix it sets up
+static int StartOutput(int numLeds)
+{
+    width = numLeds;
+    height = 1;
+    led_count = numLeds;
+    output = &framebuffer_output;
+    return init_led_string() == WS2811_SUCCESS;
+}
+
+// 4 letter codes K + base 26, enough for 17576 stations
+static void StationCode(int i, char *sCode)
+{
+    sCode[0] = 'K';
+    sCode[1] = 'A' + (i / (26 * 26)) % 26;
+    sCode[2] = 'A' + (i / 26) % 26;
+    sCode[3] = 'A' + i % 26;
+    sCode[4] = '\0';
+}
+
+/*
+ * A response shaped like the aviation wx one, observed a few minutes ago so
+ * it all counts as current. One in four has no flight_category so the raw
+ * text gets looked at too.
+ */
+static char *MakeResponse(int numStations, size_t *pLen)
+{
+    static const char *sRaw[] = {
+	"%s 121853Z 27008KT 10SM FEW250 23/09 A3002 RMK AO2 SLP165 T02330089",
+	"%s 121853Z 18012G20KT 4SM BR OVC015 14/12 A2987 RMK AO2 SLP112",
+	"%s 121853Z 00000KT 1/2SM FG VV002 08/08 A3011 RMK AO2",
+	"%s 121853Z 22006KT 2SM -RA BKN008 OVC012 11/10 A2995 RMK AO2",
+    };
+    size_t cap = (size_t)numStations * 1200 + 4096;
+    char *sData = malloc(cap);
+    size_t len = 0;
+    char sTime[32];
+    time_t tObs = time(NULL) - 10 * 60;
+    struct tm stObs;
+
+    gmtime_r(&tObs, &stObs);
+    strftime(sTime, sizeof(sTime), "%Y-%m-%dT%H:%M:%SZ", &stObs);
+    srand(numStations);
+
+    len += snprintf(sData + len, cap - len,
+		    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<response version=\"1.2\">\n"
+		    "<request_index>1</request_index>\n<data num_results=\"%d\">\n", numStations);
+    for (int i = 0; i < numStations; i++) {
+	char sCode[5];
+	char sText[128];
+	int k = rand() % 4;
+
+	StationCode(i, sCode);
+	snprintf(sText, sizeof(sText), sRaw[k], sCode);
+	len += snprintf(sData + len, cap - len,
+			"<METAR>\n<raw_text>%s</raw_text>\n<station_id>%s</station_id>\n"
+			"<observation_time>%s</observation_time>\n<latitude>41.5</latitude>\n"
+			"<longitude>-87.8</longitude>\n<temp_c>23.3</temp_c>\n<dewpoint_c>8.9</dewpoint_c>\n"
+			"<wind_dir_degrees>270</wind_dir_degrees>\n<wind_speed_kt>8</wind_speed_kt>\n"
+			"<visibility_statute_mi>10.0</visibility_statute_mi>\n<altim_in_hg>30.02</altim_in_hg>\n"
+			"<sea_level_pressure_mb>1016.5</sea_level_pressure_mb>\n"
+			"<quality_control_flags>\n<auto_station>TRUE</auto_station>\n</quality_control_flags>\n"
+			"<sky_condition sky_cover=\"FEW\" cloud_base_ft_agl=\"25000\" />\n",
+			sText, sCode, sTime);
+	if (k != 3)
+	    len += snprintf(sData + len, cap - len, "<flight_category>%s</flight_category>\n",
+			    k == 0 ? "VFR" : k == 1 ? "MVFR" : "LIFR");
+	len += snprintf(sData + len, cap - len,
+			"<metar_type>METAR</metar_type>\n<elevation_m>190.0</elevation_m>\n</METAR>\n");
+    }
+    len += snprintf(sData + len, cap - len, "</data>\n</response>\n");
+    *pLen = len;
+    return sData;
+}
+
+// index the whole response then categorize every station, as LiveMetarMap does
+static void BenchParse(int numStations)
+{
+    struct stAirport *airports = malloc(sizeof(struct stAirport) * numStations);
+    struct StationTable table;
+    struct MetarIndex index;
+    size_t len;
+    char *sData = MakeResponse(numStations, &len);
+    long passes = 0;
+    uint32_t check = 0;
+
+    for (int i = 0; i < numStations; i++) {
+	StationCode(i, airports[i].sAirportCode);
+	airports[i].iLedNo = i;
+    }
+    if (!StationTableBuild(&table, airports, numStations) || !MetarIndexInit(&index, &table)) {
+	fprintf(fResults, "parse stations=%d error=setup\n", numStations);
+	return;
+    }
+
+    double tStart = Now();
+    double tEnd;
+    do {
+	time_t tNow = time(NULL);
+	MetarIndexBuild(&index, sData, len);
+	for (int i = 0; i < numStations; i++)
+	    check += ParseTheData(airports[i].sAirportCode, MetarIndexFind(&index, airports[i].sAirportCode), tNow);
+	passes++;
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+
+    double secs = tEnd - tStart;
+    fprintf(fResults, "parse stations=%d bytes=%zu matched=%d ns_per_station=%.1f mb_per_sec=%.1f peak_rss_kb=%ld check=%u\n",
+	   numStations, len, index.numMatched, secs * 1e9 / ((double)passes * numStations),
+	   (double)passes * len / secs / 1e6, PeakRssKb(), check);
+
+    MetarIndexFree(&index);
+    StationTableFree(&table);
+    free(sData);
+    free(airports);
+}
+
+// observation_time to epoch seconds, the freshness check's share of the parse
+static void BenchObsTime(int numTimes)
+{
+    char (*sTimes)[24] = malloc(sizeof(*sTimes) * numTimes);
+    time_t tBase = time(NULL);
+    long long check = 0;
+    long passes = 0;
+
+    for (int i = 0; i < numTimes; i++) {
+	time_t t = tBase - i * 37;
+	struct tm stObs;
+	gmtime_r(&t, &stObs);
+	strftime(sTimes[i], sizeof(sTimes[i]), "%Y-%m-%dT%H:%M:%SZ", &stObs);
+    }
+
+    double tStart = Now();
+    double tEnd;
+    do {
+	for (int i = 0; i < numTimes; i++) {
+	    struct TextView view = { sTimes[i], 20 };
+	    time_t t;
+	    if (ObsTimeToEpoch(&view, &t))
+		check += t;
+	}
+	passes++;
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+
+    fprintf(fResults, "obstime timestamps=%d ns_per_timestamp=%.2f peak_rss_kb=%ld check=%lld\n", numTimes,
+	    (tEnd - tStart) * 1e9 / ((double)passes * numTimes), PeakRssKb(), check);
+    free(sTimes);
+}
+
+// raw_text straight to a category, what re-categorizing an archive of METARs costs
+static void BenchDecode(int numReports)
+{
+    static const char *sRaw[] = {
+	"KAAA 121853Z 27008KT 10SM FEW250 23/09 A3002 RMK AO2 SLP165 T02330089",
+	"KAAB 121853Z 18012G20KT 4SM BR OVC015 14/12 A2987 RMK AO2 SLP112",
+	"KAAC 121853Z 00000KT 1/2SM FG VV002 08/08 A3011 RMK AO2",
+	"KAAD 121853Z AUTO 22006KT 1 1/2SM -RA SCT004 BKN008 OVC012 11/10 A2995 RMK AO2",
+	"KAAE 121853Z VRB03KT M1/4SM FG VV/// 06/06 A3020 RMK AO2",
+	"EGLL 121850Z 24010KT 9999 FEW030 BKN045 15/08 Q1015 NOSIG",
+    };
+    const int numRaw = sizeof(sRaw) / sizeof(sRaw[0]);
+    size_t lens[sizeof(sRaw) / sizeof(sRaw[0])];
+    long passes = 0;
+    uint32_t check = 0;
+    size_t bytes = 0;
+
+    for (int k = 0; k < numRaw; k++)
+	lens[k] = strlen(sRaw[k]);
+
+    double tStart = Now();
+    double tEnd;
+    do {
+	for (int i = 0; i < numReports; i++) {
+	    struct MetarObs obs;
+	    int k = i % numRaw;
+	    if (MetarDecode(sRaw[k], lens[k], &obs))
+		check += MetarCategory(&obs);
+	    bytes += lens[k];
+	}
+	passes++;
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+
+    double secs = tEnd - tStart;
+    fprintf(fResults, "decode metars=%d ns_per_metar=%.1f metars_per_sec=%.0f mb_per_sec=%.1f peak_rss_kb=%ld check=%u\n",
+	    numReports, secs * 1e9 / ((double)passes * numReports), (double)passes * numReports / secs,
+	    bytes / secs / 1e6, PeakRssKb(), check);
+}
+
+/*
+ * numDays of 5 minute records, a few leds changing category each time the way
+ * the weather does. sRecs is numRecs records of ledCount, oldest first.
+ */
+static char *MakeRecords(int numRecs, int ledCount)
+{
+    char *sRecs = malloc((size_t)numRecs * ledCount);
+
+    srand(numRecs);
+    for (int j = 0; j < ledCount; j++)
+	sRecs[j] = sCategories[rand() % 10];
+    for (int i = 1; i < numRecs; i++) {
+	char *sRecord = sRecs + (size_t)i * ledCount;
+	memcpy(sRecord, sRecord - ledCount, ledCount);
+	for (int k = rand() % 4; k > 0; k--)
+	    sRecord[rand() % ledCount] = rand() % 20 ? sCategories[rand() % 10] : 'E';
+    }
+    return sRecs;
+}
+
+// the old day.dat text, newest first, like day_test.dat
+static size_t WriteLegacyText(const char *fileName, const char *sRecs, int numRecs)
+{
+    FILE *f = fopen(fileName, "w");
+    size_t bytes = 0;
+
+    for (int i = numRecs - 1; i >= 0; i--) {
+	for (int j = 0; j < LED_COUNT; j++)
+	    bytes += fprintf(f, "%02d%c", j, sRecs[(size_t)i * LED_COUNT + j]);
+	bytes += fprintf(f, "\n");
+    }
+    fclose(f);
+    return bytes;
+}
+
+static void BenchHistory(int numDays)
+{
+    int numRecs = numDays * BENCH_RECS_PER_DAY;
+    char *sRecs = MakeRecords(numRecs, LED_COUNT);
+    struct History h;
+    struct HistoryCursor c;
+    struct FrameWindow w;
+    double tStart;
+    double secs;
+    uint32_t check = 0;
+
+    // the one time day.dat conversion
+    size_t textBytes = WriteLegacyText(LEGACY_HISTORY_FILE, sRecs, numRecs);
+    unlink(HISTORY_FILE);
+    tStart = Now();
+    HistoryOpen(&h, HISTORY_FILE, HistorySegmentsFor(LED_COUNT), LED_COUNT, TRUE);
+    secs = Now() - tStart;
+    fprintf(fResults, "history_import days=%d records=%d records_per_sec=%.0f mb_per_sec=%.1f peak_rss_kb=%ld\n",
+	   numDays, numRecs, numRecs / secs, textBytes / secs / 1e6, PeakRssKb());
+    unlink(LEGACY_HISTORY_FILE);
+
+    // a refresh's worth at a time, the way LiveMetarMap appends. Each append
+    // is synced, so this one stops at BENCH_SECONDS instead of doing every day
+    struct History live;
+    int numAppended = 0;
+    HistoryOpen(&live, "append.ring", HistorySegmentsFor(LED_COUNT), LED_COUNT, TRUE);
+    tStart = Now();
+    do {
+	for (int k = 0; k < 16 && numAppended < numRecs; k++, numAppended++)
+	    HistoryAppend(&live, sRecs + (size_t)numAppended * LED_COUNT,
+			  BENCH_EPOCH + (time_t)numAppended * REFRESH_INTERVAL_SECS);
+	secs = Now() - tStart;
+    } while (secs < BENCH_SECONDS && numAppended < numRecs);
+    fprintf(fResults, "history_append days=%d records=%d records_per_sec=%.0f us_per_record=%.2f peak_rss_kb=%ld\n",
+	   numDays, numAppended, numAppended / secs, secs * 1e6 / numAppended, PeakRssKb());
+    HistoryClose(&live);
+    unlink("append.ring");
+
+    // everything the ring still has, oldest first, as Replay reads it
+    int numKept = HistoryCount(&h);
+    tStart = Now();
+    HistoryCursorInit(&c, &h);
+    HistoryCursorSeek(&c, numKept - 1);
+    for (const char *sRecord; (sRecord = HistoryCursorNext(&c)) != NULL; )
+	check += sRecord[check % LED_COUNT];
+    HistoryCursorFree(&c);
+    secs = Now() - tStart;
+    fprintf(fResults, "history_decode days=%d records=%d records_per_sec=%.0f mb_per_sec=%.1f peak_rss_kb=%ld check=%u\n",
+	   numDays, numKept, numKept / secs, (double)numKept * LED_COUNT / secs / 1e6, PeakRssKb(), check);
+
+    // and compiled into frames, from the oldest record's time to the newest
+    int numFrames = 0;
+    time_t tFirst, tLast;
+    HistoryTimeRange(&h, &tFirst, &tLast);
+    int framesLeft = (int)((tLast - tFirst) / REPLAY_STEP_SECS) + 1;
+    StartOutput(LED_COUNT);
+    FrameWindowInit(&w, LED_COUNT);
+    tStart = Now();
+    HistoryCursorInit(&c, &h);
+    FrameWindowStart(&w, &c, tFirst);
+    for (int n; (n = FrameWindowCompile(&w, framesLeft)) > 0; framesLeft -= n)
+	numFrames += n;
+    HistoryCursorFree(&c);
+    secs = Now() - tStart;
+    fprintf(fResults, "replay_compile days=%d records=%d records_per_sec=%.0f peak_rss_kb=%ld\n",
+	   numDays, numFrames, numFrames / secs, PeakRssKb());
+    FrameWindowFree(&w);
+    finish_led_string();
+
+    HistoryClose(&h);
+    unlink(HISTORY_FILE);
+    free(sRecs);
+}
+
+// per station stats over years of records in the column store
+static void BenchStats(int numYears)
+{
+    int numRecs = numYears * 365 * BENCH_RECS_PER_DAY;
+    char *sRecs = MakeRecords(BENCH_RECS_PER_DAY * 30, LED_COUNT);	// a month, over and over
+    struct stAirport airports[LED_COUNT];
+    struct Columns c;
+    struct StationStats *stats;
+    uint64_t check = 0;
+    long passes = 0;
+
+    for (int i = 0; i < LED_COUNT; i++) {
+	StationCode(i, airports[i].sAirportCode);
+	airports[i].iLedNo = i;
+    }
+    unlink(COLUMNS_FILE);
+    ColumnsOpen(&c, COLUMNS_FILE, TRUE);
+    double tStart = Now();
+    for (int i = 0; i < numRecs; i++)
+	ColumnsAppend(&c, sRecs + (size_t)(i % (BENCH_RECS_PER_DAY * 30)) * LED_COUNT, LED_COUNT,
+		      BENCH_EPOCH + (time_t)i * REFRESH_INTERVAL_SECS, airports, LED_COUNT);
+    double secs = Now() - tStart;
+    fprintf(fResults, "columns_append years=%d records=%d records_per_sec=%.0f peak_rss_kb=%ld\n",
+	    numYears, numRecs, numRecs / secs, PeakRssKb());
+    ColumnsClose(&c);
+
+    ColumnsOpen(&c, COLUMNS_FILE, FALSE);
+    tStart = Now();
+    double tEnd;
+    do {
+	int numStats = StatsScan(&c, 0, 0, NULL, 0, &stats);
+	for (int i = 0; i < numStats; i++)
+	    check += stats[i].changes + stats[i].counts[HCAT_IFR - 1] + stats[i].bestLast - stats[i].bestFirst;
+	free(stats);
+	passes++;
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+    secs = (tEnd - tStart) / passes;
+    fprintf(fResults, "stats_scan years=%d stations=%d ms_per_scan=%.2f mb_per_sec=%.0f peak_rss_kb=%ld check=%llu\n",
+	    numYears, LED_COUNT, secs * 1000, (double)numRecs * LED_COUNT / secs / 1e6, PeakRssKb(),
+	    (unsigned long long)(check / passes));
+    ColumnsClose(&c);
+    unlink(COLUMNS_FILE);
+    free(sRecs);
+}
+
+// compiled replay frames through the render path into the framebuffer
+static void BenchRender(int numLeds)
+{
+    int numRecs = BENCH_RECS_PER_DAY;
+    char *sRecs = MakeRecords(numRecs, numLeds);
+    struct History h;
+    struct HistoryCursor c;
+    struct FrameWindow w;
+    long frames = 0;
+
+    if (!StartOutput(numLeds)) {
+	fprintf(fResults, "render leds=%d error=init\n", numLeds);
+	return;
+    }
+
+    unlink(HISTORY_FILE);
+    HistoryOpen(&h, HISTORY_FILE, HistorySegmentsFor(numLeds), numLeds, TRUE);
+    for (int i = 0; i < numRecs; i++)
+	HistoryAppend(&h, sRecs + (size_t)i * numLeds, BENCH_EPOCH + (time_t)i * REFRESH_INTERVAL_SECS);
+    FrameWindowInit(&w, numLeds);
+    HistoryCursorInit(&c, &h);
+    FrameWindowStart(&w, &c, BENCH_EPOCH);
+    FrameWindowCompile(&w, REPLAY_WINDOW);
+
+    double tStart = Now();
+    double tEnd;
+    do {
+	for (int i = 0; i < w.numFrames; i++, frames++)
+	    matrix_render_changes(w.changes + w.firstChange[i], w.firstChange[i + 1] - w.firstChange[i]);
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+    double secs = tEnd - tStart;
+
+    // the same frames with the whole matrix copied out each time, for comparison
+    long fullFrames = 0;
+    tStart = Now();
+    do {
+	for (int i = 0; i < w.numFrames; i++, fullFrames++) {
+	    matrix_set_changes(w.changes + w.firstChange[i], w.firstChange[i + 1] - w.firstChange[i]);
+	    matrix_mark_dirty();
+	    matrix_render();
+	}
+	tEnd = Now();
+    } while (tEnd - tStart < BENCH_SECONDS);
+
+    fprintf(fResults, "render leds=%d frames_per_sec=%.0f full_frames_per_sec=%.0f peak_rss_kb=%ld\n",
+	   numLeds, frames / secs, fullFrames / (tEnd - tStart), PeakRssKb());
+
+    HistoryCursorFree(&c);
+    FrameWindowFree(&w);
+    HistoryClose(&h);
+    unlink(HISTORY_FILE);
+    free(sRecs);
+    matrix_clear();
+    finish_led_string();
+}
+
+// run one bench in a child of its own and wait for it
+static void Run(void (*bench)(int), int arg)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+	fResults = fdopen(dup(STDOUT_FILENO), "w");
+	if (fResults == NULL || freopen("/dev/null", "w", stdout) == NULL)
+	    _exit(1);
+	bench(arg);
+	fclose(fResults);
+	_exit(0);
+    }
+    if (pid > 0)
+	waitpid(pid, NULL, 0);
+}
+
+int main(void)
+{
+    char sDir[] = "/tmp/metar_bench.XXXXXX";
+
+    if (mkdtemp(sDir) == NULL || chdir(sDir) != 0) {
+	perror(sDir);
+	return 1;
+    }
+
+    Run(BenchParse, 50);
+    Run(BenchParse, 1000);
+    Run(BenchParse, 10000);
+    Run(BenchObsTime, 10000);
+    Run(BenchDecode, 10000);
+    Run(BenchHistory, 1);
+    Run(BenchHistory, 30);
+    Run(BenchHistory, MAX_REPLAY_DAYS);
+    Run(BenchStats, 3);
+    Run(BenchRender, LED_COUNT);
+    Run(BenchRender, 1000);
+
+    if (chdir("/") == 0)
+	rmdir(sDir);
+    return 0;
+}
@@ -0,0 +1,25 @@
+/**********************************************************************
+* Filename    : blend.c
+* Description : Fixed point crossfade between two led frames
+*
+* Two 8 bit channels ride in each 32 bit multiply (0x00ff00ff lanes), so
+* a color takes two multiplies per side and the loop has no branches -
+* the compiler can vectorize it and the Pi Zero keeps up without it.
+**********************************************************************/
+#include <stdint.h>
+
+#include "ws2811.h"
+#include "blend.h"
+
+void BlendFrames(ws2811_led_t *out, const ws2811_led_t *from, const ws2811_led_t *to, int count, uint32_t t)
+{
+    uint32_t s = BLEND_ONE - t;
+
+    for (int i = 0; i < count; i++) {
+	uint32_t f = from[i];
+	uint32_t g = to[i];
+	uint32_t rb = (((f & 0x00ff00ff) * s + (g & 0x00ff00ff) * t) >> 8) & 0x00ff00ff;
+	uint32_t wg = (((f >> 8) & 0x00ff00ff) * s + ((g >> 8) & 0x00ff00ff) * t) & 0xff00ff00;
+	out[i] = rb | wg;
+    }
+}
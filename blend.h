@@ -0,0 +1,3 @@
+#define BLEND_ONE 256	// blend position is 0 (all from) to BLEND_ONE (all to)
+
+void BlendFrames(ws2811_led_t *out, const ws2811_led_t *from, const ws2811_led_t *to, int count, uint32_t t);
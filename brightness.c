@@ -0,0 +1,181 @@
+/**********************************************************************
+* Filename    : brightness.c
+* Description : Brightness through the day, including dark at night,
+*               by clock time or relative to sunrise and sunset
+*
+* The daemon looks this up every refresh instead of cron starting a
+* process every 5 minutes all night just to keep the lights off.
+* Sunrise and sunset come from the NOAA solar calculator's approximate
+* equations, good to a minute or two, which is plenty for lights.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "METARmap.h"
+#include "brightness.h"
+
+#define DEG (M_PI / 180.0)
+
+/*
+ * Minutes after UTC midnight of sunrise (rising) or sunset on day yday
+ * (0-365) of year. FALSE if the sun doesn't rise or set that day.
+ */
+int SunEvent(int year, int yday, double lat, double lon, int rising, double *pMinutesUtc)
+{
+    int daysInYear = (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) ? 366 : 365;
+    double g = 2.0 * M_PI / daysInYear * (yday + 0.5);	// fractional year at noon, radians
+
+    double eqTime = 229.18 * (0.000075 + 0.001868 * cos(g) - 0.032077 * sin(g)
+			      - 0.014615 * cos(2 * g) - 0.040849 * sin(2 * g));
+    double decl = 0.006918 - 0.399912 * cos(g) + 0.070257 * sin(g) - 0.006758 * cos(2 * g)
+		  + 0.000907 * sin(2 * g) - 0.002697 * cos(3 * g) + 0.00148 * sin(3 * g);
+
+    // 90.833 degrees allows for refraction and the size of the sun
+    double cosHa = cos(90.833 * DEG) / (cos(lat * DEG) * cos(decl)) - tan(lat * DEG) * tan(decl);
+    if (cosHa < -1.0 || cosHa > 1.0)
+	return FALSE;
+    double ha = acos(cosHa) / DEG;
+
+    *pMinutesUtc = 720.0 - 4.0 * (lon + (rising ? ha : -ha)) - eqTime;
+    return TRUE;
+}
+
+// "21:00", "sunrise", "sunset+30", "sunrise-45"
+static int ParseWhen(const char *sWhen, struct BrightnessEntry *e)
+{
+    int h, m, n = 0;
+
+    if (sscanf(sWhen, "%d:%d%n", &h, &m, &n) == 2 && sWhen[n] == '\0') {
+	if (h < 0 || h > 23 || m < 0 || m > 59)
+	    return FALSE;
+	e->at = AT_CLOCK;
+	e->minutes = h * 60 + m;
+	return TRUE;
+    }
+
+    if (strncmp(sWhen, "sunrise", 7) == 0) {
+	e->at = AT_SUNRISE;
+	sWhen += 7;
+    } else if (strncmp(sWhen, "sunset", 6) == 0) {
+	e->at = AT_SUNSET;
+	sWhen += 6;
+    } else
+	return FALSE;
+
+    e->minutes = 0;
+    if (*sWhen == '\0')
+	return TRUE;
+    return sscanf(sWhen, "%d%n", &e->minutes, &n) == 1 && sWhen[n] == '\0';
+}
+
+int BrightnessLoad(struct BrightnessSchedule *s, const char *fileName)
+{
+    char sLine[128];
+    char sWhen[32];
+    int brightness;
+    int lineNo = 0;
+
+    memset(s, 0, sizeof(*s));
+
+    FILE *f = fopen(fileName, "r");
+    if (f == NULL) {
+	s->entries[0] = (struct BrightnessEntry){ AT_CLOCK, NIGHT_END_HOUR * 60, 255 };
+	s->entries[1] = (struct BrightnessEntry){ AT_CLOCK, NIGHT_START_HOUR * 60, 0 };
+	s->numEntries = 2;
+	return TRUE;
+    }
+
+    while (fgets(sLine, sizeof(sLine), f) != NULL) {
+	lineNo++;
+	sLine[strcspn(sLine, "#\r\n")] = '\0';
+	if (sscanf(sLine, "%31s", sWhen) != 1)
+	    continue;	// blank or just a comment
+
+	if (strcmp(sWhen, "location") == 0) {
+	    if (sscanf(sLine, "%*s %lf %lf", &s->lat, &s->lon) != 2) {
+		fprintf(stderr, "%s line %d: location wants latitude and longitude\n", fileName, lineNo);
+		continue;
+	    }
+	    s->haveLocation = TRUE;
+	    continue;
+	}
+
+	struct BrightnessEntry e;
+	if (sscanf(sLine, "%*s %d", &brightness) != 1 || brightness < 0 || brightness > 255
+	    || !ParseWhen(sWhen, &e)) {
+	    fprintf(stderr, "%s line %d: can't make sense of \"%s\"\n", fileName, lineNo, sLine);
+	    continue;
+	}
+	if (s->numEntries == BRIGHTNESS_MAX_ENTRIES) {
+	    fprintf(stderr, "%s: only the first %d entries are used\n", fileName, BRIGHTNESS_MAX_ENTRIES);
+	    break;
+	}
+	e.brightness = brightness;
+	s->entries[s->numEntries++] = e;
+    }
+    fclose(f);
+
+    for (int i = 0; i < s->numEntries; i++) {
+	if (s->entries[i].at != AT_CLOCK && !s->haveLocation) {
+	    fprintf(stderr, "%s: sunrise and sunset need a location line\n", fileName);
+	    break;
+	}
+    }
+    return s->numEntries > 0;
+}
+
+/*
+ * When an entry starts today, in minutes after local midnight. FALSE if it
+ * can't be placed - sun relative with no location, or the sun doesn't rise
+ * or set today.
+ */
+static int EntryStart(const struct BrightnessSchedule *s, const struct BrightnessEntry *e,
+		      const struct tm *stLocal, int *pMinutes)
+{
+    double sunUtc;
+
+    if (e->at == AT_CLOCK) {
+	*pMinutes = e->minutes;
+	return TRUE;
+    }
+    if (!s->haveLocation
+	|| !SunEvent(stLocal->tm_year + 1900, stLocal->tm_yday, s->lat, s->lon, e->at == AT_SUNRISE, &sunUtc))
+	return FALSE;
+
+    int m = (int)lround(sunUtc + stLocal->tm_gmtoff / 60.0) + e->minutes;
+    *pMinutes = ((m % 1440) + 1440) % 1440;
+    return TRUE;
+}
+
+// the brightness for time t: the entry that started last before it, yesterday's last if none today
+int BrightnessAt(const struct BrightnessSchedule *s, time_t t)
+{
+    struct tm stLocal;
+    int now;
+    int best = -1, bestStart = -1;	// latest start not after now
+    int last = -1, lastStart = -1;	// latest start of the day, for before the first one
+
+    localtime_r(&t, &stLocal);
+    now = stLocal.tm_hour * 60 + stLocal.tm_min;
+
+    for (int i = 0; i < s->numEntries; i++) {
+	int start;
+	if (!EntryStart(s, &s->entries[i], &stLocal, &start))
+	    continue;
+	if (start <= now && start > bestStart) {
+	    best = i;
+	    bestStart = start;
+	}
+	if (start > lastStart) {
+	    last = i;
+	    lastStart = start;
+	}
+    }
+
+    if (best < 0)
+	best = last;
+    return best < 0 ? 255 : s->entries[best].brightness;
+}
@@ -0,0 +1,39 @@
+#define BRIGHTNESS_FILE "Brightness.dat"
+#define BRIGHTNESS_MAX_ENTRIES 16
+
+// what a schedule entry's time is relative to
+#define AT_CLOCK 0		// minutes after local midnight
+#define AT_SUNRISE 1		// minutes after (or before, negative) sunrise
+#define AT_SUNSET 2
+
+/*
+ * The day as a list of "from this time on, this brightness" entries, read from
+ * Brightness.dat:
+ *
+ *   location 41.98 -87.90	needed for sunrise and sunset, degrees, east positive
+ *   sunrise-30 64
+ *   sunrise+30 255
+ *   sunset 128
+ *   21:00 0			0 is dark, refreshes and history carry on
+ *
+ * Each entry holds until the next one later in the day, the last one wraps
+ * round to the first. With no file it's 06:00 255 and 21:00 0, the old
+ * lightsoff.sh hours.
+ */
+struct BrightnessEntry {
+    int at;			// AT_CLOCK, AT_SUNRISE or AT_SUNSET
+    int minutes;
+    int brightness;		// 0-255
+};
+
+struct BrightnessSchedule {
+    int numEntries;
+    struct BrightnessEntry entries[BRIGHTNESS_MAX_ENTRIES];
+    int haveLocation;
+    double lat;
+    double lon;
+};
+
+int BrightnessLoad(struct BrightnessSchedule *s, const char *fileName);
+int BrightnessAt(const struct BrightnessSchedule *s, time_t t);
+int SunEvent(int year, int yday, double lat, double lon, int rising, double *pMinutesUtc);
@@ -0,0 +1,433 @@
+/**********************************************************************
+* Filename    : columns.c
+* Description : The history ring copied out one station per column,
+*               for the stats command
+*
+* The live refresh appends each new ring record here as well, which is
+* a time and a row of one byte per station written into the newest
+* block's tail, so a refresh dirties a few pages however many stations
+* there are. Every COLUMNS_TAIL_RECS records the tail is turned into the
+* columns, a run of that many bytes for each station. When the store is
+* missing or behind - a fresh install, an import - the records it hasn't
+* got are read back out of the ring by time.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "METARmap.h"
+#include "history.h"
+#include "columns.h"
+
+const char *ColumnsFileName(void)
+{
+    return test_mode == TRUE ? COLUMNS_TEST_FILE : COLUMNS_FILE;
+}
+
+static size_t TimesOffset(uint32_t numStations)
+{
+    return sizeof(struct ColumnsBlock) + (size_t)numStations * COLUMNS_CODE_LEN;
+}
+
+static size_t TailOffset(uint32_t blockRecs, uint32_t numStations)
+{
+    return (TimesOffset(numStations) + (size_t)blockRecs * sizeof(uint32_t) + 7) & ~(size_t)7;
+}
+
+// columns start 8 byte aligned so the scans can read them a uint64_t at a time
+static size_t DataOffset(const struct Columns *c, uint32_t numStations)
+{
+    size_t off = TailOffset(c->hdr->blockRecs, numStations) + (size_t)c->tailRecs * numStations;
+    return (off + 7) & ~(size_t)7;
+}
+
+static size_t BlockBytes(const struct Columns *c, uint32_t numStations)
+{
+    size_t bytes = DataOffset(c, numStations) + (size_t)numStations * c->hdr->blockRecs;
+    return (bytes + COLUMNS_PAGE - 1) & ~(size_t)(COLUMNS_PAGE - 1);
+}
+
+static size_t BlockOffset(const struct Columns *c, const struct ColumnsBlock *b)
+{
+    return (const uint8_t *)b - (const uint8_t *)c->hdr;
+}
+
+// NULL past the end of the map, or at a block still being set up
+static const struct ColumnsBlock *BlockAt(const struct Columns *c, size_t off)
+{
+    if (off + sizeof(struct ColumnsBlock) > c->mapLen)
+	return NULL;
+    const struct ColumnsBlock *b = (const struct ColumnsBlock *)((const uint8_t *)c->hdr + off);
+    if (b->numStations == 0 || b->numStations > COLUMNS_MAX_STATIONS
+	|| off + BlockBytes(c, b->numStations) > c->mapLen)
+	return NULL;
+    return b;
+}
+
+const struct ColumnsBlock *ColumnsFirstBlock(const struct Columns *c)
+{
+    return c->hdr->numBlocks > 0 ? BlockAt(c, COLUMNS_PAGE) : NULL;
+}
+
+const struct ColumnsBlock *ColumnsNextBlock(const struct Columns *c, const struct ColumnsBlock *b)
+{
+    return BlockAt(c, BlockOffset(c, b) + BlockBytes(c, b->numStations));
+}
+
+// COLUMNS_CODE_LEN chars, not NUL terminated when the code is that long
+const char *ColumnsCode(const struct ColumnsBlock *b, int station)
+{
+    return (const char *)(b + 1) + (size_t)station * COLUMNS_CODE_LEN;
+}
+
+const uint32_t *ColumnsTimes(const struct ColumnsBlock *b)
+{
+    return (const uint32_t *)((const uint8_t *)b + TimesOffset(b->numStations));
+}
+
+const uint8_t *ColumnsColumn(const struct Columns *c, const struct ColumnsBlock *b, int station)
+{
+    return (const uint8_t *)b + DataOffset(c, b->numStations) + (size_t)station * c->hdr->blockRecs;
+}
+
+// the row record i is in until the tail it's in fills
+static uint8_t *TailRow(const struct Columns *c, const struct ColumnsBlock *b, uint32_t i)
+{
+    return (uint8_t *)b + TailOffset(c->hdr->blockRecs, b->numStations) + (size_t)(i % c->tailRecs) * b->numStations;
+}
+
+// the first of a block's numRecs records that isn't in the columns yet
+uint32_t ColumnsTailStart(const struct Columns *c, uint32_t numRecs)
+{
+    return c->tailRecs != 0 ? numRecs - numRecs % c->tailRecs : numRecs;
+}
+
+// one station's records from ColumnsTailStart to numRecs, out has room for COLUMNS_TAIL_RECS
+void ColumnsTail(const struct Columns *c, const struct ColumnsBlock *b, int station, uint32_t numRecs,
+		 uint8_t *out)
+{
+    for (uint32_t i = ColumnsTailStart(c, numRecs); i < numRecs; i++)
+	*out++ = TailRow(c, b, i)[station];
+}
+
+// p to p + len has been written, for ColumnsSync to send out
+static void Touched(struct Columns *c, const void *p, size_t len)
+{
+    size_t off = (const uint8_t *)p - (const uint8_t *)c->hdr;
+
+    if (c->syncTo == 0 || off < c->syncFrom)
+	c->syncFrom = off;
+    if (off + len > c->syncTo)
+	c->syncTo = off + len;
+}
+
+// size the file to len and map all of it again, the newest block follows it
+static int Remap(struct Columns *c, size_t len)
+{
+    size_t lastOff = c->last != NULL ? BlockOffset(c, c->last) : 0;
+
+    if (c->hdr != NULL)
+	munmap(c->hdr, c->mapLen);
+    c->hdr = NULL;
+    c->last = NULL;
+    if (ftruncate(c->fd, len) != 0) {
+	fprintf(stderr, "Can't size %s %d\n", ColumnsFileName(), errno);
+	return FALSE;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (map == MAP_FAILED) {
+	fprintf(stderr, "Can't map %s %d\n", ColumnsFileName(), errno);
+	return FALSE;
+    }
+    c->hdr = map;
+    c->mapLen = len;
+    if (lastOff != 0)
+	c->last = (struct ColumnsBlock *)((uint8_t *)map + lastOff);
+    return TRUE;
+}
+
+static int Upgrade(struct Columns *c, const char *fileName);
+
+// one we can't read is kept as file.bad like the ring's, it may be years of stats
+static int SetAside(struct Columns *c, const char *fileName)
+{
+    char sBad[300];
+
+    snprintf(sBad, sizeof(sBad), "%s.bad", fileName);
+    fprintf(stderr, "%s is not one we know, keeping it as %s and starting over\n", fileName, sBad);
+    close(c->fd);
+    c->fd = -1;
+    if (rename(fileName, sBad) != 0) {
+	fprintf(stderr, "Can't rename %s %d\n", fileName, errno);
+	return FALSE;
+    }
+    c->fd = open(fileName, O_RDWR | O_CREAT, 0664);
+    if (c->fd < 0) {
+	fprintf(stderr, "Can't open %s %d\n", fileName, errno);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+int ColumnsOpen(struct Columns *c, const char *fileName, int writable)
+{
+    struct stat st;
+    struct ColumnsHeader hdr;
+    int isNew = FALSE;
+
+    memset(c, 0, sizeof(*c));
+    c->writable = writable;
+    c->fd = open(fileName, writable ? O_RDWR | O_CREAT : O_RDONLY, 0664);
+    if (c->fd < 0) {
+	if (writable || errno != ENOENT)
+	    fprintf(stderr, "Can't open %s %d\n", fileName, errno);
+	return FALSE;
+    }
+    if (fstat(c->fd, &st) != 0) {
+	close(c->fd);
+	return FALSE;
+    }
+
+    if (st.st_size == 0)
+	isNew = TRUE;
+    else if ((size_t)st.st_size < COLUMNS_PAGE || pread(c->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != COLUMNS_MAGIC
+	     || (hdr.version != COLUMNS_VERSION && hdr.version != 1) || hdr.blockRecs == 0 || hdr.blockRecs % 8 != 0
+	     || (hdr.version != 1 && (hdr.tailRecs == 0 || hdr.tailRecs > COLUMNS_TAIL_RECS
+				     || hdr.blockRecs % hdr.tailRecs != 0))) {
+	if (!writable) {
+	    fprintf(stderr, "%s is not one we know\n", fileName);
+	    close(c->fd);
+	    return FALSE;
+	}
+	if (!SetAside(c, fileName))
+	    return FALSE;
+	isNew = TRUE;
+    }
+    if (isNew && !writable) {
+	close(c->fd);
+	return FALSE;
+    }
+    if (!isNew && hdr.version == 1 && writable) {
+	close(c->fd);
+	return Upgrade(c, fileName);
+    }
+    c->tailRecs = isNew ? COLUMNS_TAIL_RECS : hdr.version == 1 ? 0 : hdr.tailRecs;
+
+    if (!writable) {
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->fd, 0);
+	if (map == MAP_FAILED) {
+	    fprintf(stderr, "Can't map %s %d\n", fileName, errno);
+	    close(c->fd);
+	    return FALSE;
+	}
+	c->hdr = map;
+	c->mapLen = st.st_size;
+	return TRUE;
+    }
+
+    if (!Remap(c, isNew ? COLUMNS_PAGE : (size_t)st.st_size)) {
+	close(c->fd);
+	return FALSE;
+    }
+    if (isNew) {
+	memset(c->hdr, 0, COLUMNS_PAGE);
+	c->hdr->magic = COLUMNS_MAGIC;
+	c->hdr->version = COLUMNS_VERSION;
+	c->hdr->blockRecs = COLUMNS_BLOCK_RECS;
+	c->hdr->tailRecs = COLUMNS_TAIL_RECS;
+	return TRUE;
+    }
+
+    // find the newest block, and drop one we were killed adding
+    size_t end = COLUMNS_PAGE;
+    uint32_t numBlocks = 0;
+    for (const struct ColumnsBlock *b = ColumnsFirstBlock(c); b != NULL && numBlocks < c->hdr->numBlocks;
+	 b = ColumnsNextBlock(c, b)) {
+	c->last = (struct ColumnsBlock *)b;
+	end = BlockOffset(c, b) + BlockBytes(c, b->numStations);
+	numBlocks++;
+    }
+    c->hdr->numBlocks = numBlocks;
+    if (end != c->mapLen && !Remap(c, end)) {
+	close(c->fd);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+static int SameStations(const struct ColumnsBlock *b, const struct stAirport *airports, int numAirports)
+{
+    if (b->numStations != (uint32_t)numAirports)
+	return FALSE;
+    for (int i = 0; i < numAirports; i++)
+	if (strncmp(ColumnsCode(b, i), airports[i].sAirportCode, COLUMNS_CODE_LEN) != 0)
+	    return FALSE;
+    return TRUE;
+}
+
+static struct ColumnsBlock *AddBlock(struct Columns *c, const struct stAirport *airports, int numAirports)
+{
+    size_t off = c->mapLen;	// blocks go end to end
+
+    if (!Remap(c, off + BlockBytes(c, numAirports)))
+	return NULL;
+    struct ColumnsBlock *b = (struct ColumnsBlock *)((uint8_t *)c->hdr + off);
+    for (int i = 0; i < numAirports; i++)
+	strncpy((char *)ColumnsCode(b, i), airports[i].sAirportCode, COLUMNS_CODE_LEN);
+    b->numRecs = 0;
+    b->numStations = numAirports;
+    Touched(c, b, TimesOffset(numAirports));
+    __atomic_store_n(&c->hdr->numBlocks, c->hdr->numBlocks + 1, __ATOMIC_RELEASE);
+    c->last = b;
+    return b;
+}
+
+// a full tail, a row per record, into a run of tailRecs bytes on the end of each column
+static void TailToColumns(struct Columns *c, struct ColumnsBlock *b, uint32_t iFirst)
+{
+    const uint8_t *rows = TailRow(c, b, iFirst);
+    uint32_t n = b->numStations;
+
+    for (uint32_t k = 0; k < n; k++) {
+	uint8_t *p = (uint8_t *)ColumnsColumn(c, b, k) + iFirst;
+	for (uint32_t r = 0; r < c->tailRecs; r++)
+	    p[r] = rows[(size_t)r * n + k];
+    }
+    Touched(c, ColumnsColumn(c, b, 0) + iFirst, (size_t)(n - 1) * c->hdr->blockRecs + c->tailRecs);
+}
+
+// one ring record, the byte for each airport's led, onto the newest block
+int ColumnsAppend(struct Columns *c, const char *sRecord, int ledCount, time_t t,
+		  const struct stAirport *airports, int numAirports)
+{
+    struct ColumnsBlock *b = c->last;
+
+    if (!c->writable || numAirports <= 0 || numAirports > COLUMNS_MAX_STATIONS)
+	return FALSE;
+    if (b == NULL || b->numRecs == c->hdr->blockRecs || !SameStations(b, airports, numAirports))
+	if ((b = AddBlock(c, airports, numAirports)) == NULL)
+	    return FALSE;
+
+    uint32_t i = b->numRecs;
+    uint32_t *times = (uint32_t *)ColumnsTimes(b);
+    uint8_t *row = TailRow(c, b, i);
+    times[i] = (uint32_t)t;
+    for (int k = 0; k < numAirports; k++) {
+	int led = airports[k].iLedNo;
+	row[k] = led >= 0 && led < ledCount ? sRecord[led] : 'E';
+    }
+    Touched(c, &times[i], sizeof(times[i]));
+    Touched(c, row, numAirports);
+    if ((i + 1) % c->tailRecs == 0)	// readers go on finding these in the tail until numRecs says otherwise
+	TailToColumns(c, b, i + 1 - c->tailRecs);
+    if (i == 0)
+	b->tFirst = (uint32_t)t;
+    b->tLast = (uint32_t)t;
+    Touched(c, b, sizeof(*b));
+    __atomic_store_n(&b->numRecs, i + 1, __ATOMIC_RELEASE);
+    c->hdr->tLast = (uint32_t)t;
+    return TRUE;
+}
+
+// append what the ring has that we haven't, returns how many records that was
+int ColumnsSync(struct Columns *c, const struct History *h, const struct stAirport *airports, int numAirports)
+{
+    struct HistoryCursor cursor;
+    int numAdded = 0;
+
+    if (!c->writable || HistoryCount(h) == 0 || !HistoryCursorInit(&cursor, h))
+	return 0;
+    if (c->hdr->tLast == 0)
+	HistoryCursorSeek(&cursor, HistoryCount(h) - 1);
+    else
+	HistoryCursorSeekTime(&cursor, (time_t)c->hdr->tLast + 1);
+
+    for (const char *sRecord; (sRecord = HistoryCursorNext(&cursor)) != NULL; ) {
+	if (cursor.tRecord <= c->hdr->tLast)
+	    continue;
+	if (!ColumnsAppend(c, sRecord, h->hdr->ledCount, cursor.tRecord, airports, numAirports))
+	    break;
+	numAdded++;
+    }
+    HistoryCursorFree(&cursor);
+
+    // what the records went into, then the header page with its tLast
+    if (c->syncTo != 0) {
+	size_t from = c->syncFrom & ~(size_t)(COLUMNS_PAGE - 1);
+	if (msync((uint8_t *)c->hdr + from, c->syncTo - from, MS_SYNC) != 0
+	    || msync(c->hdr, COLUMNS_PAGE, MS_SYNC) != 0)
+	    fprintf(stderr, "msync of %s failed %d\n", ColumnsFileName(), errno);
+	c->syncFrom = c->syncTo = 0;
+    }
+    return numAdded;
+}
+
+/*
+ * Version 1 had no tail, every record went straight into its column. Its
+ * blocks are copied a record at a time into a new store, which then takes
+ * its place - it may hold years the ring no longer has.
+ */
+static int Upgrade(struct Columns *c, const char *fileName)
+{
+    struct Columns old;
+    char sNew[300];
+    int numCopied = 0;
+    int ok = TRUE;
+
+    if (!ColumnsOpen(&old, fileName, FALSE))
+	return FALSE;
+    snprintf(sNew, sizeof(sNew), "%s.new", fileName);
+    unlink(sNew);
+    if (!ColumnsOpen(c, sNew, TRUE)) {
+	ColumnsClose(&old);
+	return FALSE;
+    }
+
+    for (const struct ColumnsBlock *b = ColumnsFirstBlock(&old); b != NULL && ok; b = ColumnsNextBlock(&old, b)) {
+	uint32_t n = b->numStations;
+	uint32_t numRecs = b->numRecs <= old.hdr->blockRecs ? b->numRecs : 0;
+	const uint32_t *times = ColumnsTimes(b);
+	struct stAirport *airports = calloc(n, sizeof(*airports));
+	char *sRecord = malloc(n);
+
+	ok = airports != NULL && sRecord != NULL;
+	for (uint32_t k = 0; ok && k < n; k++) {
+	    memcpy(airports[k].sAirportCode, ColumnsCode(b, k), COLUMNS_CODE_LEN);
+	    airports[k].iLedNo = k;
+	}
+	for (uint32_t i = 0; ok && i < numRecs; i++) {
+	    for (uint32_t k = 0; k < n; k++)
+		sRecord[k] = ColumnsColumn(&old, b, k)[i];
+	    ok = ColumnsAppend(c, sRecord, n, times[i], airports, n);
+	    numCopied++;
+	}
+	free(airports);
+	free(sRecord);
+    }
+    ColumnsClose(&old);
+
+    if (ok && msync(c->hdr, c->mapLen, MS_SYNC) == 0 && rename(sNew, fileName) == 0) {
+	c->syncFrom = c->syncTo = 0;
+	printf("%s copied into version %d, %d records\n", fileName, COLUMNS_VERSION, numCopied);
+	return TRUE;
+    }
+    fprintf(stderr, "Can't copy %s into version %d %d\n", fileName, COLUMNS_VERSION, errno);
+    ColumnsClose(c);
+    unlink(sNew);
+    return FALSE;
+}
+
+void ColumnsClose(struct Columns *c)
+{
+    if (c->hdr != NULL)
+	munmap(c->hdr, c->mapLen);
+    if (c->fd >= 0)
+	close(c->fd);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
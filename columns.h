@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <time.h>
+
+#define COLUMNS_FILE "day.cols"
+#define COLUMNS_TEST_FILE "daytest.cols"
+
+#define COLUMNS_MAGIC 0x4c4f4348	// "HCOL"
+#define COLUMNS_VERSION 2		// 1 had no tail, it's copied into a 2 the first time it's written to
+#define COLUMNS_BLOCK_RECS 8192		// records in a block, about 28 days of refreshes
+#define COLUMNS_TAIL_RECS 512		// newest records of a block, a row each until they fill it
+#define COLUMNS_CODE_LEN 4		// station codes, NUL padded
+#define COLUMNS_PAGE 4096		// the header and every block start on a page
+#define COLUMNS_MAX_STATIONS 65536	// more than that in a block and the file is junk
+
+/*
+ * The history again, turned on its side for questions about one station at a
+ * time. The ring has a record per refresh with every led in it; here a
+ * station's categories over a block of time are one run of bytes, the same
+ * 'V' 'M' 'I' 'L' 'E' chars, so a scan for one station reads only its own
+ * bytes and can take them 8 at a time. It is filled from the ring and never
+ * wraps, so it keeps going after the ring has dropped a day.
+ *
+ * On disk: a ColumnsHeader padded to a page, then blocks. Each block is a
+ * ColumnsBlock, numStations codes, blockRecs uint32 times, tailRecs rows of
+ * numStations bytes, then numStations columns of blockRecs bytes, padded to
+ * a page. A block is for one airport list, a new list starts a new block.
+ *
+ * A refresh writing a byte into every column would dirty a page for every
+ * station, so the newest records go into the tail instead, a row each, and
+ * only when tailRecs of them have piled up are they turned into columns.
+ * Records from ColumnsTailStart up to numRecs are still in the tail, and
+ * ColumnsTail copies one station's out. Counts are written after what
+ * they count, so a reader mapping the file while the daemon appends to it
+ * only ever sees whole records.
+ */
+struct ColumnsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockRecs;
+    uint32_t numBlocks;
+    uint32_t tLast;		// newest record in any block, 0 for none
+    uint32_t tailRecs;		// COLUMNS_TAIL_RECS, divides blockRecs
+};
+
+struct ColumnsBlock {
+    uint32_t numStations;
+    uint32_t numRecs;
+    uint32_t tFirst;
+    uint32_t tLast;
+};
+
+struct Columns {
+    int fd;
+    int writable;
+    size_t mapLen;		// the whole file
+    uint32_t tailRecs;		// 0 for a version 1 store
+    size_t syncFrom;		// what's been written since the last ColumnsSync,
+    size_t syncTo;		// past the header page, syncTo 0 for nothing
+    struct ColumnsHeader *hdr;
+    struct ColumnsBlock *last;	// block appends go to, NULL before the first
+};
+
+struct History;
+struct stAirport;
+
+const char *ColumnsFileName(void);
+int ColumnsOpen(struct Columns *c, const char *fileName, int writable);
+int ColumnsAppend(struct Columns *c, const char *sRecord, int ledCount, time_t t,
+		  const struct stAirport *airports, int numAirports);
+int ColumnsSync(struct Columns *c, const struct History *h, const struct stAirport *airports, int numAirports);
+void ColumnsClose(struct Columns *c);
+
+const struct ColumnsBlock *ColumnsFirstBlock(const struct Columns *c);
+const struct ColumnsBlock *ColumnsNextBlock(const struct Columns *c, const struct ColumnsBlock *b);
+const char *ColumnsCode(const struct ColumnsBlock *b, int station);
+const uint32_t *ColumnsTimes(const struct ColumnsBlock *b);
+const uint8_t *ColumnsColumn(const struct Columns *c, const struct ColumnsBlock *b, int station);
+uint32_t ColumnsTailStart(const struct Columns *c, uint32_t numRecs);
+void ColumnsTail(const struct Columns *c, const struct ColumnsBlock *b, int station, uint32_t numRecs,
+		 uint8_t *out);
@@ -0,0 +1,306 @@
+/**********************************************************************
+* Filename    : control.c
+* Description : Unix socket the daemon takes commands on
+*
+* Lets WebIO.py start a replay, turn the lights off or change the
+* brightness in the process that already has the string, instead of
+* starting a second one that waits on the semaphore and sets the string
+* up again. The daemon and Replay wait on the listening socket and the
+* clients still sending their line along with their next frame, so a
+* command is picked up straight away and a slow one holds nothing up.
+**********************************************************************/
+#define _GNU_SOURCE	// accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "METARmap.h"
+#include "matrix.h"
+#include "metrics.h"
+#include "control.h"
+#include "http.h"
+
+char control_socket[256];	// empty - CONTROL_SOCKET or CONTROL_TEST_SOCKET by test_mode
+int control_fd = -1;
+static int timer_fd = -1;	// goes off when the oldest client has had CONTROL_TIMEOUT_MS
+int lights_off = FALSE;
+int replaying = FALSE;
+struct ControlCommand control_pending = { CMD_NONE, 0, -1 };	// taken during a replay, for the daemon
+
+int ControlOpen(void)
+{
+    struct sockaddr_un addr;
+
+    if (control_socket[0] == '\0')
+	strcpy(control_socket, test_mode == TRUE ? CONTROL_TEST_SOCKET : CONTROL_SOCKET);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(control_socket) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "control socket %s is too long\n", control_socket);
+	return FALSE;
+    }
+    strcpy(addr.sun_path, control_socket);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control_fd < 0) {
+	perror("control socket");
+	return FALSE;
+    }
+    unlink(control_socket);	// left over from a run that didn't get to clean up - we hold the semaphore
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(control_fd, 4) != 0) {
+	perror(control_socket);
+	close(control_fd);
+	control_fd = -1;
+	return FALSE;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    chmod(control_socket, 0660);
+    printf("taking commands on %s\n", control_socket);
+    return TRUE;
+}
+
+// a client that has connected but not yet sent all of its line
+struct ControlClient {
+    int fd;			// -1 for a free slot
+    long long tAcceptedMs;
+    size_t len;
+    char sLine[CONTROL_LINE_LEN];
+};
+
+static struct ControlClient clients[CONTROL_MAX_CLIENTS] = {
+    [0 ... CONTROL_MAX_CLIENTS - 1] = { .fd = -1 }
+};
+
+static const struct { const char *sName; int cmd; int hasArg; } cmds[] = {
+    { "replay", CMD_REPLAY, TRUE },
+    { "stop", CMD_STOP, FALSE },
+    { "off", CMD_OFF, FALSE },
+    { "on", CMD_ON, FALSE },
+    { "brightness", CMD_BRIGHTNESS, TRUE },
+    { "refresh", CMD_REFRESH, FALSE },
+    { "status", CMD_STATUS, FALSE },
+    { "metrics", CMD_METRICS, FALSE },
+};
+
+static long long NowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// what to wait on for commands, CONTROL_NUM_FDS of them, -1 for the ones we don't have
+void ControlFds(struct pollfd *pfds)
+{
+    pfds[0].fd = control_fd;
+    pfds[1].fd = http_fd;
+    pfds[2].fd = timer_fd;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+	pfds[3 + i].fd = clients[i].fd;
+}
+
+// wake us when the oldest client runs out of time, so one that never finishes its line goes
+static void ArmTimer(void)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };	// none left, disarmed
+    long long tFirstMs = 0;
+
+    if (timer_fd < 0)
+	return;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+	if (clients[i].fd >= 0 && (tFirstMs == 0 || clients[i].tAcceptedMs < tFirstMs))
+	    tFirstMs = clients[i].tAcceptedMs;
+    if (tFirstMs != 0) {
+	long long tDueMs = tFirstMs + CONTROL_TIMEOUT_MS;
+	its.it_value.tv_sec = tDueMs / 1000;
+	its.it_value.tv_nsec = (tDueMs % 1000) * 1000000;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void DropClient(struct ControlClient *cl, const char *sReply)
+{
+    struct ControlCommand c = { CMD_NONE, 0, cl->fd };
+
+    ControlReply(&c, sReply);
+    cl->fd = -1;
+    cl->len = 0;
+}
+
+// everyone waiting to connect gets a slot, the oldest makes way when they're all taken
+static void AcceptClients(void)
+{
+    int fd;
+
+    while ((fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+	struct ControlClient *cl = &clients[0];
+	for (int i = 0; i < CONTROL_MAX_CLIENTS && cl->fd >= 0; i++)
+	    if (clients[i].fd < 0 || clients[i].tAcceptedMs < cl->tAcceptedMs)
+		cl = &clients[i];
+	if (cl->fd >= 0)
+	    DropClient(cl, "error too slow");
+	cl->fd = fd;
+	cl->len = 0;
+	cl->tAcceptedMs = NowMs();
+    }
+}
+
+/*
+ * Whatever the client has sent since we last looked, without waiting for
+ * more. TRUE with the command in c once the line is all there; FALSE if it
+ * isn't yet, or it didn't make sense - the client has had its answer then.
+ */
+static int ReadClient(struct ControlClient *cl, struct ControlCommand *c)
+{
+    char sName[CONTROL_LINE_LEN];
+    int arg = 0;
+
+    ssize_t got = read(cl->fd, cl->sLine + cl->len, sizeof(cl->sLine) - 1 - cl->len);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return FALSE;
+    if (got > 0)
+	cl->len += got;
+    cl->sLine[cl->len] = '\0';
+    // wait for the end of the line, unless they've hung up or filled the buffer
+    if (got > 0 && memchr(cl->sLine, '\n', cl->len) == NULL && cl->len < sizeof(cl->sLine) - 1)
+	return FALSE;
+
+    cl->sLine[strcspn(cl->sLine, "\r\n")] = '\0';
+    if (cl->sLine[0] == '\0') {
+	DropClient(cl, "error nothing to do");
+	return FALSE;
+    }
+
+    int numFields = sscanf(cl->sLine, "%127s %d", sName, &arg);
+    for (size_t i = 0; numFields >= 1 && i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+	if (strcmp(sName, cmds[i].sName) != 0)
+	    continue;
+	if (cmds[i].hasArg && numFields < 2)
+	    break;
+	c->cmd = cmds[i].cmd;
+	c->arg = arg;
+	c->fd = cl->fd;	// the caller answers it
+	printf("control: %s\n", cl->sLine);
+	cl->fd = -1;
+	cl->len = 0;
+	return TRUE;
+    }
+
+    DropClient(cl, "error unknown command");
+    return FALSE;
+}
+
+/*
+ * A command from whichever of them woke us up, FALSE if there wasn't one to
+ * act on. Nothing here waits: a client's line is put together over as many
+ * calls as it takes to arrive, so a slow one can't hold up a frame.
+ */
+int ControlTake(struct ControlCommand *c, const struct pollfd *pfds)
+{
+    long long tNowMs = NowMs();
+    int taken = FALSE;
+
+    c->cmd = CMD_NONE;
+    c->fd = -1;
+    if (pfds[1].revents != 0 && HttpService(c))
+	return TRUE;
+    if (pfds[0].revents != 0)
+	AcceptClients();
+    if (pfds[2].revents != 0) {
+	uint64_t expirations;
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+	    fprintf(stderr, "control: timer %d\n", errno);
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+	struct ControlClient *cl = &clients[i];
+	if (cl->fd < 0)
+	    continue;
+	// only fds that were in this poll - a slot just filled waits for the next one
+	if (!taken && pfds[3 + i].fd == cl->fd && pfds[3 + i].revents != 0)
+	    taken = ReadClient(cl, c);
+	if (cl->fd >= 0 && tNowMs - cl->tAcceptedMs >= CONTROL_TIMEOUT_MS)
+	    DropClient(cl, "error too slow");
+    }
+    ArmTimer();
+    return taken;
+}
+
+/*
+ * The commands that don't change what's on the map are answered here, so
+ * they work in the middle of a replay too. FALSE means the caller has to
+ * deal with it.
+ */
+int ControlAnswer(struct ControlCommand *c)
+{
+    char sReply[CONTROL_LINE_LEN];
+
+    switch (c->cmd) {
+    case CMD_BRIGHTNESS:
+	if (c->arg < 0 || c->arg > 255) {
+	    ControlReply(c, "error brightness is 0-255");
+	    return TRUE;
+	}
+	matrix_set_brightness(c->arg);
+	if (!lights_off)
+	    matrix_render();
+	ControlReply(c, "ok");
+	return TRUE;
+
+    case CMD_STATUS:
+	snprintf(sReply, sizeof(sReply), "%s brightness %d last_refresh %lld",
+		 replaying ? "replay" : lights_off ? "off" : "live",
+		 matrix_get_brightness(), (long long)metrics.lastRefresh);
+	ControlReply(c, sReply);
+	return TRUE;
+
+    case CMD_METRICS: {
+	FILE *f = fdopen(dup(c->fd), "w");
+	if (f != NULL) {
+	    MetricsPrint(f);
+	    fclose(f);
+	}
+	close(c->fd);
+	c->fd = -1;
+	return TRUE;
+    }
+
+    default:
+	return FALSE;
+    }
+}
+
+void ControlReply(struct ControlCommand *c, const char *sReply)
+{
+    if (c->fd < 0)
+	return;
+    if (send(c->fd, sReply, strlen(sReply), MSG_NOSIGNAL) < 0 || send(c->fd, "\n", 1, MSG_NOSIGNAL) < 0)
+	fprintf(stderr, "control: couldn't answer %d\n", errno);
+    close(c->fd);
+    c->fd = -1;
+}
+
+void ControlClose(void)
+{
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+	if (clients[i].fd >= 0)
+	    DropClient(&clients[i], "error going away");
+    if (timer_fd >= 0)
+	close(timer_fd);
+    timer_fd = -1;
+    if (control_fd < 0)
+	return;
+    close(control_fd);
+    unlink(control_socket);
+    control_fd = -1;
+}
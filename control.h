@@ -0,0 +1,50 @@
+#define CONTROL_SOCKET "/run/metarmap.sock"
+#define CONTROL_TEST_SOCKET "/tmp/metarmap-test.sock"
+
+/*
+ * One line in, one line back, over a unix stream socket the daemon listens on
+ * (the http server in http.c hands in the same commands, with no fd):
+ *
+ *   replay N      replay the last N hours, then back to live
+ *   stop          end a replay
+ *   off, on       lights off and back on, refreshes carry on in the dark
+ *   brightness N  0-255
+ *   refresh       fetch now rather than at the next 5 minutes
+ *   status        what we're doing
+ *   metrics       the Prometheus text from metrics.c
+ */
+#define CMD_NONE 0
+#define CMD_REPLAY 1
+#define CMD_STOP 2
+#define CMD_OFF 3
+#define CMD_ON 4
+#define CMD_BRIGHTNESS 5
+#define CMD_REFRESH 6
+#define CMD_STATUS 7
+#define CMD_METRICS 8
+
+#define CONTROL_MAX_CLIENTS 4	// connected and still sending their line
+#define CONTROL_NUM_FDS (3 + CONTROL_MAX_CLIENTS)	// the socket, the http server, a timer and those, see ControlFds
+#define CONTROL_LINE_LEN 128
+#define CONTROL_TIMEOUT_MS 1000	// a client that doesn't send its line by then is dropped
+
+struct ControlCommand {
+    int cmd;
+    int arg;
+    int fd;			// the client, until it has its answer
+};
+
+extern char control_socket[256];
+extern int control_fd;		// listening socket, -1 when there isn't one
+extern int lights_off;
+extern int replaying;
+extern struct ControlCommand control_pending;
+
+struct pollfd;
+
+int ControlOpen(void);
+void ControlFds(struct pollfd *pfds);
+int ControlTake(struct ControlCommand *c, const struct pollfd *pfds);
+int ControlAnswer(struct ControlCommand *c);
+void ControlReply(struct ControlCommand *c, const char *sReply);
+void ControlClose(void);
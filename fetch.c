@@ -0,0 +1,426 @@
+/**********************************************************************
+* Filename    : fetch.c
+* Description : Keep one curl handle around and pull the METAR xml with it
+*
+* The handle, and with it the connection, DNS and TLS session caches, is
+* reused for every refresh. We ask for gzip and send the ETag and
+* Last-Modified from the previous answer so the server can tell us
+* "304 nothing new" and we can skip the parse altogether.
+*
+* A long airport list is split into several requests that go out side by
+* side through a curl multi handle, each with its own easy handle and
+* validators, so a few hundred airports take about as long as one request.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "METARmap.h"
+#include "fetch.h"
+
+// Curl Callback used by FetchData
+static size_t
+WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+  size_t realsize = size * nmemb;
+  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+
+  char *ptr = realloc(mem->memory, mem->size + realsize + 1);
+  if(ptr == NULL) {
+    /* out of memory! */
+    printf("not enough memory (realloc returned NULL)\n");
+    return 0;
+  }
+
+  mem->memory = ptr;
+  memcpy(&(mem->memory[mem->size]), contents, realsize);
+  mem->size += realsize;
+  mem->memory[mem->size] = 0;
+
+  return realsize;
+}
+
+// copy a header value without the trailing CR/LF
+static void SaveHeaderValue(char *sDest, size_t destLen, const char *sValue, size_t valueLen)
+{
+    while (valueLen > 0 && isspace((unsigned char)*sValue)) {
+	sValue++;
+	valueLen--;
+    }
+    while (valueLen > 0 && isspace((unsigned char)sValue[valueLen-1]))
+	valueLen--;
+    if (valueLen >= destLen)
+	valueLen = 0;	// too long to be useful, don't send half of one back
+    memcpy(sDest, sValue, valueLen);
+    sDest[valueLen] = 0;
+}
+
+// Curl header callback - all we want are the validators for next time
+static size_t
+HeaderCallback(char *buffer, size_t size, size_t nitems, void *userp)
+{
+  size_t realsize = size * nitems;
+  struct FetchContext *ctx = (struct FetchContext *)userp;
+
+  if (realsize > 5 && strncasecmp(buffer, "ETag:", 5) == 0)
+    SaveHeaderValue(ctx->sNewETag, sizeof(ctx->sNewETag), buffer + 5, realsize - 5);
+  else if (realsize > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0)
+    SaveHeaderValue(ctx->sNewLastModified, sizeof(ctx->sNewLastModified), buffer + 14, realsize - 14);
+
+  return realsize;
+}
+
+/*
+ * http:// or https:// is asked for our stations. Anything else is a recorded
+ * response - file://path or just the path - and if that is a directory we go
+ * through the files in it in name order, one per refresh, and start over.
+ */
+int FetchSourceInit(struct FetchSource *src, const char *sSource)
+{
+  struct stat st;
+  const char *sPath = sSource;
+
+  memset(src, 0, sizeof(*src));
+  if (strncmp(sSource, "http://", 7) == 0 || strncmp(sSource, "https://", 8) == 0) {
+    src->type = SOURCE_HTTP;
+    snprintf(src->sBase, sizeof(src->sBase), "%s", sSource);
+    return FETCH_OK;
+  }
+
+  if (strncmp(sSource, "file://", 7) == 0)
+    sPath = sSource + 7;
+  // file:// wants the whole path, a relative one would be taken for a host name
+  char *sFull = realpath(sPath, NULL);
+  if (sFull == NULL || stat(sFull, &st) != 0) {
+    perror(sPath);
+    free(sFull);
+    return FETCH_ERROR;
+  }
+  snprintf(src->sBase, sizeof(src->sBase), "%s", sFull);
+  sPath = src->sBase;
+  free(sFull);
+  if (!S_ISDIR(st.st_mode)) {
+    src->type = SOURCE_FILE;
+    return FETCH_OK;
+  }
+
+  struct dirent **entries;
+  int numEntries = scandir(sPath, &entries, NULL, alphasort);
+  if (numEntries < 0) {
+    perror(sPath);
+    return FETCH_ERROR;
+  }
+  src->type = SOURCE_DIR;
+  src->sFiles = malloc(sizeof(char *) * (numEntries ? numEntries : 1));
+  for (int i = 0; i < numEntries; i++) {
+    if (entries[i]->d_name[0] != '.' && src->sFiles != NULL)
+      src->sFiles[src->numFiles++] = strdup(entries[i]->d_name);
+    free(entries[i]);
+  }
+  free(entries);
+  if (src->numFiles == 0) {
+    fprintf(stderr, "no recorded responses in %s\n", sPath);
+    FetchSourceFree(src);
+    return FETCH_ERROR;
+  }
+  printf("replaying %d recorded responses from %s\n", src->numFiles, sPath);
+  return FETCH_OK;
+}
+
+// the url for this refresh. For SOURCE_HTTP the caller adds the stations
+int FetchSourceUrl(struct FetchSource *src, char *sUrl, size_t len)
+{
+  int n;
+
+  if (src->type == SOURCE_HTTP)
+    n = snprintf(sUrl, len, "%s", src->sBase);
+  else if (src->type == SOURCE_FILE)
+    n = snprintf(sUrl, len, "file://%s", src->sBase);
+  else {
+    n = snprintf(sUrl, len, "file://%s/%s", src->sBase, src->sFiles[src->next]);
+    src->next = (src->next + 1) % src->numFiles;
+  }
+  return n >= 0 && (size_t)n < len ? FETCH_OK : FETCH_ERROR;
+}
+
+void FetchSourceFree(struct FetchSource *src)
+{
+  for (int i = 0; i < src->numFiles; i++)
+    free(src->sFiles[i]);
+  free(src->sFiles);
+  src->sFiles = NULL;
+  src->numFiles = 0;
+}
+
+int FetchInit(struct FetchContext *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+
+  /* init the curl session - once, it lives as long as we do */
+  ctx->curl_handle = curl_easy_init();
+  if (ctx->curl_handle == NULL) {
+    fprintf(stderr, "curl_easy_init() failed\n");
+    return FETCH_ERROR;
+  }
+
+  /* send all data to this function  */
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_HEADERFUNCTION, HeaderCallback);
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_HEADERDATA, (void *)ctx);
+
+  /* some servers don't like requests that are made without a user-agent
+     field, so we provide one */
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_USERAGENT, "libcurl-agent-rpi/1.0");
+
+  /* let curl ask for gzip and unpack it for us */
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_ACCEPT_ENCODING, "gzip");
+
+  /* keep the connection, the address and the TLS session around for next time */
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_SSL_SESSIONID_CACHE, 1L);
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_DNS_CACHE_TIMEOUT, (long)FETCH_DNS_CACHE_SECS);
+
+  return FETCH_OK;
+}
+
+// set the handle up for one request - validators from last time go along
+static void FetchPrepare(struct FetchContext *ctx, const char *url, struct MemoryStruct *chunk)
+{
+  char sHeader[256];
+
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->sNewETag[0] = 0;
+  ctx->sNewLastModified[0] = 0;
+
+  // a different request means what the server told us last time doesn't apply
+  if (strcmp(ctx->sUrl, url) != 0) {
+    ctx->sETag[0] = 0;
+    ctx->sLastModified[0] = 0;
+    snprintf(ctx->sUrl, sizeof(ctx->sUrl), "%s", url);
+  }
+
+  ctx->pHeaders = NULL;
+  if (ctx->sETag[0]) {
+    snprintf(sHeader, sizeof(sHeader), "If-None-Match: %s", ctx->sETag);
+    ctx->pHeaders = curl_slist_append(ctx->pHeaders, sHeader);
+  }
+  if (ctx->sLastModified[0]) {
+    snprintf(sHeader, sizeof(sHeader), "If-Modified-Since: %s", ctx->sLastModified);
+    ctx->pHeaders = curl_slist_append(ctx->pHeaders, sHeader);
+  }
+
+  /* specify URL to get */
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_URL, url);
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_HTTPHEADER, ctx->pHeaders);
+
+  /* we pass our 'chunk' struct to the callback function */
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_WRITEDATA, (void *)chunk);
+}
+
+// what came of it - stats, validators for next time and our return code
+static int FetchFinish(struct FetchContext *ctx, CURLcode res, const struct MemoryStruct *chunk)
+{
+  int iRet = FETCH_OK;
+
+  curl_easy_setopt(ctx->curl_handle, CURLOPT_HTTPHEADER, NULL);
+  curl_slist_free_all(ctx->pHeaders);
+  ctx->pHeaders = NULL;
+
+  /* check for errors */
+  if(res != CURLE_OK) {
+    fprintf(stderr, "curl_easy_perform() failed: %s\n",
+            curl_easy_strerror(res));
+    iRet = FETCH_ERROR;
+  }
+
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_RESPONSE_CODE, &ctx->stats.lHttpCode);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_SIZE_DOWNLOAD_T, &ctx->stats.iWireBytes);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_HEADER_SIZE, &ctx->stats.iHeaderBytes);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_NUM_CONNECTS, &ctx->stats.lNewConnects);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_NAMELOOKUP_TIME_T, &ctx->stats.tDns);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_CONNECT_TIME_T, &ctx->stats.tConnect);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_APPCONNECT_TIME_T, &ctx->stats.tTls);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &ctx->stats.tFirstByte);
+  curl_easy_getinfo(ctx->curl_handle, CURLINFO_TOTAL_TIME_T, &ctx->stats.tTotal);
+  ctx->stats.iBodyBytes = chunk->size;
+
+  if (iRet == FETCH_OK) {
+    if (ctx->stats.lHttpCode == 304) {
+      iRet = FETCH_NOT_MODIFIED;
+    } else if (ctx->stats.lHttpCode == 200 || strncmp(ctx->sUrl, "file://", 7) == 0) {
+      strcpy(ctx->sETag, ctx->sNewETag);
+      strcpy(ctx->sLastModified, ctx->sNewLastModified);
+    } else {
+      fprintf(stderr, "aviation wx returned http %ld\n", ctx->stats.lHttpCode);
+      ctx->sETag[0] = 0;
+      ctx->sLastModified[0] = 0;
+      iRet = FETCH_ERROR;	// an error page is no weather
+    }
+  }
+
+//  Remember that caller will be responsible for freeing up chunk->memory
+
+  return iRet;
+}
+
+int FetchData(struct FetchContext *ctx, const char *url, struct MemoryStruct *chunk)
+{
+  FetchPrepare(ctx, url, chunk);
+
+  /* get it! */
+  return FetchFinish(ctx, curl_easy_perform(ctx->curl_handle), chunk);
+}
+
+void FetchPrintStats(const struct FetchContext *ctx)
+{
+  const struct FetchStats *st = &ctx->stats;
+
+  printf("fetch: http %ld, %ld wire bytes (%ld header), %lu body bytes, %s connection\n",
+	 st->lHttpCode, (long)st->iWireBytes, st->iHeaderBytes,
+	 (unsigned long)st->iBodyBytes, st->lNewConnects ? "new" : "reused");
+  printf("fetch: dns %.1fms connect %.1fms tls %.1fms first byte %.1fms total %.1fms\n",
+	 st->tDns / 1000.0, st->tConnect / 1000.0, st->tTls / 1000.0,
+	 st->tFirstByte / 1000.0, st->tTotal / 1000.0);
+}
+
+/*
+ * Batches go through one multi handle, at most parallel of them in flight.
+ * The multi handle's connection cache is shared, so they reuse each other's
+ * connections from one refresh to the next.
+ */
+int FetchBatchInit(struct FetchBatch *b, int numFetches, int parallel)
+{
+  memset(b, 0, sizeof(*b));
+  b->parallel = parallel > 0 ? parallel : 1;
+  b->multi = curl_multi_init();
+  b->fetches = calloc(numFetches, sizeof(struct FetchContext));
+  b->bodies = calloc(numFetches, sizeof(struct MemoryStruct));
+  b->results = calloc(numFetches, sizeof(int));
+  if (b->multi == NULL || b->fetches == NULL || b->bodies == NULL || b->results == NULL) {
+    FetchBatchCleanup(b);
+    return FETCH_ERROR;
+  }
+  for (int i = 0; i < numFetches; i++) {
+    if (FetchInit(&b->fetches[i]) != FETCH_OK) {
+      FetchBatchCleanup(b);
+      return FETCH_ERROR;
+    }
+    b->numFetches++;
+    b->results[i] = FETCH_ERROR;
+  }
+  return FETCH_OK;
+}
+
+// FETCH_OK if anything new came in, FETCH_NOT_MODIFIED if every batch said so
+int FetchBatchRun(struct FetchBatch *b, char **sUrls)
+{
+  struct MemoryStruct chunks[b->numFetches];
+  struct timespec tsStart, tsEnd;
+  int numAdded = 0;
+  int numRunning = 0;
+  int numNew = 0;
+  int numNotModified = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  for (int i = 0; i < b->numFetches; i++) {
+    chunks[i].memory = malloc(1);  /* will be grown as needed by the fetch */
+    chunks[i].size = 0;    /* no data at this point */
+    chunks[i].memory[0] = 0;
+    FetchPrepare(&b->fetches[i], sUrls[i], &chunks[i]);
+    curl_easy_setopt(b->fetches[i].curl_handle, CURLOPT_PRIVATE, (void *)(intptr_t)i);
+  }
+
+  do {
+    // keep parallel requests going until they've all been sent
+    while (numAdded < b->numFetches && numRunning < b->parallel) {
+      curl_multi_add_handle(b->multi, b->fetches[numAdded].curl_handle);
+      numAdded++;
+      numRunning++;
+    }
+
+    int numStillRunning;
+    curl_multi_perform(b->multi, &numStillRunning);
+
+    CURLMsg *msg;
+    int numQueued;
+    while ((msg = curl_multi_info_read(b->multi, &numQueued)) != NULL) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      char *pPrivate;
+      CURL *handle = msg->easy_handle;
+      CURLcode res = msg->data.result;
+      curl_easy_getinfo(handle, CURLINFO_PRIVATE, &pPrivate);
+      int i = (int)(intptr_t)pPrivate;
+      curl_multi_remove_handle(b->multi, handle);
+      numRunning--;
+
+      b->results[i] = FetchFinish(&b->fetches[i], res, &chunks[i]);
+      if (b->results[i] == FETCH_OK) {
+        free(b->bodies[i].memory);	// keep this one in case the next answer is a 304
+        b->bodies[i] = chunks[i];
+        chunks[i].memory = NULL;
+        numNew++;
+      } else if (b->results[i] == FETCH_NOT_MODIFIED) {
+        numNotModified++;
+      }
+      free(chunks[i].memory);
+    }
+
+    if (numRunning > 0)
+      curl_multi_wait(b->multi, NULL, 0, 1000, NULL);
+  } while (numRunning > 0 || numAdded < b->numFetches);
+
+  clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+  b->tWallUs = (tsEnd.tv_sec - tsStart.tv_sec) * 1000000LL + (tsEnd.tv_nsec - tsStart.tv_nsec) / 1000;
+
+  if (numNotModified == b->numFetches)
+    return FETCH_NOT_MODIFIED;
+  return numNew + numNotModified > 0 ? FETCH_OK : FETCH_ERROR;
+}
+
+void FetchBatchPrintStats(const struct FetchBatch *b)
+{
+  long long tSerial = 0;
+
+  if (b->numFetches == 1) {
+    FetchPrintStats(&b->fetches[0]);
+    return;
+  }
+  for (int i = 0; i < b->numFetches; i++) {
+    const struct FetchStats *st = &b->fetches[i].stats;
+    printf("fetch %d: http %ld, %ld wire bytes, %lu body bytes, %s connection, total %.1fms\n", i,
+	   st->lHttpCode, (long)st->iWireBytes, (unsigned long)st->iBodyBytes,
+	   st->lNewConnects ? "new" : "reused", st->tTotal / 1000.0);
+    tSerial += st->tTotal;
+  }
+  printf("fetch: %d batches %d at a time in %.1fms, %.1fms one after another\n",
+	 b->numFetches, b->parallel, b->tWallUs / 1000.0, tSerial / 1000.0);
+}
+
+void FetchBatchCleanup(struct FetchBatch *b)
+{
+  for (int i = 0; i < b->numFetches; i++) {
+    FetchCleanup(&b->fetches[i]);
+    free(b->bodies[i].memory);
+  }
+  if (b->multi != NULL)
+    curl_multi_cleanup(b->multi);
+  free(b->fetches);
+  free(b->bodies);
+  free(b->results);
+  memset(b, 0, sizeof(*b));
+}
+
+void FetchCleanup(struct FetchContext *ctx)
+{
+  /* cleanup curl stuff */
+  if (ctx->curl_handle != NULL)
+    curl_easy_cleanup(ctx->curl_handle);
+  ctx->curl_handle = NULL;
+}
@@ -0,0 +1,75 @@
+#include <curl/curl.h>
+
+// FetchData return codes
+#define FETCH_OK 0
+#define FETCH_NOT_MODIFIED 1	// 304 - server says nothing new since last time
+#define FETCH_ERROR -1
+
+#define FETCH_DNS_CACHE_SECS 3600	// aviation wx doesn't move around much
+#define FETCH_MAX_URL 2000		// stations go into batches so no request url is longer
+#define FETCH_PARALLEL 4		// default batches in flight at once
+
+// what the last fetch cost us. times are in microseconds from the start of the request
+struct FetchStats {
+    long lHttpCode;
+    curl_off_t iWireBytes;	// bytes on the wire (compressed if the server gzipped it)
+    long iHeaderBytes;
+    size_t iBodyBytes;		// bytes after decompression
+    long lNewConnects;		// 0 means the connection was reused
+    curl_off_t tDns;
+    curl_off_t tConnect;
+    curl_off_t tTls;
+    curl_off_t tFirstByte;
+    curl_off_t tTotal;
+};
+
+// One of these lives for the life of the process so the easy handle keeps its
+// connection, DNS and TLS session caches between refreshes
+struct FetchContext {
+    CURL *curl_handle;
+    char sUrl[2048];		// validators only apply to the url they came from
+    char sETag[128];
+    char sLastModified[64];
+    char sNewETag[128];		// filled in by the header callback during a request
+    char sNewLastModified[64];
+    struct curl_slist *pHeaders;	// conditional headers for the request in progress
+    struct FetchStats stats;
+};
+
+// where the weather comes from, see FetchSourceInit
+#define SOURCE_HTTP 0		// the aviation wx url or a stand-in, our stations go on the end
+#define SOURCE_FILE 1		// one recorded response, every refresh
+#define SOURCE_DIR 2		// a directory of recorded responses, one per refresh in name order
+
+struct FetchSource {
+    int type;
+    char sBase[1024];		// url, file or directory
+    char **sFiles;		// SOURCE_DIR - the responses, sorted
+    int numFiles;
+    int next;			// the one the next refresh gets, wraps around
+};
+
+// the station list split into several requests, fetched side by side
+struct FetchBatch {
+    CURLM *multi;
+    int numFetches;
+    int parallel;		// most requests in flight at once
+    struct FetchContext *fetches;	// one per batch so each keeps its own validators
+    struct MemoryStruct *bodies;	// last good response per batch, indexed again after a 304
+    int *results;		// FETCH_OK, FETCH_NOT_MODIFIED or FETCH_ERROR per batch
+    long long tWallUs;		// the whole lot, start to last one done
+};
+
+int FetchSourceInit(struct FetchSource *src, const char *sSource);
+int FetchSourceUrl(struct FetchSource *src, char *sUrl, size_t len);
+void FetchSourceFree(struct FetchSource *src);
+
+int FetchInit(struct FetchContext *ctx);
+int FetchData(struct FetchContext *ctx, const char *url, struct MemoryStruct *chunk);
+void FetchPrintStats(const struct FetchContext *ctx);
+void FetchCleanup(struct FetchContext *ctx);
+
+int FetchBatchInit(struct FetchBatch *b, int numFetches, int parallel);
+int FetchBatchRun(struct FetchBatch *b, char **sUrls);
+void FetchBatchPrintStats(const struct FetchBatch *b);
+void FetchBatchCleanup(struct FetchBatch *b);
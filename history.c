@@ -0,0 +1,760 @@
+/**********************************************************************
+* Filename    : history.c
+* Description : Replay history kept in a fixed size, memory mapped ring
+*
+* Records are packed 3 bits per led. Most refreshes only change a few
+* airports, so most records just list the leds that changed since the one
+* before, with a full keyframe at the start of every segment and every
+* HISTORY_KEYFRAME_EVERY records so we never have to decode far to seek.
+* Each record carries the time it was taken, so a replay can start at any
+* time and show the gaps where they were.
+* The file is sized once; an append writes into one segment and the header.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "METARmap.h"
+#include "history.h"
+
+static const char catChars[8] = { 'E', 'V', 'M', 'I', 'L', 'E', 'E', 'E' };
+
+static uint8_t CatCode(char cCond)
+{
+    switch(cCond) {
+	case 'V':
+	    return HCAT_VFR;
+	case 'M':
+	    return HCAT_MVFR;
+	case 'I':
+	    return HCAT_IFR;
+	case 'L':
+	    return HCAT_LIFR;
+	default:
+	    return HCAT_NONE;
+    }
+}
+
+const char *HistoryFileName(void)
+{
+    return test_mode == TRUE ? HISTORY_TEST_FILE : HISTORY_FILE;
+}
+
+static uint32_t KeyframeBytes(const struct History *h)
+{
+    return 1 + (h->timed ? 4 : 0) + (h->hdr->ledCount * 3 + 7) / 8;
+}
+
+static uint32_t DeltaBytes(const struct History *h, uint32_t numChanges)
+{
+    return 1 + (h->timed ? 1 : 0) + numChanges * 2;
+}
+
+static uint32_t GetTime(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void PutTime(uint8_t *p, uint32_t t)
+{
+    p[0] = t & 0xff;
+    p[1] = (t >> 8) & 0xff;
+    p[2] = (t >> 16) & 0xff;
+    p[3] = t >> 24;
+}
+
+static struct SegmentHeader *Segment(const struct History *h, uint32_t seg)
+{
+    return (struct SegmentHeader *)(h->segments + (size_t)seg * h->hdr->segmentSize);
+}
+
+static uint8_t *SegmentData(const struct History *h, uint32_t seg)
+{
+    return (uint8_t *)(Segment(h, seg) + 1);
+}
+
+static uint32_t OldestSegment(const struct History *h)
+{
+    return (h->hdr->head + h->hdr->capacity + 1 - h->hdr->count) % h->hdr->capacity;
+}
+
+// flush just the pages that hold [p, p+len) so a power pull doesn't lose the record
+static void SyncRange(const void *p, size_t len)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)p & ~(uintptr_t)(pagesize - 1);
+
+    if (msync((void *)start, (uintptr_t)p + len - start, MS_SYNC) != 0)
+	fprintf(stderr, "msync of %s failed %d\n", HistoryFileName(), errno);
+}
+
+// ask the kernel to start reading the segments after this one while we decode it
+static void ReadAhead(const struct History *h, uint32_t seg, uint32_t segsLeft)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uint32_t numSegs = segsLeft < HISTORY_READAHEAD ? segsLeft : HISTORY_READAHEAD;
+
+    for (uint32_t i = 1; i <= numSegs; i++) {
+	uintptr_t start = (uintptr_t)Segment(h, (seg + i) % h->hdr->capacity);
+	uintptr_t end = start + h->hdr->segmentSize;
+	start &= ~(uintptr_t)(pagesize - 1);
+	madvise((void *)start, end - start, MADV_WILLNEED);
+    }
+}
+
+// bytes taken by the record at p, without decoding it
+static uint32_t RecordBytes(const struct History *h, const uint8_t *p)
+{
+    return p[0] == HISTORY_KEYFRAME ? KeyframeBytes(h) : DeltaBytes(h, p[0]);
+}
+
+// when the record at p was taken, given the time of the one before it
+static uint32_t RecordTime(const struct History *h, const uint8_t *p, uint32_t tPrev)
+{
+    if (!h->timed)
+	return 0;
+    return p[0] == HISTORY_KEYFRAME ? GetTime(p + 1) : tPrev + p[1] * HISTORY_STEP_UNIT;
+}
+
+// apply the record at p to sRecord, *pTime goes from the time of the record before to this one's
+static void DecodeRecord(const struct History *h, const uint8_t *p, char *sRecord, uint32_t *pTime)
+{
+    uint32_t ledCount = h->hdr->ledCount;
+
+    *pTime = RecordTime(h, p, *pTime);
+    if (p[0] == HISTORY_KEYFRAME) {
+	const uint8_t *bits = p + 1 + (h->timed ? 4 : 0);
+	for (uint32_t j = 0; j < ledCount; j++) {
+	    uint32_t bit = j * 3;
+	    uint32_t v = bits[bit >> 3];
+	    if ((bit & 7) > 5)	// straddles a byte
+		v |= (uint32_t)bits[(bit >> 3) + 1] << 8;
+	    sRecord[j] = catChars[(v >> (bit & 7)) & 7];
+	}
+    } else {
+	const uint8_t *q = p + 1 + (h->timed ? 1 : 0);
+	for (uint32_t i = 0; i < p[0]; i++) {
+	    uint32_t change = q[i*2] | ((uint32_t)q[1 + i*2] << 8);
+	    uint32_t led = change >> 3;
+	    if (led < ledCount)
+		sRecord[led] = catChars[change & 7];
+	}
+    }
+}
+
+static void EncodeKeyframe(const struct History *h, uint8_t *p, const char *sRecord, uint32_t t)
+{
+    uint32_t ledCount = h->hdr->ledCount;
+    uint8_t *bits = p + 5;
+
+    p[0] = HISTORY_KEYFRAME;
+    PutTime(p + 1, t);
+    memset(bits, 0, KeyframeBytes(h) - 5);
+    for (uint32_t j = 0; j < ledCount; j++) {
+	uint32_t bit = j * 3;
+	uint32_t v = (uint32_t)CatCode(sRecord[j]) << (bit & 7);
+	bits[bit >> 3] |= v & 0xff;
+	if (v > 0xff)
+	    bits[(bit >> 3) + 1] |= v >> 8;
+    }
+}
+
+static void StartSegment(struct History *h)
+{
+    struct HistoryHeader *hdr = h->hdr;
+
+    hdr->head = (hdr->head + 1) % hdr->capacity;
+    if (hdr->count < hdr->capacity) {
+	hdr->count++;
+    } else {
+	// full - the segment we are about to reuse is the oldest, drop it
+	hdr->numRecords -= Segment(h, hdr->head)->numRecords;
+    }
+    Segment(h, hdr->head)->numRecords = 0;
+    Segment(h, hdr->head)->usedBytes = 0;
+}
+
+static void AppendRecord(struct History *h, const char *sRecord, time_t t, int doSync)
+{
+    struct HistoryHeader *hdr = h->hdr;
+    uint32_t keyBytes = KeyframeBytes(h);
+    uint32_t dataBytes = hdr->segmentSize - sizeof(struct SegmentHeader);
+    struct SegmentHeader *seg = Segment(h, hdr->head);
+    uint32_t numChanges = 0;
+
+    // the clock went back - keep the times in order so they can be searched
+    uint32_t tRec = t < 0 ? 0 : t > (time_t)UINT32_MAX ? UINT32_MAX : (uint32_t)t;
+    if (tRec < h->tLast)
+	tRec = h->tLast;
+    uint32_t step = (tRec - h->tLast + HISTORY_STEP_UNIT / 2) / HISTORY_STEP_UNIT;
+
+    for (uint32_t j = 0; j < hdr->ledCount; j++)
+	if (CatCode(sRecord[j]) != CatCode(h->sLast[j]))
+	    numChanges++;
+
+    int isKey = seg->numRecords % HISTORY_KEYFRAME_EVERY == 0 || step > HISTORY_MAX_STEP
+		|| numChanges > HISTORY_MAX_DELTA || DeltaBytes(h, numChanges) >= keyBytes;
+    uint32_t recBytes = isKey ? keyBytes : DeltaBytes(h, numChanges);
+
+    if (seg->usedBytes + recBytes > dataBytes) {
+	StartSegment(h);
+	seg = Segment(h, hdr->head);
+	isKey = TRUE;
+	recBytes = keyBytes;
+    }
+
+    uint8_t *p = SegmentData(h, hdr->head) + seg->usedBytes;
+    if (isKey) {
+	EncodeKeyframe(h, p, sRecord, tRec);
+    } else {
+	uint8_t *q = p + 2;
+	p[0] = (uint8_t)numChanges;
+	p[1] = (uint8_t)step;
+	tRec = h->tLast + step * HISTORY_STEP_UNIT;	// what a reader will make of it
+	for (uint32_t j = 0; j < hdr->ledCount; j++) {
+	    if (CatCode(sRecord[j]) != CatCode(h->sLast[j])) {
+		uint32_t change = (j << 3) | CatCode(sRecord[j]);
+		*q++ = change & 0xff;
+		*q++ = change >> 8;
+	    }
+	}
+    }
+    memcpy(h->sLast, sRecord, hdr->ledCount);
+    h->tLast = tRec;
+    h->bytesWritten += recBytes;
+
+    // data first, then the counts that make it visible
+    if (doSync)
+	SyncRange(p, recBytes);
+    seg->usedBytes += recBytes;
+    seg->numRecords++;
+    hdr->numRecords++;
+    if (doSync) {
+	SyncRange(seg, sizeof(*seg));
+	SyncRange(hdr, sizeof(*hdr));
+    }
+}
+
+static void InitHeader(struct History *h, int capacity, int ledCount, int segmentSize)
+{
+    struct HistoryHeader *hdr = h->hdr;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = HISTORY_MAGIC;
+    hdr->version = HISTORY_VERSION;
+    hdr->ledCount = ledCount;
+    hdr->segmentSize = segmentSize;
+    hdr->capacity = capacity;
+    hdr->head = 0;
+    hdr->count = 1;
+    Segment(h, 0)->numRecords = 0;
+    Segment(h, 0)->usedBytes = 0;
+    memset(h->sLast, 'E', ledCount);
+    h->tLast = 0;
+    h->timed = TRUE;
+}
+
+// records from before they had times: the newest taken when the file was last written, the rest a refresh apart
+static uint32_t *GuessTimes(uint32_t numRecs, time_t tNewest)
+{
+    uint32_t *times = malloc(sizeof(uint32_t) * (numRecs + 1));
+
+    for (uint32_t i = 0; times != NULL && i < numRecs; i++)
+	times[i] = tNewest - (time_t)(numRecs - 1 - i) * HISTORY_GUESS_SECS;
+    return times;
+}
+
+// pull the records out of a version 1 ring (one char per led per slot), oldest first
+static char *ReadSlotRing(int fd, uint32_t *pNumRecs, uint32_t *pRecSize)
+{
+    struct {
+	uint32_t magic, version, recordSize, capacity, head, count;
+    } old;
+
+    if (pread(fd, &old, sizeof(old), 0) != sizeof(old) || old.capacity == 0 || old.count > old.capacity)
+	return NULL;
+
+    char *sRecs = malloc((size_t)old.count * old.recordSize + 1);
+    if (sRecs == NULL)
+	return NULL;
+    for (uint32_t i = 0; i < old.count; i++) {
+	uint32_t slot = (old.head + old.capacity - old.count + i) % old.capacity;
+	off_t off = sizeof(old) + (off_t)slot * old.recordSize;
+	if (pread(fd, sRecs + (size_t)i * old.recordSize, old.recordSize, off) != (ssize_t)old.recordSize)
+	    memset(sRecs + (size_t)i * old.recordSize, 'E', old.recordSize);
+    }
+    *pNumRecs = old.count;
+    *pRecSize = old.recordSize;
+    return sRecs;
+}
+
+// pull the records out of a packed ring laid out for a different led count or size, or
+// from before records had times, oldest first
+static char *ReadPackedRing(int fd, size_t fileLen, time_t tModified, uint32_t *pNumRecs, uint32_t *pRecSize,
+			    uint32_t **pTimes)
+{
+    struct History old;
+    struct HistoryCursor c;
+    char *sRecs = NULL;
+
+    memset(&old, 0, sizeof(old));
+    void *map = mmap(NULL, fileLen, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+	return NULL;
+    old.hdr = map;
+    old.segments = (uint8_t *)map + old.hdr->segmentSize;
+    old.timed = old.hdr->version >= HISTORY_VERSION;
+    if (old.hdr->capacity == 0 || old.hdr->count > old.hdr->capacity
+	|| (size_t)old.hdr->segmentSize * (old.hdr->capacity + 1) > fileLen) {
+	munmap(map, fileLen);
+	return NULL;
+    }
+
+    uint32_t numRecs = old.hdr->numRecords;
+    uint32_t recSize = old.hdr->ledCount;
+    uint32_t *times = NULL;
+    if (HistoryCursorInit(&c, &old)) {
+	sRecs = malloc((size_t)numRecs * recSize + 1);
+	times = malloc(sizeof(uint32_t) * (numRecs + 1));
+	for (uint32_t i = 0; sRecs != NULL && times != NULL && i < numRecs; i++) {
+	    const char *sRecord = HistoryCursorNext(&c);
+	    if (sRecord == NULL) {
+		numRecs = i;
+		break;
+	    }
+	    memcpy(sRecs + (size_t)i * recSize, sRecord, recSize);
+	    times[i] = c.tRecord;
+	}
+	HistoryCursorFree(&c);
+    }
+    munmap(map, fileLen);
+    if (!old.timed) {
+	free(times);
+	times = GuessTimes(numRecs, tModified);
+    }
+    if (times == NULL) {
+	free(sRecs);
+	return NULL;
+    }
+
+    *pNumRecs = numRecs;
+    *pRecSize = recSize;
+    *pTimes = times;
+    return sRecs;
+}
+
+// more leds means bigger keyframes, give them room in proportion
+int HistorySegmentsFor(int ledCount)
+{
+    return HISTORY_SEGMENTS * ((ledCount + HISTORY_LEDS_PER_RING - 1) / HISTORY_LEDS_PER_RING);
+}
+
+// a file we can't read is kept as file.bad, not thrown away - it may be months of history
+static int SetAside(struct History *h, const char *fileName, const char *sWhy)
+{
+    char sBad[300];
+
+    snprintf(sBad, sizeof(sBad), "%s.bad", fileName);
+    fprintf(stderr, "history %s %s, keeping it as %s and starting over\n", fileName, sWhy, sBad);
+    close(h->fd);
+    h->fd = -1;
+    if (rename(fileName, sBad) != 0) {
+	fprintf(stderr, "Can't rename history %s %d\n", fileName, errno);
+	return FALSE;
+    }
+    h->fd = open(fileName, O_RDWR | O_CREAT, 0664);
+    if (h->fd < 0) {
+	fprintf(stderr, "Can't open history %s %d\n", fileName, errno);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Without writable the ring is only read: it's mapped read-only, and one
+ * that's missing, empty or would need converting or setting aside is an
+ * error rather than something we fix under a daemon that has it mapped.
+ */
+int HistoryOpen(struct History *h, const char *fileName, int capacity, int ledCount, int writable)
+{
+    struct stat st;
+    size_t mapLen = (size_t)HISTORY_SEGMENT_SIZE * (capacity + 1);
+    int isNew = FALSE;
+    const char *sUnreadable = NULL;	// why it has to be set aside
+    char *sOldRecs = NULL;
+    uint32_t *oldTimes = NULL;
+    uint32_t numOldRecs = 0;
+    uint32_t oldRecSize = 0;
+
+    memset(h, 0, sizeof(*h));
+    // a bigger map would write changes to the wrong leds and keyframes past their segment
+    if (ledCount <= 0 || ledCount > HISTORY_MAX_LEDS
+	|| 5 + ((uint32_t)ledCount * 3 + 7) / 8 > HISTORY_SEGMENT_SIZE - sizeof(struct SegmentHeader)) {
+	fprintf(stderr, "history can't keep %d leds, %d at most\n", ledCount, HISTORY_MAX_LEDS);
+	return FALSE;
+    }
+    h->fd = open(fileName, writable ? O_RDWR | O_CREAT : O_RDONLY, 0664);
+    if (h->fd < 0) {
+	fprintf(stderr, "Can't open history %s %d\n", fileName, errno);
+	return FALSE;
+    }
+
+    if (fstat(h->fd, &st) != 0) {
+	close(h->fd);
+	return FALSE;
+    }
+    if ((size_t)st.st_size < sizeof(struct HistoryHeader))
+	isNew = TRUE;
+    if (isNew && !writable) {
+	fprintf(stderr, "history %s is empty\n", fileName);
+	close(h->fd);
+	return FALSE;
+    }
+
+    if (!isNew) {
+	struct HistoryHeader hdr;
+	if (pread(h->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != HISTORY_MAGIC) {
+	    sUnreadable = "is not one of ours";
+	    isNew = TRUE;
+	} else if (hdr.version == HISTORY_VERSION_SLOTS) {
+	    sOldRecs = ReadSlotRing(h->fd, &numOldRecs, &oldRecSize);
+	    oldTimes = GuessTimes(numOldRecs, st.st_mtime);
+	    isNew = TRUE;
+	} else if (hdr.version == HISTORY_VERSION_UNTIMED) {
+	    sOldRecs = ReadPackedRing(h->fd, st.st_size, st.st_mtime, &numOldRecs, &oldRecSize, &oldTimes);
+	    isNew = TRUE;
+	} else if (hdr.version != HISTORY_VERSION) {
+	    sUnreadable = "is from a version we don't know";
+	    isNew = TRUE;
+	} else if (hdr.ledCount != (uint32_t)ledCount || hdr.capacity != (uint32_t)capacity
+		   || hdr.segmentSize != HISTORY_SEGMENT_SIZE) {
+	    // the map was resized - keep what we have, cut or padded to the new led count
+	    sOldRecs = ReadPackedRing(h->fd, st.st_size, st.st_mtime, &numOldRecs, &oldRecSize, &oldTimes);
+	    isNew = TRUE;
+	} else if ((size_t)st.st_size < mapLen) {	// mapped whole, a read past the end would be SIGBUS
+	    sUnreadable = "is cut short";
+	    isNew = TRUE;
+	}
+	if (sOldRecs != NULL && oldTimes == NULL) {
+	    free(sOldRecs);
+	    sOldRecs = NULL;
+	}
+	if (isNew && sOldRecs == NULL && sUnreadable == NULL)
+	    sUnreadable = "can't be converted";
+	if (isNew && !writable) {
+	    // a writer may have it mapped - converting it or starting over is the writer's job
+	    fprintf(stderr, "history %s %s, run the map once to sort it out\n", fileName,
+		    sUnreadable != NULL ? sUnreadable : "needs converting");
+	    free(sOldRecs);
+	    free(oldTimes);
+	    close(h->fd);
+	    return FALSE;
+	}
+	if (sUnreadable != NULL) {
+	    free(oldTimes);
+	    oldTimes = NULL;
+	    if (!SetAside(h, fileName, sUnreadable))
+		return FALSE;
+	} else if (isNew && ftruncate(h->fd, 0) != 0) {
+	    free(sOldRecs);
+	    free(oldTimes);
+	    close(h->fd);
+	    return FALSE;
+	}
+    }
+
+    if (isNew && ftruncate(h->fd, mapLen) != 0) {
+	fprintf(stderr, "Can't size history %s %d\n", fileName, errno);
+	free(sOldRecs);
+	free(oldTimes);
+	close(h->fd);
+	return FALSE;
+    }
+
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, mapLen, prot, MAP_SHARED, h->fd, 0);
+    h->sLast = malloc(ledCount);
+    if (map == MAP_FAILED || h->sLast == NULL) {
+	fprintf(stderr, "Can't map history %s %d\n", fileName, errno);
+	if (map != MAP_FAILED)
+	    munmap(map, mapLen);
+	free(h->sLast);
+	free(sOldRecs);
+	free(oldTimes);
+	close(h->fd);
+	return FALSE;
+    }
+    h->mapLen = mapLen;
+    h->hdr = map;
+    h->segments = (uint8_t *)map + HISTORY_SEGMENT_SIZE;
+
+    if (isNew) {
+	InitHeader(h, capacity, ledCount, HISTORY_SEGMENT_SIZE);
+	if (sOldRecs != NULL) {
+	    char sRecord[ledCount];
+	    for (uint32_t i = 0; i < numOldRecs; i++) {
+		memset(sRecord, 'E', ledCount);
+		memcpy(sRecord, sOldRecs + (size_t)i * oldRecSize, oldRecSize < (uint32_t)ledCount ? oldRecSize : (uint32_t)ledCount);
+		AppendRecord(h, sRecord, oldTimes[i], FALSE);
+	    }
+	    printf("converted %u records in %s for %d leds\n", numOldRecs, fileName, ledCount);
+	    free(sOldRecs);
+	    free(oldTimes);
+	} else if (strcmp(fileName, HistoryFileName()) == 0) {	// not for a scratch ring
+	    HistoryImportText(h, test_mode == TRUE ? LEGACY_HISTORY_TEST_FILE : LEGACY_HISTORY_FILE);
+	}
+	SyncRange(h->hdr, h->mapLen);
+    } else {
+	// the counts in the segments are written before the header's, trust them
+	struct HistoryCursor c;
+	uint32_t numRecords = 0;
+	for (uint32_t i = 0; i < h->hdr->count; i++)
+	    numRecords += Segment(h, (OldestSegment(h) + i) % h->hdr->capacity)->numRecords;
+	if (writable && h->hdr->numRecords != numRecords)
+	    h->hdr->numRecords = numRecords;	// killed between the two, a reader lives with it
+
+	// pick up the newest record so the next append can be a delta against it
+	h->timed = TRUE;
+	memset(h->sLast, 'E', ledCount);
+	if (numRecords > 0 && HistoryCursorInit(&c, h)) {
+	    const char *sRecord;
+	    HistoryCursorSeek(&c, 0);
+	    if ((sRecord = HistoryCursorNext(&c)) != NULL) {
+		memcpy(h->sLast, sRecord, ledCount);
+		h->tLast = c.tRecord;
+	    }
+	    HistoryCursorFree(&c);
+	}
+    }
+
+    return TRUE;
+}
+
+void HistoryAppend(struct History *h, const char *sRecord, time_t t)
+{
+    AppendRecord(h, sRecord, t, TRUE);
+}
+
+// for a bulk load - no msync per record, HistorySync once at the end
+void HistoryAppendNoSync(struct History *h, const char *sRecord, time_t t)
+{
+    AppendRecord(h, sRecord, t, FALSE);
+}
+
+void HistorySync(struct History *h)
+{
+    SyncRange(h->hdr, h->mapLen);
+}
+
+// empty the ring, same size and led count
+void HistoryClear(struct History *h)
+{
+    InitHeader(h, h->hdr->capacity, h->hdr->ledCount, h->hdr->segmentSize);
+    SyncRange(h->hdr, h->mapLen);
+}
+
+int HistoryCount(const struct History *h)
+{
+    return (int)h->hdr->numRecords;
+}
+
+// when the oldest and newest records were taken, FALSE if there aren't any
+int HistoryTimeRange(const struct History *h, time_t *pFirst, time_t *pLast)
+{
+    if (h->hdr->numRecords == 0)
+	return FALSE;
+    *pFirst = GetTime(SegmentData(h, OldestSegment(h)) + 1);	// a segment starts with a keyframe
+    *pLast = h->tLast;
+    return TRUE;
+}
+
+/*
+ * One time conversion of the old day.dat - newest record first, each record
+ * "NNC" per led plus '\n'. We add them oldest first so the ring ends up in order.
+ */
+int HistoryImportText(struct History *h, const char *textFileName)
+{
+    FILE *fDay = fopen(textFileName, "r");
+    if (fDay == NULL)
+	return 0;
+
+    struct stat st;
+    time_t tNewest = fstat(fileno(fDay), &st) == 0 ? st.st_mtime : time(NULL);
+    fseek(fDay, 0L, SEEK_END);
+    long int numrecs = ftell(fDay) / (REC_LEN);
+
+    char sText[REC_LEN+1];
+    char sRecord[h->hdr->ledCount];
+    int numImported = 0;
+
+    for (long int i = numrecs - 1; i >= 0; i--) {
+	if (fseek(fDay, i * (REC_LEN), SEEK_SET) != 0 || fread(sText, REC_LEN, 1, fDay) < 1)
+	    continue;
+	for (uint32_t j = 0; j < h->hdr->ledCount; j++)
+	    sRecord[j] = j < LED_COUNT ? sText[(j*3)+2] : 'E';
+	AppendRecord(h, sRecord, tNewest - (time_t)i * HISTORY_GUESS_SECS, FALSE);	// one sync for the lot at the end
+	numImported++;
+    }
+    fclose(fDay);
+
+    printf("converted %d records from %s to %s\n", numImported, textFileName, HistoryFileName());
+    return numImported;
+}
+
+void HistoryClose(struct History *h)
+{
+    if (h->hdr != NULL)
+	munmap(h->hdr, h->mapLen);
+    if (h->fd >= 0)
+	close(h->fd);
+    free(h->sLast);
+    h->hdr = NULL;
+    h->segments = NULL;
+    h->sLast = NULL;
+    h->fd = -1;
+}
+
+int HistoryCursorInit(struct HistoryCursor *c, const struct History *h)
+{
+    memset(c, 0, sizeof(*c));
+    c->h = h;
+    c->sRecord = malloc(h->hdr->ledCount);
+    if (c->sRecord == NULL)
+	return FALSE;
+    memset(c->sRecord, 'E', h->hdr->ledCount);
+    HistoryCursorSeek(c, h->hdr->numRecords - 1);	// start at the oldest
+    return TRUE;
+}
+
+// put c at record want of segment seg, decoding from the keyframe before it
+static void SeekInSegment(struct HistoryCursor *c, uint32_t seg, uint32_t segsLeft, uint32_t want)
+{
+    const struct History *h = c->h;
+
+    // skip to the last keyframe at or before the one we want, then decode up to it
+    const uint8_t *p = SegmentData(h, seg);
+    const uint8_t *pKey = p;
+    uint32_t keyIndex = 0;
+    for (uint32_t i = 0; i < want; i++) {
+	p += RecordBytes(h, p);
+	if (p[0] == HISTORY_KEYFRAME) {
+	    pKey = p;
+	    keyIndex = i + 1;
+	}
+    }
+    p = pKey;
+    for (uint32_t i = keyIndex; i < want; i++) {
+	DecodeRecord(h, p, c->sRecord, &c->tRecord);
+	p += RecordBytes(h, p);
+    }
+
+    c->seg = seg;
+    c->segsLeft = segsLeft;
+    c->p = p;
+    c->recsLeft = Segment(h, seg)->numRecords - want;
+    ReadAhead(h, seg, segsLeft);
+}
+
+// set up so the next HistoryCursorNext returns the record this old (0 is the newest)
+int HistoryCursorSeek(struct HistoryCursor *c, int age)
+{
+    const struct History *h = c->h;
+    const struct HistoryHeader *hdr = h->hdr;
+
+    c->recsLeft = 0;
+    c->segsLeft = 0;
+    if (age < 0 || (uint32_t)age >= hdr->numRecords)
+	return FALSE;
+
+    // find the segment, counting from the oldest
+    uint32_t want = hdr->numRecords - 1 - age;
+    uint32_t seg = OldestSegment(h);
+    uint32_t segsLeft = hdr->count - 1;
+    while (want >= Segment(h, seg)->numRecords && segsLeft > 0) {
+	want -= Segment(h, seg)->numRecords;
+	seg = (seg + 1) % hdr->capacity;
+	segsLeft--;
+    }
+
+    SeekInSegment(c, seg, segsLeft, want);
+    return TRUE;
+}
+
+// set up so the next HistoryCursorNext returns the first record taken at or after t
+int HistoryCursorSeekTime(struct HistoryCursor *c, time_t t)
+{
+    const struct History *h = c->h;
+    const struct HistoryHeader *hdr = h->hdr;
+    uint32_t oldest = OldestSegment(h);
+    uint32_t lo = 0, hi = hdr->count;	// counting from the oldest segment
+
+    c->recsLeft = 0;
+    c->segsLeft = 0;
+    if (hdr->numRecords == 0 || !h->timed)
+	return FALSE;
+
+    // the last segment starting at or before t, the oldest if they all start after it
+    while (hi - lo > 1) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	uint32_t seg = (oldest + mid) % hdr->capacity;
+	if (Segment(h, seg)->numRecords > 0 && (time_t)GetTime(SegmentData(h, seg) + 1) <= t)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    // and the first record in it at or after t
+    uint32_t seg = (oldest + lo) % hdr->capacity;
+    uint32_t segsLeft = hdr->count - 1 - lo;
+    const uint8_t *p = SegmentData(h, seg);
+    uint32_t tRec = 0;
+    uint32_t want;
+    for (want = 0; want < Segment(h, seg)->numRecords; want++) {
+	tRec = RecordTime(h, p, tRec);
+	if ((time_t)tRec >= t)
+	    break;
+	p += RecordBytes(h, p);
+    }
+    if (want == Segment(h, seg)->numRecords) {	// all before t, so it's the start of the next one
+	if (segsLeft == 0)
+	    return FALSE;
+	seg = (seg + 1) % hdr->capacity;
+	segsLeft--;
+	want = 0;
+    }
+
+    SeekInSegment(c, seg, segsLeft, want);
+    return TRUE;
+}
+
+// the next record, oldest to newest, or NULL when we run out
+const char *HistoryCursorNext(struct HistoryCursor *c)
+{
+    const struct History *h = c->h;
+
+    while (c->recsLeft == 0) {
+	if (c->segsLeft == 0)
+	    return NULL;
+	c->seg = (c->seg + 1) % h->hdr->capacity;
+	c->segsLeft--;
+	c->p = SegmentData(h, c->seg);
+	c->recsLeft = Segment(h, c->seg)->numRecords;
+	ReadAhead(h, c->seg, c->segsLeft);
+    }
+
+    DecodeRecord(h, c->p, c->sRecord, &c->tRecord);
+    c->p += RecordBytes(h, c->p);
+    c->recsLeft--;
+    return c->sRecord;
+}
+
+void HistoryCursorFree(struct HistoryCursor *c)
+{
+    free(c->sRecord);
+    c->sRecord = NULL;
+}
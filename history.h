@@ -0,0 +1,104 @@
+#include <stdint.h>
+#include <time.h>
+
+#define HISTORY_FILE "day.ring"
+#define HISTORY_TEST_FILE "daytest.ring"
+#define LEGACY_HISTORY_FILE "day.dat"		// the old newest-first text file, converted once
+#define LEGACY_HISTORY_TEST_FILE "daytest.dat"
+
+#define HISTORY_MAGIC 0x474e5248	// "HRNG"
+#define HISTORY_VERSION 3
+#define HISTORY_VERSION_UNTIMED 2	// records without their times, converted when we open it
+#define HISTORY_VERSION_SLOTS 1		// one char per led per slot, converted when we open it
+
+#define HISTORY_SEGMENT_SIZE 4096	// one page, so an append dirties one data page and the header
+#define HISTORY_SEGMENTS 64		// 256K - at a few changes per refresh that is over 6 months
+#define HISTORY_LEDS_PER_RING 50	// ... for this many leds, HistorySegmentsFor scales it up
+#define HISTORY_KEYFRAME_EVERY 64	// records between keyframes inside a segment
+#define HISTORY_READAHEAD 2		// segments a replay cursor asks the kernel to page in ahead of it
+#define HISTORY_MAX_LEDS 8191		// a delta's change is the led << 3 in 2 bytes, and a keyframe
+					// for this many fits in a segment with room to spare
+
+// record encoding - first byte is the type
+#define HISTORY_KEYFRAME 0xFF		// followed by the time, 4 bytes, and 3 bits per led
+#define HISTORY_MAX_DELTA 0xFE		// else the byte is a count of changed leds, then a step byte
+					// and the changes, 2 bytes each
+#define HISTORY_STEP_UNIT 4		// seconds per step - a record's time after the one before
+#define HISTORY_MAX_STEP 0xFF		// anything longer, a gap, makes a keyframe
+#define HISTORY_GUESS_SECS 300		// how far apart records without times are taken to be
+
+// category codes, 3 bits each
+#define HCAT_NONE 0	// 'E' - no data
+#define HCAT_VFR 1
+#define HCAT_MVFR 2
+#define HCAT_IFR 3
+#define HCAT_LIFR 4
+
+/*
+ * On disk: this header padded out to a segment, then HistorySegmentsFor() segments
+ * used as a ring. Each segment starts with a SegmentHeader and a keyframe, the
+ * rest are keyframes or deltas against the record before. When the ring is
+ * full the oldest segment is dropped whole, so every segment can be decoded
+ * on its own.
+ *
+ * Every record has the time it was taken - epoch seconds in a keyframe, a
+ * step since the record before in a delta. Times only go forward, so the
+ * first keyframe of each segment is a sparse index: a binary search over the
+ * segments and a walk through one of them finds any time.
+ */
+struct HistoryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ledCount;
+    uint32_t segmentSize;
+    uint32_t capacity;		// segments
+    uint32_t head;		// segment being filled
+    uint32_t count;		// segments in use, at most capacity
+    uint32_t numRecords;	// records in all of them
+};
+
+struct SegmentHeader {
+    uint32_t numRecords;
+    uint32_t usedBytes;		// after this header
+};
+
+struct History {
+    int fd;
+    size_t mapLen;
+    struct HistoryHeader *hdr;
+    uint8_t *segments;
+    char *sLast;		// newest record, what the next delta is against
+    uint32_t tLast;		// and its time
+    int timed;			// FALSE reading an untimed ring to convert it
+    uint64_t bytesWritten;	// appended since it was opened
+};
+
+// reads records oldest to newest, one at a time, straight out of the map -
+// memory use is one record no matter how much history is replayed
+struct HistoryCursor {
+    const struct History *h;
+    uint32_t seg;		// segment we are in
+    uint32_t segsLeft;		// segments after this one
+    const uint8_t *p;		// next record in the segment
+    uint32_t recsLeft;		// records left in the segment
+    char *sRecord;		// decoded state, one category char per led
+    uint32_t tRecord;		// and the time of it
+};
+
+const char *HistoryFileName(void);
+int HistorySegmentsFor(int ledCount);
+int HistoryOpen(struct History *h, const char *fileName, int capacity, int ledCount, int writable);
+void HistoryAppend(struct History *h, const char *sRecord, time_t t);
+void HistoryAppendNoSync(struct History *h, const char *sRecord, time_t t);
+void HistorySync(struct History *h);
+void HistoryClear(struct History *h);
+int HistoryCount(const struct History *h);
+int HistoryTimeRange(const struct History *h, time_t *pFirst, time_t *pLast);
+int HistoryImportText(struct History *h, const char *textFileName);
+void HistoryClose(struct History *h);
+
+int HistoryCursorInit(struct HistoryCursor *c, const struct History *h);
+int HistoryCursorSeek(struct HistoryCursor *c, int age);
+int HistoryCursorSeekTime(struct HistoryCursor *c, time_t t);
+const char *HistoryCursorNext(struct HistoryCursor *c);
+void HistoryCursorFree(struct HistoryCursor *c);
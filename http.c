@@ -0,0 +1,678 @@
+/**********************************************************************
+* Filename    : http.c
+* Description : Event loop HTTP server for the map's state, live
+*               updates and the replay controls
+*
+* Non-blocking sockets on one level triggered epoll set. A client is a
+* slot in a fixed table with its request read into the slot and what it
+* is owed queued behind it; EPOLLOUT is only asked for while something
+* is queued. Events for /events viewers are built once and copied to
+* each of them, and one that stops reading is dropped rather than let
+* it hold up the string. Frame and station events are diffs against
+* what went out last, which is kept up to date whether or not anyone
+* is watching so a viewer's first "state" and the diffs after it agree.
+**********************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "METARmap.h"
+#include "matrix.h"
+#include "metrics.h"
+#include "control.h"
+#include "http.h"
+
+struct HttpClient {
+    int fd;			// -1 for a free slot
+    int streaming;		// an /events viewer, kept open
+    int watchingOut;		// EPOLLOUT asked for
+    int closeWhenSent;
+    time_t tAccepted;
+    char in[HTTP_REQUEST_MAX + 1];
+    size_t inLen;
+    char *out;			// queued, out[outSent] is next
+    size_t outLen;
+    size_t outSent;
+    size_t outCap;
+};
+
+// text built up a printf at a time
+struct HttpText {
+    char *s;
+    size_t len;
+    size_t cap;
+};
+
+int http_port = 0;
+int http_fd = -1;
+static int listenFd = -1;
+static struct HttpClient clients[HTTP_MAX_CLIENTS];
+static int numStreaming;
+
+// what went out last, for the diffs
+static ws2811_led_t *sentFrame;
+static int sentFrameLeds;
+static char *sentCond;
+static time_t *sentObserved;
+static int sentStations;
+static const char *sentMode = "";
+
+static const char sPage[] =
+    "<!DOCTYPE html>\n<html><head><meta name=\"viewport\" content=\"width=device-width\">\n"
+    "<title>METAR map</title>\n"
+    "<style>body{width:960px;margin:20px auto;font-family:sans-serif}"
+    "input{height:50px;width:200px;font-size:large}td{padding:2px 12px}</style></head>\n"
+    "<body>\n<h1>METAR map</h1>\n<p>Showing: <b id=\"mode\"></b></p>\n"
+    "<form action=\"/\" method=\"POST\">\n"
+    "<label style=\"font-size:large\" for=\"hours\">Hours to replay (1 to 4320):</label>\n"
+    "<input type=\"number\" id=\"hours\" name=\"hours\" min=\"1\" max=\"4320\">\n"
+    "<input type=\"submit\" name=\"submit\" value=\"Ok\">\n"
+    "<input type=\"submit\" name=\"submit\" value=\"Clear\">\n"
+    "<input type=\"submit\" name=\"submit\" value=\"On\">\n"
+    "</form>\n<table id=\"stations\"></table>\n<script>\n"
+    "var rows = {};\n"
+    "function show(s) {\n"
+    "  var r = rows[s.id];\n"
+    "  if (!r) { r = rows[s.id] = document.getElementById('stations').insertRow(); r.insertCell(); r.insertCell(); r.insertCell(); }\n"
+    "  r.cells[0].textContent = s.id;\n"
+    "  r.cells[1].textContent = s.category;\n"
+    "  r.cells[2].textContent = s.age == null ? '' : Math.round(s.age / 60) + ' min old';\n"
+    "}\n"
+    "function mode(m) { document.getElementById('mode').textContent = m; }\n"
+    "var es = new EventSource('/events');\n"
+    "es.addEventListener('state', function (e) { var d = JSON.parse(e.data); mode(d.mode); d.stations.forEach(show); });\n"
+    "es.addEventListener('stations', function (e) { JSON.parse(e.data).stations.forEach(show); });\n"
+    "es.addEventListener('mode', function (e) { mode(JSON.parse(e.data).mode); });\n"
+    "</script>\n</body></html>\n";
+
+static void TextPrintf(struct HttpText *t, const char *sFormat, ...)
+{
+    va_list args;
+
+    for (;;) {
+	size_t room = t->cap - t->len;
+	va_start(args, sFormat);
+	int n = vsnprintf(t->s != NULL ? t->s + t->len : NULL, room, sFormat, args);
+	va_end(args);
+	if (n < 0)
+	    return;
+	if ((size_t)n < room) {
+	    t->len += n;
+	    return;
+	}
+	size_t cap = t->cap ? t->cap * 2 : 4096;
+	while (cap - t->len <= (size_t)n)
+	    cap *= 2;
+	char *s = realloc(t->s, cap);
+	if (s == NULL)
+	    return;
+	t->s = s;
+	t->cap = cap;
+    }
+}
+
+static const char *Mode(void)
+{
+    return replaying ? "replay" : lights_off ? "off" : night_mode ? "dark" : "live";
+}
+
+static const char *CategoryName(char cCond)
+{
+    switch (cCond) {
+    case 'V': return "VFR";
+    case 'M': return "MVFR";
+    case 'I': return "IFR";
+    case 'L': return "LIFR";
+    default: return "none";
+    }
+}
+
+static void StationJson(struct HttpText *t, const struct stAirport *a, time_t tNow)
+{
+    TextPrintf(t, "{\"id\":\"%s\",\"led\":%d,\"category\":\"%s\",", a->sAirportCode, a->iLedNo,
+	       CategoryName(a->cCond));
+    if (a->tObserved != 0)
+	TextPrintf(t, "\"observed\":%lld,\"age\":%lld}", (long long)a->tObserved, (long long)(tNow - a->tObserved));
+    else
+	TextPrintf(t, "\"observed\":null,\"age\":null}");
+}
+
+static void StateJson(struct HttpText *t)
+{
+    const struct stAirport *airports;
+    int numAirports = GetAirports(&airports);
+    time_t tNow = time(NULL);
+
+    TextPrintf(t, "{\"mode\":\"%s\",\"brightness\":%d,\"refreshes\":%lu,\"last_refresh\":%lld,\"now\":%lld,"
+	       "\"stations\":[", Mode(), matrix_get_brightness(), (unsigned long)metrics.refreshes,
+	       (long long)metrics.lastRefresh, (long long)tNow);
+    for (int i = 0; i < numAirports; i++) {
+	if (i > 0)
+	    TextPrintf(t, ",");
+	StationJson(t, &airports[i], tNow);
+    }
+    TextPrintf(t, "],\"leds\":[");
+    for (int j = 0; j < led_count; j++)
+	TextPrintf(t, j > 0 ? ",\"%06x\"" : "\"%06x\"", (unsigned)(matrix[j] & 0xffffff));
+    TextPrintf(t, "]}");
+}
+
+static void CloseClient(struct HttpClient *cl)
+{
+    epoll_ctl(http_fd, EPOLL_CTL_DEL, cl->fd, NULL);
+    close(cl->fd);
+    if (cl->streaming)
+	numStreaming--;
+    free(cl->out);
+    memset(cl, 0, sizeof(*cl));
+    cl->fd = -1;
+}
+
+static void WatchOut(struct HttpClient *cl, int watch)
+{
+    if (cl->watchingOut == watch)
+	return;
+    struct epoll_event ev = { .events = EPOLLIN | (watch ? EPOLLOUT : 0), .data.ptr = cl };
+    epoll_ctl(http_fd, EPOLL_CTL_MOD, cl->fd, &ev);
+    cl->watchingOut = watch;
+}
+
+// send what's queued, as much as the socket takes
+static void Flush(struct HttpClient *cl)
+{
+    while (cl->outSent < cl->outLen) {
+	ssize_t n = send(cl->fd, cl->out + cl->outSent, cl->outLen - cl->outSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    WatchOut(cl, TRUE);
+	    return;
+	}
+	if (n <= 0) {
+	    CloseClient(cl);
+	    return;
+	}
+	cl->outSent += n;
+    }
+    cl->outLen = cl->outSent = 0;
+    WatchOut(cl, FALSE);
+    if (cl->closeWhenSent)
+	CloseClient(cl);
+}
+
+static void Queue(struct HttpClient *cl, const char *s, size_t len)
+{
+    if (cl->outSent > 0) {	// what's been sent makes room
+	memmove(cl->out, cl->out + cl->outSent, cl->outLen - cl->outSent);
+	cl->outLen -= cl->outSent;
+	cl->outSent = 0;
+    }
+    if (cl->outLen + len > HTTP_OUT_MAX) {
+	fprintf(stderr, "http: dropping a client that isn't keeping up\n");
+	CloseClient(cl);
+	return;
+    }
+    if (cl->outLen + len > cl->outCap) {
+	size_t cap = cl->outCap ? cl->outCap : 4096;
+	while (cap < cl->outLen + len)
+	    cap *= 2;
+	char *out = realloc(cl->out, cap);
+	if (out == NULL) {
+	    CloseClient(cl);
+	    return;
+	}
+	cl->out = out;
+	cl->outCap = cap;
+    }
+    memcpy(cl->out + cl->outLen, s, len);
+    cl->outLen += len;
+    Flush(cl);
+}
+
+static void Respond(struct HttpClient *cl, int status, const char *sStatus, const char *sType,
+		    const char *sExtra, const char *sBody, size_t len)
+{
+    struct HttpText t = { 0 };
+
+    // in one piece, Flush closes as soon as the queue empties
+    TextPrintf(&t, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+	       "Cache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\nConnection: close\r\n%s\r\n%.*s",
+	       status, sStatus, sType, len, sExtra, (int)len, len > 0 ? sBody : "");
+    cl->closeWhenSent = TRUE;
+    if (t.s != NULL)
+	Queue(cl, t.s, t.len);
+    else
+	CloseClient(cl);
+    free(t.s);
+}
+
+static void RespondText(struct HttpClient *cl, int status, const char *sStatus, const char *sBody)
+{
+    Respond(cl, status, sStatus, "application/json", "", sBody, strlen(sBody));
+}
+
+// one event to every /events viewer
+static void Broadcast(const char *sEvent, const struct HttpText *data)
+{
+    struct HttpText t = { 0 };
+
+    if (numStreaming == 0 || data->s == NULL)
+	return;
+    TextPrintf(&t, "event: %s\ndata: %.*s\n\n", sEvent, (int)data->len, data->s);
+    for (int i = 0; i < HTTP_MAX_CLIENTS && t.s != NULL; i++)
+	if (clients[i].fd >= 0 && clients[i].streaming)
+	    Queue(&clients[i], t.s, t.len);
+    free(t.s);
+}
+
+// name=value out of a query string or form body, FALSE if it isn't there
+static int FormValue(const char *s, const char *sName, char *sValue, size_t len)
+{
+    size_t nameLen = strlen(sName);
+
+    while (s != NULL && *s != '\0') {
+	if (strncmp(s, sName, nameLen) == 0 && s[nameLen] == '=') {
+	    s += nameLen + 1;
+	    size_t n = strcspn(s, "&\r\n ");
+	    if (n >= len)
+		n = len - 1;
+	    memcpy(sValue, s, n);
+	    sValue[n] = '\0';
+	    return TRUE;
+	}
+	s = strchr(s, '&');
+	if (s != NULL)
+	    s++;
+    }
+    return FALSE;
+}
+
+static int FormNumber(const char *sQuery, const char *sBody, const char *sName, int *pValue)
+{
+    char sValue[16];
+
+    if (!FormValue(sQuery, sName, sValue, sizeof(sValue)) && !FormValue(sBody, sName, sValue, sizeof(sValue)))
+	return FALSE;
+    char *pEnd;
+    long v = strtol(sValue, &pEnd, 10);
+    if (pEnd == sValue || *pEnd != '\0')
+	return FALSE;
+    *pValue = (int)v;
+    return TRUE;
+}
+
+// a POST, made into a command for the daemon. FALSE if it wasn't one
+static int PostCommand(const char *sPath, const char *sQuery, const char *sBody, struct ControlCommand *c)
+{
+    static const struct { const char *sPath; int cmd; const char *sArg; } posts[] = {
+	{ "/replay", CMD_REPLAY, "hours" },
+	{ "/stop", CMD_STOP, NULL },
+	{ "/off", CMD_OFF, NULL },
+	{ "/on", CMD_ON, NULL },
+	{ "/refresh", CMD_REFRESH, NULL },
+	{ "/brightness", CMD_BRIGHTNESS, "value" },
+    };
+    char sSubmit[16];
+
+    c->arg = 0;
+    if (strcmp(sPath, "/") == 0) {	// the WebIO.py form
+	if (!FormValue(sBody, "submit", sSubmit, sizeof(sSubmit)))
+	    return FALSE;
+	if (strcmp(sSubmit, "Ok") == 0) {
+	    c->cmd = CMD_REPLAY;
+	    return FormNumber(sQuery, sBody, "hours", &c->arg);
+	}
+	c->cmd = strcmp(sSubmit, "On") == 0 ? CMD_ON : CMD_OFF;
+	return TRUE;
+    }
+
+    for (size_t i = 0; i < sizeof(posts) / sizeof(posts[0]); i++) {
+	if (strcmp(sPath, posts[i].sPath) != 0)
+	    continue;
+	c->cmd = posts[i].cmd;
+	return posts[i].sArg == NULL || FormNumber(sQuery, sBody, posts[i].sArg, &c->arg);
+    }
+    return FALSE;
+}
+
+static void StartEvents(struct HttpClient *cl)
+{
+    static const char sHead[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+	"Access-Control-Allow-Origin: *\r\nConnection: keep-alive\r\n\r\nretry: 5000\n\n";
+    struct HttpText t = { 0 };
+
+    if (numStreaming >= HTTP_MAX_VIEWERS) {	// leave room for the requests
+	RespondText(cl, 503, "Service Unavailable", "{\"error\":\"too many watching\"}");
+	return;
+    }
+    cl->streaming = TRUE;
+    numStreaming++;
+    Queue(cl, sHead, sizeof(sHead) - 1);
+    if (cl->fd < 0)
+	return;
+    TextPrintf(&t, "event: state\ndata: ");
+    StateJson(&t);
+    TextPrintf(&t, "\n\n");
+    if (t.s != NULL)
+	Queue(cl, t.s, t.len);
+    free(t.s);
+}
+
+/*
+ * The request in cl->in is all there. A POST that makes a command goes in
+ * *c unless there's one there already from this round - TRUE if it did.
+ */
+static int HandleRequest(struct HttpClient *cl, char *sBody, struct ControlCommand *c)
+{
+    char sMethod[8], sTarget[256];
+
+    if (sscanf(cl->in, "%7s %255s", sMethod, sTarget) != 2) {
+	RespondText(cl, 400, "Bad Request", "{\"error\":\"bad request\"}");
+	return FALSE;
+    }
+    char *sQuery = strchr(sTarget, '?');
+    if (sQuery != NULL)
+	*sQuery++ = '\0';
+
+    int isHead = strcmp(sMethod, "HEAD") == 0;
+    if (strcmp(sMethod, "GET") == 0 || isHead) {
+	if (strcmp(sTarget, "/") == 0)
+	    Respond(cl, 200, "OK", "text/html; charset=utf-8", "", sPage, isHead ? 0 : sizeof(sPage) - 1);
+	else if (strcmp(sTarget, "/state") == 0) {
+	    struct HttpText t = { 0 };
+	    StateJson(&t);
+	    Respond(cl, 200, "OK", "application/json", "", t.s, isHead ? 0 : t.len);
+	    free(t.s);
+	} else if (strcmp(sTarget, "/events") == 0 && !isHead)
+	    StartEvents(cl);
+	else
+	    RespondText(cl, 404, "Not Found", "{\"error\":\"not found\"}");
+	return FALSE;
+    }
+
+    if (strcmp(sMethod, "POST") != 0) {
+	RespondText(cl, 405, "Method Not Allowed", "{\"error\":\"GET or POST\"}");
+	return FALSE;
+    }
+    if (c->cmd != CMD_NONE) {
+	RespondText(cl, 503, "Service Unavailable", "{\"error\":\"busy, try again\"}");
+	return FALSE;
+    }
+    if (!PostCommand(sTarget, sQuery, sBody, c)) {
+	c->cmd = CMD_NONE;
+	RespondText(cl, 400, "Bad Request", "{\"error\":\"unknown command or missing value\"}");
+	return FALSE;
+    }
+    printf("http: %s %s\n", sMethod, sTarget);
+    if (strcmp(sTarget, "/") == 0)	// back to the page, like WebIO.py did
+	Respond(cl, 303, "See Other", "text/html", "Location: /\r\n", "", 0);
+    else
+	RespondText(cl, 202, "Accepted", "{\"ok\":true}");
+    return TRUE;
+}
+
+// more of a request came in, deal with it once it's all there
+static int ReadRequest(struct HttpClient *cl, struct ControlCommand *c)
+{
+    char sDrain[512];
+
+    if (cl->streaming || cl->closeWhenSent) {	// nothing more wanted from them, just notice when they go
+	ssize_t n = recv(cl->fd, sDrain, sizeof(sDrain), MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+	    CloseClient(cl);
+	return FALSE;
+    }
+
+    ssize_t n = recv(cl->fd, cl->in + cl->inLen, HTTP_REQUEST_MAX - cl->inLen, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return FALSE;
+    if (n <= 0) {
+	CloseClient(cl);
+	return FALSE;
+    }
+    cl->inLen += n;
+    cl->in[cl->inLen] = '\0';
+
+    char *pEnd = strstr(cl->in, "\r\n\r\n");
+    if (pEnd == NULL) {
+	if (cl->inLen == HTTP_REQUEST_MAX)
+	    RespondText(cl, 413, "Payload Too Large", "{\"error\":\"too long\"}");
+	return FALSE;
+    }
+    char *sBody = pEnd + 4;
+
+    // a form body is as long as Content-Length says
+    size_t bodyLen = 0;
+    for (char *p = strstr(cl->in, "\r\n"); p != NULL && p < pEnd; p = strstr(p + 2, "\r\n"))
+	if (strncasecmp(p + 2, "Content-Length:", 15) == 0)
+	    bodyLen = strtoul(p + 17, NULL, 10);
+    if (bodyLen > (size_t)(cl->in + HTTP_REQUEST_MAX - sBody)) {
+	RespondText(cl, 413, "Payload Too Large", "{\"error\":\"too long\"}");
+	return FALSE;
+    }
+    if ((size_t)(cl->in + cl->inLen - sBody) < bodyLen)
+	return FALSE;	// more to come
+    sBody[bodyLen] = '\0';
+    *pEnd = '\0';
+    return HandleRequest(cl, sBody, c);
+}
+
+static void Accept(void)
+{
+    for (;;) {
+	int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+	    return;
+
+	struct HttpClient *cl = NULL, *oldest = NULL;
+	for (int i = 0; i < HTTP_MAX_CLIENTS && cl == NULL; i++) {
+	    if (clients[i].fd < 0)
+		cl = &clients[i];
+	    else if (!clients[i].streaming && (oldest == NULL || clients[i].tAccepted < oldest->tAccepted))
+		oldest = &clients[i];
+	}
+	if (cl == NULL && oldest != NULL) {	// full up, the slowest request makes way
+	    CloseClient(oldest);
+	    cl = oldest;
+	}
+	if (cl == NULL) {
+	    close(fd);	// can't happen while viewers are held to HTTP_MAX_VIEWERS
+	    continue;
+	}
+
+	memset(cl, 0, sizeof(*cl));
+	cl->fd = fd;
+	cl->tAccepted = time(NULL);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cl };
+	if (epoll_ctl(http_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+	    close(fd);
+	    cl->fd = -1;
+	}
+    }
+}
+
+int HttpOpen(void)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    for (int i = 0; i < HTTP_MAX_CLIENTS; i++)
+	clients[i].fd = -1;
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+	perror("http socket");
+	return FALSE;
+    }
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(http_port);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0) {
+	fprintf(stderr, "http port %d: %s\n", http_port, strerror(errno));
+	close(listenFd);
+	listenFd = -1;
+	return FALSE;
+    }
+
+    http_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (http_fd < 0 || epoll_ctl(http_fd, EPOLL_CTL_ADD, listenFd, &ev) != 0) {
+	perror("http epoll");
+	HttpClose();
+	return FALSE;
+    }
+    printf("serving http on port %d\n", http_port);
+    return TRUE;
+}
+
+/*
+ * Whatever is ready on the epoll set, without waiting. TRUE if a POST left
+ * a command in c, which the caller treats like one off the control socket.
+ */
+int HttpService(struct ControlCommand *c)
+{
+    struct epoll_event events[HTTP_EVENTS];
+    int queued = FALSE;
+    int accepting = FALSE;
+    time_t tNow = time(NULL);
+
+    if (http_fd < 0)
+	return FALSE;
+
+    int n = epoll_wait(http_fd, events, HTTP_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+	struct HttpClient *cl = events[i].data.ptr;
+	if (cl == NULL) {
+	    accepting = TRUE;
+	    continue;
+	}
+	if (cl->fd < 0)
+	    continue;	// closed by an event before this one
+	if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+	    CloseClient(cl);
+	    continue;
+	}
+	if (events[i].events & EPOLLOUT)
+	    Flush(cl);
+	if (cl->fd >= 0 && (events[i].events & EPOLLIN) && ReadRequest(cl, c))
+	    queued = TRUE;
+    }
+    // not before now - a slot Accept reuses may have events left in this batch for the one it had
+    if (accepting)
+	Accept();
+
+    // a request that never finishes arriving doesn't get to keep its slot
+    for (int i = 0; i < HTTP_MAX_CLIENTS; i++)
+	if (clients[i].fd >= 0 && !clients[i].streaming && !clients[i].closeWhenSent
+	    && tNow - clients[i].tAccepted > HTTP_REQUEST_TIMEOUT)
+	    CloseClient(&clients[i]);
+    return queued;
+}
+
+// after a refresh - the stations whose category or observation changed
+void HttpStations(void)
+{
+    const struct stAirport *airports;
+    struct HttpText t = { 0 };
+    time_t tNow = time(NULL);
+    int numChanged = 0;
+
+    if (http_fd < 0)
+	return;
+    int numAirports = GetAirports(&airports);
+    if (numAirports != sentStations) {
+	free(sentCond);
+	free(sentObserved);
+	sentCond = calloc(numAirports, 1);
+	sentObserved = calloc(numAirports, sizeof(time_t));
+	sentStations = (sentCond != NULL && sentObserved != NULL) ? numAirports : 0;
+    }
+
+    TextPrintf(&t, "{\"refreshes\":%lu,\"now\":%lld,\"stations\":[", (unsigned long)metrics.refreshes,
+	       (long long)tNow);
+    for (int i = 0; i < sentStations; i++) {
+	if (airports[i].cCond == sentCond[i] && airports[i].tObserved == sentObserved[i])
+	    continue;
+	if (numChanged++ > 0)
+	    TextPrintf(&t, ",");
+	StationJson(&t, &airports[i], tNow);
+	sentCond[i] = airports[i].cCond;
+	sentObserved[i] = airports[i].tObserved;
+    }
+    TextPrintf(&t, "]}");
+    Broadcast("stations", &t);	// even with nothing in it, so viewers know we're still here
+    free(t.s);
+}
+
+// the leds that changed since the last frame, t is the time the frame is of
+void HttpFrame(time_t t)
+{
+    struct HttpText text = { 0 };
+    int numChanged = 0;
+
+    if (http_fd < 0 || matrix == NULL)
+	return;
+    if (sentFrameLeds != led_count) {
+	free(sentFrame);
+	sentFrame = calloc(led_count, sizeof(ws2811_led_t));
+	sentFrameLeds = sentFrame != NULL ? led_count : 0;
+    }
+
+    for (int j = 0; j < sentFrameLeds; j++) {
+	if (matrix[j] == sentFrame[j])
+	    continue;
+	if (numChanged++ == 0)
+	    TextPrintf(&text, "{\"t\":%lld,\"leds\":[", (long long)t);
+	else
+	    TextPrintf(&text, ",");
+	TextPrintf(&text, "[%d,\"%06x\"]", j, (unsigned)(matrix[j] & 0xffffff));
+	sentFrame[j] = matrix[j];
+    }
+    if (numChanged > 0) {
+	TextPrintf(&text, "]}");
+	Broadcast("frame", &text);
+    }
+    free(text.s);
+}
+
+// live, replay, off or dark, when that's changed
+void HttpMode(void)
+{
+    struct HttpText t = { 0 };
+    const char *sMode = Mode();
+
+    if (http_fd < 0 || strcmp(sMode, sentMode) == 0)
+	return;
+    sentMode = sMode;
+    TextPrintf(&t, "{\"mode\":\"%s\"}", sMode);
+    Broadcast("mode", &t);
+    free(t.s);
+}
+
+void HttpClose(void)
+{
+    for (int i = 0; i < HTTP_MAX_CLIENTS; i++)
+	if (clients[i].fd >= 0 && http_fd >= 0)
+	    CloseClient(&clients[i]);
+    if (listenFd >= 0)
+	close(listenFd);
+    if (http_fd >= 0)
+	close(http_fd);
+    listenFd = http_fd = -1;
+    free(sentFrame);
+    free(sentCond);
+    free(sentObserved);
+    sentFrame = NULL;
+    sentCond = NULL;
+    sentObserved = NULL;
+    sentFrameLeds = sentStations = 0;
+}
@@ -0,0 +1,38 @@
+#include <time.h>
+
+#define HTTP_MAX_CLIENTS 64		// viewers and requests at once, past that the oldest request goes
+#define HTTP_MAX_VIEWERS 56		// of those /events, the rest are kept for requests
+#define HTTP_REQUEST_MAX 4096		// request line, headers and a form body
+#define HTTP_REQUEST_TIMEOUT 10		// seconds a client gets to send its request
+#define HTTP_OUT_MAX (256 * 1024)	// queued for one client before we give up on it
+#define HTTP_EVENTS 16			// epoll events taken at a time
+
+/*
+ * A small HTTP/1.1 server inside the process that has the string, in
+ * place of WebIO.py. Everything is on one epoll set, which the daemon and
+ * replay wait on along with the control socket, so it costs nothing
+ * between requests and there are no threads.
+ *
+ *   GET /         the WebIO.py page, with each station kept up to date
+ *   GET /state    JSON: mode, brightness, refreshes, every station's
+ *                 category and observation age, and the leds' colors
+ *   GET /events   server-sent events: "state" when you connect, then
+ *                 "stations" after every refresh, "frame" with the leds
+ *                 that changed and "mode" when it changes
+ *   POST /        hours=N&submit=Ok|Clear|On, the WebIO.py form
+ *   POST /replay?hours=N  /stop  /off  /on  /refresh  /brightness?value=N
+ *
+ * A request is answered and closed; /events stays open. The POSTs become
+ * the same commands as the control socket's.
+ */
+extern int http_port;		// 0 for no server
+extern int http_fd;		// the epoll set, -1 when there isn't one
+
+struct ControlCommand;
+
+int HttpOpen(void);
+int HttpService(struct ControlCommand *c);
+void HttpStations(void);
+void HttpFrame(time_t t);
+void HttpMode(void);
+void HttpClose(void);
@@ -0,0 +1,548 @@
+/**********************************************************************
+* Filename    : import.c
+* Description : Fill the history ring from archived METARs
+*
+* Every input file is mapped and cut into chunks on record boundaries,
+* and a thread per core takes chunks until they run out. Each picks
+* out the records for our airports - the same <METAR> scan as the live
+* response, or one CSV line at a time - and keeps just the station's
+* slot, the observation time and the category, 8 bytes an observation.
+* One counting sort by 5 minute slot afterwards puts them in time order
+* and a single sweep plays them forward the way the refreshes would
+* have seen them, stale_minutes and all, appending a record per slot.
+**********************************************************************/
+#define _GNU_SOURCE	// memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "METARmap.h"
+#include "matrix.h"
+#include "metarindex.h"
+#include "metardecode.h"
+#include "history.h"
+#include "columns.h"
+#include "metrics.h"
+#include "import.h"
+
+// column each field is in, -1 if the file doesn't have it
+#define COL_STATION 0
+#define COL_TIME 1
+#define COL_RAW 2
+#define COL_CATEGORY 3
+#define NUM_FIELDS 4
+
+struct ImportFile {
+    char *sData;		// mapped
+    size_t len;
+    int isXml;
+    int cols[NUM_FIELDS];
+};
+
+struct ImportChunk {
+    int file;
+    size_t start;
+    size_t end;
+};
+
+struct ImportObs {
+    uint32_t t;			// epoch seconds, good to 2106
+    uint32_t slot : 24;		// station table slot
+    uint32_t cat : 8;
+};
+
+struct ImportWorker {
+    pthread_t thread;
+    struct ImportObs *obs;
+    size_t numObs;
+    size_t maxObs;
+    unsigned long numRecords;	// read, ours or not
+};
+
+static struct ImportFile *files;
+static int numFiles;
+static struct ImportChunk *chunks;
+static int numChunks;
+static int nextChunk;		// taken with an atomic add
+static struct StationTable table;
+
+// the K on US codes is left off by some archives, IEM's among them
+static int StationSlot(const struct TextView *v)
+{
+    int slot = StationTableLookup(&table, StationKey(v->ptr, v->len));
+
+    if (slot < 0 && v->len == 3) {
+	char sCode[4] = { 'K', v->ptr[0], v->ptr[1], v->ptr[2] };
+	slot = StationTableLookup(&table, StationKey(sCode, 4));
+    }
+    return slot;
+}
+
+// ObsTimeToEpoch's form, or "YYYY-MM-DD HH:MM" as IEM writes it
+static int ImportTime(const struct TextView *v, time_t *pT)
+{
+    char sTime[20];
+    struct TextView view = { sTime, sizeof(sTime) };
+
+    if (v->ptr == NULL || v->len < 16)
+	return FALSE;
+    if (v->len >= 19)
+	return ObsTimeToEpoch(v, pT);
+    memcpy(sTime, v->ptr, 16);
+    memcpy(sTime + 16, ":00", 3);
+    sTime[10] = 'T';
+    sTime[19] = 'Z';
+    return ObsTimeToEpoch(&view, pT);
+}
+
+static void AddObs(struct ImportWorker *w, const struct TextView *station, const struct TextView *obsTime,
+		   const struct TextView *raw, const struct TextView *category)
+{
+    struct MetarObs metar;
+    time_t t;
+    char cat;
+
+    w->numRecords++;
+    if (station->ptr == NULL)
+	return;
+    int slot = StationSlot(station);
+    if (slot < 0 || !ImportTime(obsTime, &t) || t < 0 || t > (time_t)UINT32_MAX)
+	return;
+
+    if (category->ptr != NULL && category->len > 0)
+	cat = category->ptr[0];
+    else if (raw->ptr != NULL && MetarDecode(raw->ptr, raw->len, &metar))
+	cat = MetarCategory(&metar);
+    else
+	return;
+    if (cat != 'V' && cat != 'M' && cat != 'I' && cat != 'L')
+	return;
+
+    if (w->numObs == w->maxObs) {
+	size_t maxObs = w->maxObs ? w->maxObs * 2 : 65536;
+	struct ImportObs *pGrown = realloc(w->obs, sizeof(struct ImportObs) * maxObs);
+	if (pGrown == NULL)
+	    return;
+	w->obs = pGrown;
+	w->maxObs = maxObs;
+    }
+    w->obs[w->numObs++] = (struct ImportObs){ (uint32_t)t, (uint32_t)slot, (uint8_t)cat };
+}
+
+// fields of one CSV line, quotes round a field dropped - none of ours have commas in them
+static int SplitLine(const char *p, const char *sEnd, struct TextView *fields, int maxFields)
+{
+    int n = 0;
+
+    while (n < maxFields) {
+	const char *sComma = memchr(p, ',', sEnd - p);
+	const char *sField = sComma != NULL ? sComma : sEnd;
+	struct TextView *f = &fields[n++];
+
+	f->ptr = p;
+	f->len = sField - p;
+	if (f->len >= 2 && p[0] == '"' && p[f->len - 1] == '"') {
+	    f->ptr++;
+	    f->len -= 2;
+	}
+	if (sComma == NULL)
+	    break;
+	p = sComma + 1;
+    }
+    return n;
+}
+
+static void ImportCsv(struct ImportWorker *w, const struct ImportFile *f, const char *p, const char *sEnd)
+{
+    static const struct TextView none = { NULL, 0 };
+    struct TextView fields[IMPORT_MAX_COLUMNS];
+
+    while (p < sEnd) {
+	const char *sEol = memchr(p, '\n', sEnd - p);
+	const char *sLineEnd = sEol != NULL ? sEol : sEnd;
+	if (sLineEnd > p && sLineEnd[-1] == '\r')
+	    sLineEnd--;
+
+	int n = SplitLine(p, sLineEnd, fields, IMPORT_MAX_COLUMNS);
+	const struct TextView *v[NUM_FIELDS];
+	for (int i = 0; i < NUM_FIELDS; i++)
+	    v[i] = f->cols[i] >= 0 && f->cols[i] < n ? &fields[f->cols[i]] : &none;
+	AddObs(w, v[COL_STATION], v[COL_TIME], v[COL_RAW], v[COL_CATEGORY]);
+
+	p = sEol != NULL ? sEol + 1 : sEnd;
+    }
+}
+
+static void *ImportThread(void *arg)
+{
+    struct ImportWorker *w = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_RELAXED)) < numChunks) {
+	const struct ImportFile *f = &files[chunks[i].file];
+	const char *p = f->sData + chunks[i].start;
+	const char *sEnd = f->sData + chunks[i].end;
+
+	if (f->isXml) {
+	    struct MetarRecord rec;
+	    while ((p = MetarNextRecord(p, sEnd, &rec)) != NULL)
+		AddObs(w, &rec.station_id, &rec.observation_time, &rec.raw_text, &rec.flight_category);
+	} else {
+	    ImportCsv(w, f, p, sEnd);
+	}
+    }
+    return NULL;
+}
+
+// two reports for the same minute - a SPECI and the METAR, or archives that overlap -
+// the worse one wins, so which thread read which doesn't matter
+static int Severity(char cat)
+{
+    return cat == 'L' ? 4 : cat == 'I' ? 3 : cat == 'M' ? 2 : 1;
+}
+
+static int ColumnIs(const struct TextView *v, const char *sName)
+{
+    return v->len == strlen(sName) && memcmp(v->ptr, sName, v->len) == 0;
+}
+
+/*
+ * XML if there's a <METAR> near the start, else look for the CSV header row -
+ * the aviation wx CSV has a few lines of chatter before it. Returns where the
+ * records start, or -1 if it's neither.
+ */
+static long FileFormat(struct ImportFile *f)
+{
+    size_t scan = f->len < IMPORT_HEADER_SCAN ? f->len : IMPORT_HEADER_SCAN;
+    const char *p = f->sData;
+    const char *sEnd = f->sData + scan;
+    struct TextView fields[IMPORT_MAX_COLUMNS];
+
+    if (memmem(f->sData, scan, "<METAR>", 7) != NULL) {
+	f->isXml = TRUE;
+	return 0;
+    }
+
+    while (p < sEnd) {
+	const char *sEol = memchr(p, '\n', sEnd - p);
+	if (sEol == NULL)
+	    break;
+	const char *sLineEnd = sEol > p && sEol[-1] == '\r' ? sEol - 1 : sEol;
+	int n = SplitLine(p, sLineEnd, fields, IMPORT_MAX_COLUMNS);
+
+	for (int i = 0; i < NUM_FIELDS; i++)
+	    f->cols[i] = -1;
+	for (int i = 0; i < n; i++) {
+	    if (ColumnIs(&fields[i], "station_id") || ColumnIs(&fields[i], "station"))
+		f->cols[COL_STATION] = i;
+	    else if (ColumnIs(&fields[i], "observation_time") || ColumnIs(&fields[i], "valid"))
+		f->cols[COL_TIME] = i;
+	    else if (ColumnIs(&fields[i], "raw_text") || ColumnIs(&fields[i], "metar"))
+		f->cols[COL_RAW] = i;
+	    else if (ColumnIs(&fields[i], "flight_category"))
+		f->cols[COL_CATEGORY] = i;
+	}
+	if (f->cols[COL_STATION] >= 0 && f->cols[COL_TIME] >= 0
+	    && (f->cols[COL_RAW] >= 0 || f->cols[COL_CATEGORY] >= 0)) {
+	    f->isXml = FALSE;
+	    return sEol + 1 - f->sData;
+	}
+	p = sEol + 1;
+    }
+    return -1;
+}
+
+// map it and cut it into chunks that end on a record boundary
+static int AddFile(const char *sFileName)
+{
+    struct stat st;
+    int fd = open(sFileName, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+	if (fd >= 0)
+	    close(fd);
+	fprintf(stderr, "can't read %s\n", sFileName);
+	return FALSE;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	fprintf(stderr, "can't map %s\n", sFileName);
+	return FALSE;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    struct ImportFile *pGrown = realloc(files, sizeof(struct ImportFile) * (numFiles + 1));
+    if (pGrown == NULL) {
+	munmap(map, st.st_size);
+	return FALSE;
+    }
+    files = pGrown;
+    struct ImportFile *f = &files[numFiles];
+    f->sData = map;
+    f->len = st.st_size;
+
+    long start = FileFormat(f);
+    if (start < 0) {
+	fprintf(stderr, "%s is neither METAR XML nor CSV with a header we know, skipping it\n", sFileName);
+	munmap(map, st.st_size);
+	return FALSE;
+    }
+
+    const char *sMark = f->isXml ? "<METAR>" : "\n";
+    size_t markLen = strlen(sMark);
+    size_t pos = start;
+    while (pos < f->len) {
+	size_t end = pos + IMPORT_CHUNK_SIZE;
+	if (end >= f->len) {
+	    end = f->len;
+	} else {
+	    const char *sNext = memmem(f->sData + end, f->len - end, sMark, markLen);
+	    end = sNext == NULL ? f->len : (size_t)(sNext - f->sData) + (f->isXml ? 0 : 1);
+	}
+	struct ImportChunk *pChunks = realloc(chunks, sizeof(struct ImportChunk) * (numChunks + 1));
+	if (pChunks == NULL)
+	    break;
+	chunks = pChunks;
+	chunks[numChunks++] = (struct ImportChunk){ numFiles, pos, end };
+	pos = end;
+    }
+
+    printf("%s: %s, %.1f MB\n", sFileName, f->isXml ? "XML" : "CSV", f->len / 1e6);
+    numFiles++;
+    return TRUE;
+}
+
+static int AddPath(const char *sPath)
+{
+    struct stat st;
+    struct dirent **names;
+
+    if (stat(sPath, &st) != 0) {
+	fprintf(stderr, "can't find %s\n", sPath);
+	return 0;
+    }
+    if (!S_ISDIR(st.st_mode))
+	return AddFile(sPath);
+
+    int numNames = scandir(sPath, &names, NULL, alphasort);
+    int numAdded = 0;
+    for (int i = 0; i < numNames; i++) {
+	char sFile[1024];
+	if (names[i]->d_name[0] != '.'
+	    && snprintf(sFile, sizeof(sFile), "%s/%s", sPath, names[i]->d_name) < (int)sizeof(sFile)
+	    && stat(sFile, &st) == 0 && S_ISREG(st.st_mode))
+	    numAdded += AddFile(sFile);
+	free(names[i]);
+    }
+    if (numNames >= 0)
+	free(names);
+    return numAdded;
+}
+
+static void FreeFiles(void)
+{
+    for (int i = 0; i < numFiles; i++)
+	munmap(files[i].sData, files[i].len);
+    free(files);
+    free(chunks);
+    files = NULL;
+    chunks = NULL;
+    numFiles = numChunks = nextChunk = 0;
+}
+
+/*
+ * Play the observations forward a 5 minute slot at a time into the ring,
+ * each led showing its station's latest observation until it's stale_minutes
+ * old, as a refresh at the end of that slot would have.
+ */
+static int WriteHistory(struct ImportWorker *workers, int numWorkers, const struct stAirport *airports,
+			int numAirports)
+{
+    size_t numObs = 0;
+    uint32_t tMin = UINT32_MAX, tMax = 0;
+
+    for (int i = 0; i < numWorkers; i++) {
+	numObs += workers[i].numObs;
+	for (size_t j = 0; j < workers[i].numObs; j++) {
+	    uint32_t t = workers[i].obs[j].t;
+	    tMin = t < tMin ? t : tMin;
+	    tMax = t > tMax ? t : tMax;
+	}
+    }
+    if (numObs == 0) {
+	fprintf(stderr, "nothing in there for our airports\n");
+	return FALSE;
+    }
+
+    // replay can't go back further than this, don't spend the ring on it
+    uint32_t tStart = tMax - tMin > MAX_REPLAY_DAYS * 86400u ? tMax - MAX_REPLAY_DAYS * 86400u : tMin;
+    tStart -= tStart % REFRESH_INTERVAL_SECS;
+    uint32_t numSlots = (tMax - tStart) / REFRESH_INTERVAL_SECS + 1;
+
+    // counting sort by slot
+    size_t *slotStart = calloc(numSlots + 1, sizeof(size_t));
+    struct ImportObs *sorted = malloc(sizeof(struct ImportObs) * numObs);
+    uint32_t *lastT = calloc(table.mask + 1, sizeof(uint32_t));
+    char *lastCat = malloc(table.mask + 1);
+    int *airportSlot = malloc(sizeof(int) * (numAirports + 1));
+    if (slotStart == NULL || sorted == NULL || lastT == NULL || lastCat == NULL || airportSlot == NULL) {
+	fprintf(stderr, "not enough memory to sort %zu observations\n", numObs);
+	free(slotStart);
+	free(sorted);
+	free(lastT);
+	free(lastCat);
+	free(airportSlot);
+	return FALSE;
+    }
+    for (int i = 0; i < numWorkers; i++)
+	for (size_t j = 0; j < workers[i].numObs; j++)
+	    if (workers[i].obs[j].t >= tStart)
+		slotStart[(workers[i].obs[j].t - tStart) / REFRESH_INTERVAL_SECS + 1]++;
+    for (uint32_t s = 0; s < numSlots; s++)
+	slotStart[s + 1] += slotStart[s];
+    numObs = slotStart[numSlots];
+    {
+	size_t *next = slotStart;	// bumped as we go, put back below
+	for (int i = 0; i < numWorkers; i++)
+	    for (size_t j = 0; j < workers[i].numObs; j++)
+		if (workers[i].obs[j].t >= tStart)
+		    sorted[next[(workers[i].obs[j].t - tStart) / REFRESH_INTERVAL_SECS]++] = workers[i].obs[j];
+	for (uint32_t s = numSlots; s > 0; s--)
+	    slotStart[s] = slotStart[s - 1];
+	slotStart[0] = 0;
+    }
+
+    for (int i = 0; i < numAirports; i++)
+	airportSlot[i] = StationTableLookup(&table, StationKey(airports[i].sAirportCode,
+							      sizeof(airports[i].sAirportCode)));
+
+    // a new ring next to the old one, so a failed import leaves what was there
+    char sRing[300];
+    struct History h;
+    snprintf(sRing, sizeof(sRing), "%s.import", HistoryFileName());
+    unlink(sRing);
+    if (!HistoryOpen(&h, sRing, HistorySegmentsFor(led_count), led_count, TRUE)) {
+	free(slotStart);
+	free(sorted);
+	free(lastT);
+	free(lastCat);
+	free(airportSlot);
+	return FALSE;
+    }
+    HistoryClear(&h);
+
+    char sRecord[led_count];
+    for (uint32_t s = 0; s < numSlots; s++) {
+	uint32_t tEnd = tStart + (s + 1) * REFRESH_INTERVAL_SECS;
+
+	for (size_t j = slotStart[s]; j < slotStart[s + 1]; j++) {
+	    const struct ImportObs *o = &sorted[j];
+	    if (o->t > lastT[o->slot] || (o->t == lastT[o->slot] && Severity(o->cat) > Severity(lastCat[o->slot]))) {
+		lastT[o->slot] = o->t;
+		lastCat[o->slot] = o->cat;
+	    }
+	}
+
+	memset(sRecord, 'E', led_count);
+	for (int i = 0; i < numAirports; i++) {
+	    int slot = airportSlot[i];
+	    if (slot >= 0 && lastT[slot] != 0 && tEnd - lastT[slot] <= (uint32_t)stale_minutes * 60)
+		sRecord[airports[i].iLedNo] = lastCat[slot];
+	}
+	HistoryAppendNoSync(&h, sRecord, tEnd);
+    }
+    HistorySync(&h);
+    int numKept = HistoryCount(&h);
+    HistoryClose(&h);
+
+    free(slotStart);
+    free(sorted);
+    free(lastT);
+    free(lastCat);
+    free(airportSlot);
+
+    if (rename(sRing, HistoryFileName()) != 0) {
+	perror(HistoryFileName());
+	unlink(sRing);
+	return FALSE;
+    }
+    printf("%zu observations in %u slots, %d records kept in %s\n", numObs, numSlots, numKept,
+	   HistoryFileName());
+
+    // the column store goes with the history it was copied from
+    struct Columns cols;
+    unlink(ColumnsFileName());
+    if (HistoryOpen(&h, HistoryFileName(), HistorySegmentsFor(led_count), led_count, TRUE)) {
+	if (ColumnsOpen(&cols, ColumnsFileName(), TRUE)) {
+	    ColumnsSync(&cols, &h, airports, numAirports);
+	    ColumnsClose(&cols);
+	}
+	HistoryClose(&h);
+    }
+    return TRUE;
+}
+
+int ImportHistory(const char *sPath)
+{
+    const struct stAirport *airports;
+    struct ImportWorker workers[IMPORT_MAX_THREADS];
+    int numAirports = GetAirports(&airports);
+    int numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int iRet;
+
+    if (numAirports == 0 || !StationTableBuild(&table, airports, numAirports))
+	return FALSE;
+    if (numWorkers < 1)
+	numWorkers = 1;
+    if (numWorkers > IMPORT_MAX_THREADS)
+	numWorkers = IMPORT_MAX_THREADS;
+
+    double tStart = MetricsNow();
+    if (AddPath(sPath) == 0) {
+	StationTableFree(&table);
+	FreeFiles();
+	return FALSE;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    int numStarted = 0;
+    for (; numStarted < numWorkers; numStarted++)
+	if (pthread_create(&workers[numStarted].thread, NULL, ImportThread, &workers[numStarted]) != 0)
+	    break;
+    if (numStarted == 0)
+	ImportThread(&workers[numStarted++]);	// no threads to be had, do it ourselves
+    else
+	for (int i = 0; i < numStarted; i++)
+	    pthread_join(workers[i].thread, NULL);
+    double tParsed = MetricsNow();
+
+    unsigned long numRecords = 0;
+    size_t numObs = 0;
+    size_t numBytes = 0;
+    for (int i = 0; i < numStarted; i++) {
+	numRecords += workers[i].numRecords;
+	numObs += workers[i].numObs;
+    }
+    for (int i = 0; i < numFiles; i++)
+	numBytes += files[i].len;
+    printf("read %lu METARs, %zu for our airports, from %.1f MB in %.2fs on %d threads\n", numRecords, numObs,
+	   numBytes / 1e6, tParsed - tStart, numStarted);
+
+    iRet = WriteHistory(workers, numStarted, airports, numAirports);
+    if (iRet)
+	printf("history written in %.2fs\n", MetricsNow() - tParsed);
+
+    for (int i = 0; i < numStarted; i++)
+	free(workers[i].obs);
+    StationTableFree(&table);
+    FreeFiles();
+    return iRet;
+}
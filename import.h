@@ -0,0 +1,16 @@
+#define IMPORT_CHUNK_SIZE (4 << 20)	// input handed to a thread at a time
+#define IMPORT_MAX_THREADS 16
+#define IMPORT_HEADER_SCAN 65536	// how far into a CSV file to look for its column names
+#define IMPORT_MAX_COLUMNS 64
+
+/*
+ * Build the history ring from archived METARs instead of waiting for the
+ * board to record it. sPath is a file or a directory of them, each either
+ * the aviation wx XML (<METAR> records, as the live fetch gets) or CSV with
+ * a header row naming its columns - the aviation wx CSV (raw_text,
+ * station_id, observation_time, flight_category) or an IEM ASOS download
+ * (station, valid, metar). Observations are cut into one record per 5
+ * minute refresh, the newest MAX_REPLAY_DAYS of them, and replace what the
+ * ring had.
+ */
+int ImportHistory(const char *sPath);
@@ -0,0 +1,214 @@
+/**********************************************************************
+* Filename    : livestate.c
+* Description : The current frame and stations in POSIX shared memory,
+*               behind a seqlock, for other processes to read
+*
+* The writer is whichever of the daemon, replay or a cron run has the
+* leds. Readers map the segment read-only and never write to it, not
+* even a lock, so however many there are and however slow they are the
+* map goes on at its own pace. See livestate.h for the layout.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "METARmap.h"
+#include "matrix.h"
+#include "metrics.h"
+#include "control.h"
+#include "livestate.h"
+
+static struct LiveStateHeader *shared;
+static size_t sharedLen;
+
+const char *LiveStateName(void)
+{
+    return test_mode == TRUE ? LIVESTATE_TEST_NAME : LIVESTATE_NAME;
+}
+
+static size_t SegmentBytes(uint32_t maxLeds)
+{
+    return sizeof(struct LiveStateHeader) + (size_t)maxLeds * (sizeof(uint32_t) + sizeof(struct LiveStateStation));
+}
+
+static struct LiveStateStation *Stations(const struct LiveStateHeader *h)
+{
+    return (struct LiveStateStation *)((uint8_t *)(h + 1) + (size_t)h->maxLeds * sizeof(uint32_t));
+}
+
+int LiveStateOpen(void)
+{
+    struct stat st;
+    uint32_t maxLeds = (led_count + 1) & ~1;
+    size_t len = SegmentBytes(maxLeds);
+
+    int fd = shm_open(LiveStateName(), O_RDWR | O_CREAT, 0644);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size != 0 && (size_t)st.st_size != len) {
+	// sized for another map - a reader may have that mapped, so leave it be and start a new one
+	close(fd);
+	shm_unlink(LiveStateName());
+	fd = shm_open(LiveStateName(), O_RDWR | O_CREAT, 0644);
+    }
+    if (fd < 0 || ftruncate(fd, len) != 0) {
+	fprintf(stderr, "Can't make shared memory %s %d\n", LiveStateName(), errno);
+	if (fd >= 0)
+	    close(fd);
+	return FALSE;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);	// the mapping keeps it
+    if (map == MAP_FAILED) {
+	fprintf(stderr, "Can't map %s %d\n", LiveStateName(), errno);
+	return FALSE;
+    }
+
+    shared = map;
+    sharedLen = len;
+    uint32_t seq = shared->magic == LIVESTATE_MAGIC ? shared->seq : 0;
+    if (seq & 1)
+	seq++;	// the last writer died mid update, readers have been waiting on it
+    __atomic_store_n(&shared->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset((uint8_t *)shared + offsetof(struct LiveStateHeader, pid), 0,
+	   len - offsetof(struct LiveStateHeader, pid));
+    shared->magic = LIVESTATE_MAGIC;
+    shared->version = LIVESTATE_VERSION;
+    shared->pid = getpid();
+    shared->maxLeds = maxLeds;
+    __atomic_store_n(&shared->seq, seq + 2, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// the leds as they are now, and the stations as of the last refresh
+void LiveStatePublish(time_t tFrame)
+{
+    const struct stAirport *airports;
+
+    if (shared == NULL || matrix == NULL)
+	return;
+    int numAirports = GetAirports(&airports);
+    int numLeds = led_count < (int)shared->maxLeds ? led_count : (int)shared->maxLeds;
+    if (numAirports > (int)shared->maxLeds)
+	numAirports = shared->maxLeds;
+
+    uint32_t seq = shared->seq;
+    __atomic_store_n(&shared->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);	// odd lands before any of the data does
+
+    shared->numLeds = numLeds;
+    shared->numStations = numAirports;
+    shared->mode = replaying ? LIVESTATE_REPLAY : lights_off ? LIVESTATE_OFF
+	: night_mode ? LIVESTATE_DARK : LIVESTATE_LIVE;
+    shared->refreshes = metrics.refreshes;
+    shared->tFrame = tFrame;
+    shared->tRefresh = metrics.lastRefresh;
+    shared->brightness = matrix_get_brightness();
+    memcpy(shared + 1, matrix, numLeds * sizeof(uint32_t));
+
+    struct LiveStateStation *st = Stations(shared);
+    for (int i = 0; i < numAirports; i++) {
+	strncpy(st[i].sCode, airports[i].sAirportCode, sizeof(st[i].sCode) - 1);
+	st[i].led = airports[i].iLedNo;
+	st[i].cCategory = airports[i].cCond;
+	st[i].tObserved = airports[i].tObserved;
+    }
+
+    __atomic_store_n(&shared->seq, seq + 2, __ATOMIC_RELEASE);	// and all of it before even
+}
+
+// the segment stays for readers to see the last state, the pid says nobody's updating it
+void LiveStateClose(void)
+{
+    if (shared != NULL)
+	munmap(shared, sharedLen);
+    shared = NULL;
+    sharedLen = 0;
+}
+
+/*
+ * A consistent copy of a mapped segment, as much of it as fits in copy.
+ * FALSE if the writer was in the middle every time we looked, or it isn't
+ * a segment we know - its counts are checked against maxLeds and maxLeds
+ * against what was copied, so the copy can be walked as it stands.
+ */
+int LiveStateSnapshot(const struct LiveStateHeader *h, size_t len, struct LiveStateHeader *copy, size_t copyLen)
+{
+    size_t n = len < copyLen ? len : copyLen;
+
+    if (n < sizeof(*h))
+	return FALSE;
+    for (int i = 0; i < LIVESTATE_READ_TRIES; i++) {
+	uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+	    continue;
+	memcpy(copy, h, n);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);	// the copy is done before seq is looked at again
+	if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)	// and what it says has to fit in the copy
+	    return copy->magic == LIVESTATE_MAGIC && copy->version == LIVESTATE_VERSION
+		&& copy->maxLeds <= UINT16_MAX + 1 && SegmentBytes(copy->maxLeds) <= n
+		&& copy->numLeds <= copy->maxLeds && copy->numStations <= copy->maxLeds;
+    }
+    return FALSE;
+}
+
+static const char *ModeName(uint32_t mode)
+{
+    static const char *sModes[] = { "live", "dark", "off", "replay" };
+    return mode < sizeof(sModes) / sizeof(sModes[0]) ? sModes[mode] : "?";
+}
+
+// METARmap state - what another process sees, and a worked example of reading it
+int LiveStateCommand(void)
+{
+    struct stat st;
+    char sTime[32];
+
+    int fd = shm_open(LiveStateName(), O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+	fprintf(stderr, "no %s, the map hasn't run since boot\n", LiveStateName());
+	if (fd >= 0)
+	    close(fd);
+	return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	fprintf(stderr, "Can't map %s %d\n", LiveStateName(), errno);
+	return 1;
+    }
+    struct LiveStateHeader *copy = malloc(st.st_size);
+    int ok = copy != NULL && LiveStateSnapshot(map, st.st_size, copy, st.st_size);
+    munmap(map, st.st_size);
+    if (!ok) {
+	fprintf(stderr, "%s can't be read\n", LiveStateName());
+	free(copy);
+	return 1;
+    }
+
+    time_t tNow = time(NULL);
+    time_t tFrame = copy->tFrame;
+    strftime(sTime, sizeof(sTime), "%Y-%m-%d %H:%M", localtime(&tFrame));
+    printf("%s, pid %u%s, refresh %llu, frame of %s, brightness %u\n", ModeName(copy->mode), copy->pid,
+	   kill(copy->pid, 0) == 0 || errno == EPERM ? "" : " (gone)", (unsigned long long)copy->refreshes,
+	   sTime, copy->brightness);
+
+    const uint32_t *leds = (const uint32_t *)(copy + 1);
+    const struct LiveStateStation *stations = Stations(copy);
+    for (uint32_t i = 0; i < copy->numStations; i++) {
+	const struct LiveStateStation *s = &stations[i];
+	uint32_t color = s->led >= 0 && (uint32_t)s->led < copy->numLeds ? leds[s->led] : 0;
+	printf("%-6s led %-4d %c  %06x", s->sCode, s->led, s->cCategory, color & 0xffffff);
+	if (s->tObserved != 0)
+	    printf("  %lld min old", (long long)(tNow - s->tObserved) / 60);
+	printf("\n");
+    }
+    free(copy);
+    return 0;
+}
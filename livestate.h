@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <time.h>
+
+#define LIVESTATE_NAME "/metarmap"		// POSIX shm, /dev/shm/metarmap on Linux
+#define LIVESTATE_TEST_NAME "/metarmap-test"
+#define LIVESTATE_MAGIC 0x534c4d4d		// "MMLS"
+#define LIVESTATE_VERSION 1
+#define LIVESTATE_READ_TRIES 1000		// a reader gives up after this many torn copies
+
+// mode
+#define LIVESTATE_LIVE 0
+#define LIVESTATE_DARK 1	// night, from the brightness schedule
+#define LIVESTATE_OFF 2		// told to go off
+#define LIVESTATE_REPLAY 3
+
+/*
+ * What the map is showing, in shared memory for anything else on the box
+ * to read. The layout is fixed and all of it little endian, native to the
+ * Pi:
+ *
+ *   0                      struct LiveStateHeader, 64 bytes
+ *   64                     uint32_t leds[maxLeds], 0xWWRRGGBB as sent
+ *                          to the string
+ *   64 + 4 * maxLeds       struct LiveStateStation stations[maxLeds],
+ *                          24 bytes each
+ *
+ * maxLeds is even so the stations are 8 byte aligned, and doesn't change
+ * while the segment exists - a map resized with -x gets a new segment.
+ *
+ * seq is a seqlock: the writer makes it odd, writes, and makes it even
+ * again. To read, load seq, wait out an odd one, copy what you want, then
+ * load seq again and copy again if it moved (LiveStateSnapshot does this).
+ * There's nothing to lock so a reader can't hold up the map, and it's
+ * plain memory so a read costs no system calls. The frame is published
+ * every time the leds change, in replay too; the stations are the last
+ * refresh's, replay doesn't touch them.
+ */
+struct LiveStateHeader {
+    uint32_t magic;		// 0
+    uint32_t version;		// 4
+    uint32_t seq;		// 8, odd while it's being written
+    uint32_t pid;		// 12, of the writer - gone means the state is old
+    uint32_t maxLeds;		// 16, room in leds[] and stations[]
+    uint32_t numLeds;		// 20
+    uint32_t numStations;	// 24
+    uint32_t mode;		// 28, LIVESTATE_LIVE ...
+    uint64_t refreshes;		// 32, cycle sequence number, one more every refresh
+    int64_t tFrame;		// 40, time the frame shows, in replay the history's time
+    int64_t tRefresh;		// 48, wall clock of the last refresh, 0 for none yet
+    uint32_t brightness;	// 56, 0-255
+    uint32_t reserved;		// 60
+};
+
+struct LiveStateStation {
+    char sCode[8];		// 0, NUL terminated
+    int32_t led;		// 8
+    char cCategory;		// 12, V M I L or E for no data
+    char pad[3];
+    int64_t tObserved;		// 16, 0 if we don't know
+};
+
+const char *LiveStateName(void);
+int LiveStateOpen(void);
+void LiveStatePublish(time_t tFrame);
+void LiveStateClose(void);
+int LiveStateSnapshot(const struct LiveStateHeader *shared, size_t sharedLen, struct LiveStateHeader *copy,
+		      size_t copyLen);
+int LiveStateCommand(void);
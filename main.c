@@ -1,7 +1,7 @@
 /*
  * main for METARmap program
  * Program designed to light a series of leds with METAR data using airports in AirportList.dat,
- * along with the ability to replay up to 10 days of historical data 
+ * along with the ability to replay up to 180 days of historical data 
  * Heather and Bill Fahle 2021 No copyright. Feel free to use this program for your own
  * purposes. We provide no guarantees, support, or warranty that this will work the way that 
  * you want it to work. 
@@ -18,6 +18,7 @@
  
 static char VERSION[] = "XX.YY.ZZ";
 
+#define _GNU_SOURCE	// strptime
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,9 +32,12 @@ static char VERSION[] = "XX.YY.ZZ";
 #include <stdarg.h>
 #include <getopt.h>
 #include <errno.h>
+#include <poll.h>
 #include <semaphore.h>
 #include <sys/stat.h>
 #include <pwd.h>
+#include <time.h>
+#include <curl/curl.h>
 
 #include "clk.h"
 #include "gpio.h"
@@ -42,6 +46,18 @@ static char VERSION[] = "XX.YY.ZZ";
 #include "version.h"
 #include "METARmap.h"
 #include "matrix.h"
+#include "sched.h"
+#include "output.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "control.h"
+#include "http.h"
+#include "brightness.h"
+#include "import.h"
+#include "history.h"
+#include "columns.h"
+#include "stats.h"
+#include "livestate.h"
 
 #include "ws2811.h"
 
@@ -58,14 +74,25 @@ int led_count = LED_COUNT;
 int strip = WS2811_STRIP_RGB; //strip type - rgb (default), grb, gbr, rgbw
 int dma = 10; // dma channel to use (default 10)
 int gpio = 18; //	GPIO to use If omitted, default is 18
+int gpio2 = 0; //	GPIO for a second string on channel 1, 0 for none
+int count2 = 0; //	leds on the second string, 0 to split the matrix evenly
 int invert =  0; // 1 to invert
 
 int num_replay_hours = 4;
 int clear_on_exit = 0;
 int replay_mode = 0;
+time_t replay_from = 0;	// -F, 0 for the last num_replay_hours
+time_t replay_to = 0;	// -T, 0 for up to the newest record
 int night_mode = 0;
+int daemon_mode = 0;
+int smooth_frames = 0;
 int test_mode = 0;
 int free_the_semaphore = 0;
+char wx_source[1024] = AIRPTSTR;	// where the weather comes from, see FetchSourceInit
+int fetch_parallel = FETCH_PARALLEL;	// station batches fetched at once
+int stale_minutes = STALE_MINUTES;	// oldest observation we still show
+char import_path[1024];	// -I, archived METARs to build history from instead of running
+char brightness_file[256] = BRIGHTNESS_FILE;	// the daemon's day and night, see brightness.h
 
 static void ctrl_c_handler(int signum)
 {
@@ -82,8 +109,34 @@ static void setup_handlers(void)
 
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);	// a control client that hangs up early is not a reason to die
 }
 
+// "2024-03-05 14:30", "2024-03-05T14:30" or "2024-03-05" local time, or "3d", "6h", "90m" ago
+static time_t ParseReplayTime(const char *sWhen)
+{
+    static const char *formats[] = { "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d" };
+    struct tm stTime;
+    long n;
+    char unit;
+    int len;
+
+    if (sscanf(sWhen, "%ld%c%n", &n, &unit, &len) == 2 && sWhen[len] == '\0' && n >= 0) {
+	int secs = unit == 'd' ? 86400 : unit == 'h' ? 3600 : unit == 'm' ? 60 : 0;
+	if (secs != 0)
+	    return time(NULL) - (time_t)n * secs;
+    }
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+	memset(&stTime, 0, sizeof(stTime));
+	const char *pEnd = strptime(sWhen, formats[i], &stTime);
+	if (pEnd != NULL && *pEnd == '\0') {
+	    stTime.tm_isdst = -1;
+	    return mktime(&stTime);
+	}
+    }
+    return -1;
+}
 
 void parseargs(int argc, char **argv)
 {
@@ -93,17 +146,32 @@ void parseargs(int argc, char **argv)
     static struct option longopts[] =
     {
 	    {"help", no_argument, 0, 'h'},
+	    {"max-age", required_argument, 0, 'A'},
+	    {"brightness", required_argument, 0, 'B'},
+	    {"metrics", required_argument, 0, 'M'},
 	    {"dma", required_argument, 0, 'd'},
 	    {"gpio", required_argument, 0, 'g'},
+	    {"gpio2", required_argument, 0, 'G'},
+	    {"count2", required_argument, 0, 'C'},
 	    {"invert", no_argument, 0, 'i'},
+	    {"import", required_argument, 0, 'I'},
 	    {"clear", no_argument, 0, 'c'},
+	    {"daemon", no_argument, 0, 'D'},
 	    {"freesem", no_argument, 0, 'f'},
 	    {"test", no_argument, 0, 't'},
+	    {"source", required_argument, 0, 'u'},
 	    {"night", no_argument, 0, 'n'},
+	    {"output", required_argument, 0, 'o'},
+	    {"parallel", required_argument, 0, 'P'},
 	    {"replay_days", required_argument, 0, 'r'},
 	    {"Replay_hrs", required_argument, 0, 'R'},
+	    {"from", required_argument, 0, 'F'},
+	    {"to", required_argument, 0, 'T'},
+	    {"smooth", required_argument, 0, 'S'},
 	    {"strip", required_argument, 0, 's'},
 	    {"height", required_argument, 0, 'y'},
+	    {"control", required_argument, 0, 'k'},
+	    {"http", required_argument, 0, 'W'},
 	    {"width", required_argument, 0, 'x'},
 	    {"version", no_argument, 0, 'v'},
 	    {0, 0, 0, 0}
@@ -111,7 +179,7 @@ void parseargs(int argc, char **argv)
 
     while (1) {
 	index = 0;
-	c = getopt_long(argc, argv, "cd:fg:hinR:r:s:tvx:y:", longopts, &index);
+	c = getopt_long(argc, argv, "A:B:C:cDd:F:fG:g:hI:ik:M:no:P:R:r:S:s:T:tu:vW:x:y:", longopts, &index);
 
 	if (c == -1)
 		break;
@@ -124,25 +192,83 @@ void parseargs(int argc, char **argv)
 
 	case 'h':
 		fprintf(stderr, "%s version %s\n", argv[0], VERSION);
-		fprintf(stderr, "Usage: %s \n"
+		fprintf(stderr, "Usage: %s [stats [station ...] | state]\n"
+			"stats          - time in each category, changes and the\n"
+			"                 longest IFR spell per station, over -F to -T\n"
+			"state          - what the running map is showing, read\n"
+			"                 from shared memory\n"
 			"-h (--help)    - this information\n"
+			"-A (--max-age) - minutes before a METAR counts as out\n"
+			"                 of date and shows as no data (default 90)\n"
+			"-B (--brightness) - the daemon's brightness schedule\n"
+			"                 (default Brightness.dat, or dark 21:00-06:00)\n"
 			"-s (--strip)   - strip type - rgb, grb, gbr, rgbw\n"
-			"-x (--width)   - matrix width (default 8)\n"
-			"-y (--height)  - matrix height (default 8)\n"
+			"-x (--width)   - matrix width (default 50)\n"
+			"-y (--height)  - matrix height (default 1)\n"
 			"-d (--dma)     - dma channel to use (default 10)\n"
 			"-g (--gpio)    - GPIO to use\n"
 			"                 If omitted, default is 18 (PWM0)\n"
+			"-G (--gpio2)   - GPIO for a second string, e.g. 13 (PWM1)\n"
+			"-C (--count2)  - leds on the second string, the rest\n"
+			"                 are on the first (default half)\n"
 			"-i (--invert)  - invert pin output (pulse LOW)\n"
+			"-I (--import)  - build history from archived METARs, an\n"
+			"                 XML or CSV file or a directory of them,\n"
+			"                 and exit. Replaces the history there is\n"
 			"-c (--clear)   - clear matrix on exit.\n"
-			"-r (--replay)  - replay days range 1-10\n"
-			"-R (--replay)  - replay hours range 1-240\n"
+			"-P (--parallel)- airport batches fetched at once when\n"
+			"                 the list needs more than one request\n"
+			"                 (default 4)\n"
+			"-r (--replay)  - replay days range 1-180\n"
+			"-R (--replay)  - replay hours range 1-4320\n"
+			"-F (--from)    - replay from this time, YYYY-MM-DD[ HH:MM]\n"
+			"                 or 3d, 6h, 90m ago\n"
+			"-T (--to)      - replay up to this time (default now)\n"
+			"-S (--smooth)  - fade between replay records with this\n"
+			"                 many in-between frames (1-30)\n"
 			"-t (--test)  	- operate in test mode\n"
+			"-u (--source)  - where the weather comes from: an http url\n"
+			"                 the stations go on the end of, a recorded\n"
+			"                 response file, or a directory of them to\n"
+			"                 go through one per refresh\n"
+			"-M (--metrics) - write timings and counters to this file\n"
+			"                 after every refresh, Prometheus format\n"
 			"-n (--night)   - night mode - record but don't light\n"
+			"-o (--output)  - where frames go: ws2811 (default), fb for\n"
+			"                 an in-memory framebuffer, record[:file]\n"
+			"                 to save them (default frames.rec)\n"
+			"-D (--daemon)  - stay running, refresh every 5 minutes\n"
+			"                 and dim or go dark on the -B schedule\n"
+			"-k (--control) - socket the daemon takes commands on\n"
+			"                 (default /run/metarmap.sock)\n"
+			"-W (--http)    - serve the map's state, live updates and\n"
+			"                 the replay controls on this port\n"
 			"-v (--version) - version information\n"
 			, argv[0]);
 		exit(-1);
 
+	case 'A':
+		if (optarg) {
+			stale_minutes = atoi(optarg);
+			if (stale_minutes <= 0) {
+				printf ("invalid max-age %d\n", stale_minutes);
+				exit (-1);
+			}
+		}
+		break;
+
+	case 'B':
+		if (optarg) {
+			if (strlen(optarg) >= sizeof(brightness_file)) {
+				printf ("invalid brightness file %s\n", optarg);
+				exit (-1);
+			}
+			strcpy(brightness_file, optarg);
+		}
+		break;
+
 	case 'D':
+		daemon_mode=TRUE;
 		break;
 
 	case 'g':
@@ -151,6 +277,22 @@ void parseargs(int argc, char **argv)
 	    }
 	    break;
 
+	case 'G':
+		if (optarg) {
+			gpio2 = atoi(optarg);
+	    }
+	    break;
+
+	case 'C':
+		if (optarg) {
+			count2 = atoi(optarg);
+			if (count2 <= 0) {
+				printf ("invalid count2 %d\n", count2);
+				exit (-1);
+			}
+		}
+		break;
+
 	case 'i':
 		invert=1;
 		break;
@@ -179,14 +321,115 @@ void parseargs(int argc, char **argv)
 	    }
 		break;
 
+	case 'F':
+	case 'T':
+	    {
+		time_t t = optarg ? ParseReplayTime(optarg) : -1;
+		if (t == -1) {
+			printf ("invalid time %s\n", optarg ? optarg : "");
+			exit (-1);
+		}
+		replay_mode=TRUE;
+		if (c == 'F')
+		    replay_from = t;
+		else
+		    replay_to = t;
+	    }
+		break;
+
+	case 'S':
+		if (optarg) {
+			smooth_frames = atoi(optarg);
+			if (smooth_frames < 0 || smooth_frames > MAX_SMOOTH_FRAMES) {
+				printf ("invalid smooth %d\n", smooth_frames);
+				exit (-1);
+			}
+		}
+		break;
+
+	case 'k':
+		if (optarg) {
+			if (strlen(optarg) >= sizeof(control_socket)) {
+				printf ("invalid control socket %s\n", optarg);
+				exit (-1);
+			}
+			strcpy(control_socket, optarg);
+		}
+		break;
+
+	case 'W':
+		if (optarg) {
+			http_port = atoi(optarg);
+			if (http_port <= 0 || http_port > 65535) {
+				printf ("invalid http port %d\n", http_port);
+				exit (-1);
+			}
+		}
+		break;
+
+	case 'M':
+		if (optarg) {
+			if (strlen(optarg) >= sizeof(metrics_file)) {
+				printf ("invalid metrics file %s\n", optarg);
+				exit (-1);
+			}
+			strcpy(metrics_file, optarg);
+		}
+		break;
+
 	case 'n':
 		night_mode=TRUE;
 		break;
 
+	case 'o':
+		if (optarg) {
+			char *sFile = strchr(optarg, ':');
+			if (sFile != NULL) {
+				*sFile++ = '\0';
+				snprintf(output_file, sizeof(output_file), "%s", sFile);
+			}
+			output = OutputByName(optarg);
+			if (output == NULL) {
+				printf ("invalid output %s\n", optarg);
+				exit (-1);
+			}
+		}
+		break;
+
+	case 'P':
+		if (optarg) {
+			fetch_parallel = atoi(optarg);
+			if (fetch_parallel <= 0) {
+				printf ("invalid parallel %d\n", fetch_parallel);
+				exit (-1);
+			}
+		}
+		break;
+
 	case 't':
 		test_mode=TRUE;
 		break;
 
+	case 'I':
+		if (optarg) {
+			if (strlen(optarg) >= sizeof(import_path)) {
+				printf ("invalid import path %s\n", optarg);
+				exit (-1);
+			}
+			strcpy(import_path, optarg);
+		}
+		break;
+
+	case 'u':
+		if (optarg) {
+			if (strlen(optarg) >= sizeof(wx_source)) {
+				printf ("invalid source %s\n", optarg);
+				exit (-1);
+			}
+			strcpy(wx_source, optarg);
+		}
+		break;
+
 	case 'd':
 		if (optarg) {
 			dma = atoi(optarg);
@@ -262,6 +505,140 @@ void parseargs(int argc, char **argv)
 		exit(-1);
 	}
     }
+
+    led_count = width * height;
+    if (led_count <= 0 || led_count > HISTORY_MAX_LEDS) {
+	printf ("invalid size %d leds, history keeps at most %d\n", led_count, HISTORY_MAX_LEDS);
+	exit (-1);
+    }
+    if (gpio2) {
+	if (count2 == 0)
+	    count2 = led_count / 2;
+	if (count2 >= led_count) {
+	    printf ("invalid count2 %d for %d leds\n", count2, led_count);
+	    exit (-1);
+	}
+    }
+    else
+	count2 = 0;
+}
+
+/*
+ * Daemon mode - everything (semaphore, leds, curl, airport list) is set up once by main,
+ * then we refresh on an absolute deadline so the cycle doesn't drift and we sleep
+ * in the kernel between refreshes. Night is handled here rather than by lightsoff.sh:
+ * the brightness schedule says how bright the map is for each refresh, and at 0 we
+ * keep recording history but leave the leds dark.
+ */
+static struct BrightnessSchedule brightness_schedule;
+static int scheduled_brightness = -1;	// what the schedule last set, so a manual change holds until the next step
+
+// light the map, or keep it dark at night or when we've been told to
+static void ShowMap(int *pWasDark)
+{
+    int dark = night_mode || lights_off;
+
+    if (!dark)
+	matrix_render();
+    else if (!*pWasDark)	// just went dark - the matrix keeps the picture for later
+	clear_ledstring();
+    *pWasDark = dark;
+    HttpFrame(time(NULL));
+    HttpMode();
+    LiveStatePublish(time(NULL));
+}
+
+static int Refresh(int *pWasDark)
+{
+    int brightness = BrightnessAt(&brightness_schedule, time(NULL));
+
+    night_mode = (brightness == 0);
+    if (brightness > 0 && brightness != scheduled_brightness)
+	matrix_set_brightness(brightness);
+    scheduled_brightness = brightness;
+
+    if (LiveMetarMap() == 0)
+	return FALSE;	// no airport list, nothing we can do
+    ShowMap(pWasDark);
+    HttpStations();
+    MetricsWrite();
+    return TRUE;
+}
+
+// replay on request, then put the live picture back
+static void DaemonReplay(int hours, int *pWasDark)
+{
+    ws2811_led_t saved[led_count];
+
+    memcpy(saved, matrix, sizeof(saved));
+    num_replay_hours = hours < 1 ? 1 : hours > MAX_REPLAY_DAYS*24 ? MAX_REPLAY_DAYS*24 : hours;
+    replay_from = replay_to = 0;
+    Replay();
+
+    memcpy(matrix, saved, sizeof(saved));
+    matrix_mark_dirty();
+    *pWasDark = FALSE;	// the replay lit it up
+    ShowMap(pWasDark);
+}
+
+static void RunDaemon(void)
+{
+    struct FrameScheduler sched;
+    int was_dark = FALSE;
+
+    if (!BrightnessLoad(&brightness_schedule, brightness_file)) {
+	fprintf(stderr, "nothing usable in %s, dark 21:00-06:00 as before\n", brightness_file);
+	BrightnessLoad(&brightness_schedule, "");
+    }
+    if (!ControlOpen())
+	fprintf(stderr, "no control socket, carrying on without\n");
+
+    // a refresh is one "frame"; one that overruns its slot just skips the next
+    SchedStart(&sched, REFRESH_INTERVAL_SECS * 1000000000LL);
+
+    while (running) {
+	struct ControlCommand c = control_pending;	// left by a replay we were in
+	control_pending.cmd = CMD_NONE;
+
+	if (c.cmd == CMD_NONE) {
+	    struct pollfd pfds[CONTROL_NUM_FDS];
+	    ControlFds(pfds);
+	    int ret = SchedWaitFds(&sched, pfds, CONTROL_NUM_FDS);
+	    if (ret == SCHED_FD_READY) {
+		if (ControlTake(&control_pending, pfds) && ControlAnswer(&control_pending))
+		    control_pending.cmd = CMD_NONE;
+		continue;
+	    }
+	    if (ret < 0)
+		break;	// signalled while we slept
+
+	    if (!Refresh(&was_dark))
+		break;
+	    SchedFrameDone(&sched);
+	    continue;
+	}
+
+	ControlReply(&c, "ok");
+	switch (c.cmd) {
+	case CMD_REPLAY:
+	    DaemonReplay(c.arg, &was_dark);
+	    break;
+	case CMD_OFF:
+	case CMD_ON:
+	    lights_off = (c.cmd == CMD_OFF);
+	    ShowMap(&was_dark);
+	    break;
+	case CMD_REFRESH:
+	    if (!Refresh(&was_dark))
+		running = 0;
+	    break;
+	default:	// stop with no replay going
+	    break;
+	}
+    }
+
+    ControlClose();
+    SchedReport(&sched, "daemon");
 }
 
 int main(int argc, char *argv[])
@@ -276,6 +653,11 @@ int main(int argc, char *argv[])
     setup_handlers();
 
     parseargs(argc, argv);
+
+    if (optind < argc && strcmp(argv[optind], "stats") == 0)	// only reads, no semaphore or leds
+	return StatsCommand(argc - optind - 1, argv + optind + 1);
+    if (optind < argc && strcmp(argv[optind], "state") == 0)
+	return LiveStateCommand();
     
     // set a semaphore and check it so that only one instance of the program can run at a time. Both files and leds req exclusive use here
     sem_t *sem_id = sem_open(semName, O_CREAT, SEM_PERMISSIONS, 1);
@@ -294,26 +676,46 @@ int main(int argc, char *argv[])
     sem_wait(sem_id);	// wait for anybody else who has this process and its resources
     printf("we have the sem\n");  // free at last free at last
 
+    if (import_path[0] != '\0') {	// no leds or curl wanted for this
+	int iImported = ImportHistory(import_path);
+	sem_post(sem_id);
+	return iImported ? 0 : 1;
+    }
+
     ws2811_ret = init_led_string();
     if (ws2811_ret != WS2811_SUCCESS) {
-	fprintf(stderr, "ws2811_init failed: %s\n", ws2811_get_return_t_str(ws2811_ret));
+	fprintf(stderr, "%s init failed: %s\n", output->name, ws2811_get_return_t_str(ws2811_ret));
 	sem_post(sem_id);
 	return ws2811_ret;
     }
 
+    curl_global_init(CURL_GLOBAL_ALL);
+    LiveStateOpen();	// other processes do without if it can't be made
+
+    if (http_port > 0 && (replay_mode || daemon_mode) && !HttpOpen())
+	fprintf(stderr, "no http server, carrying on without\n");
+
     if(replay_mode == TRUE) {
 	printf("replay\n");
 	Replay();
+    } else if (daemon_mode == TRUE) {
+	printf("daemon\n");
+	RunDaemon();
     } else {
 	if (LiveMetarMap() == 0) {
+	    FinishLiveMetarMap();
+	    curl_global_cleanup();
     	    sem_post(sem_id);
 	    return 0;
 	}
+	LiveStatePublish(time(NULL));
     }
 	 
-    if (!night_mode) { // don't blinky blinky all night
+    if (!night_mode && !lights_off) { // don't blinky blinky all night, or light up what was turned off
 	matrix_render();
     }
+    if (!replay_mode)
+	MetricsWrite();
 
     // 15 frames /sec
     usleep(1000000 / 15);
@@ -323,7 +725,11 @@ int main(int argc, char *argv[])
 	matrix_render();
     }
 
+    HttpClose();
+    LiveStateClose();
     finish_led_string();
+    FinishLiveMetarMap();
+    curl_global_cleanup();
 
     printf ("freeing semaphore\n"); // to make all of the output print
     sem_post(sem_id);  // set him free
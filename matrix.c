@@ -1,9 +1,12 @@
 //#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "METARmap.h"
 #include "matrix.h"
+#include "output.h"
+#include "metrics.h"
 
 ws2811_t ledstring =
 {
@@ -30,39 +33,58 @@ ws2811_t ledstring =
 };
 
 ws2811_led_t *matrix;
-
-void matrix_render(void)
+const struct OutputBackend *output = &ws2811_output;
+static int count0;	// leds on channel 0, the rest of the matrix is on channel 1
+
+// Dirty tracking so an unchanged frame costs nothing. matrix_dirty means the matrix
+// has changes the led buffer doesn't, render_pending means the led buffer has
+// changes the string hasn't been sent yet.
+static int matrix_dirty = 1;
+static int render_pending = 1;
+unsigned long renders_issued = 0;
+unsigned long renders_skipped = 0;
+
+void matrix_mark_dirty(void)
 {
-    int x, y;
+    matrix_dirty = 1;
+}
 
-    for (x = 0; x < width; x++)
-    {
-        for (y = 0; y < height; y++)
-        {
-            ledstring.channel[0].leds[(y * width) + x] = matrix[y * width + x];
-        }
+static void send_ledstring(void)
+{
+    if (!render_pending) {
+	renders_skipped++;
+	return;
     }
-   
+
     int ret = 0;
-    if ((ret = ws2811_render(&ledstring)) != WS2811_SUCCESS) {
-	fprintf(stderr, "ws2811_render failed: %s\n", ws2811_get_return_t_str(ret));
+    double tStart = MetricsNow();
+    ret = output->render(&ledstring);
+    metrics.renderSecondsTotal += MetricsNow() - tStart;
+    if (ret != WS2811_SUCCESS) {
+	fprintf(stderr, "%s render failed: %s\n", output->name, ws2811_get_return_t_str(ret));
     }
+    render_pending = 0;
+    renders_issued++;
 }
 
-void matrix_clear(void)
+void matrix_render(void)
 {
-    int x, y;
-
-    for (y = 0; y < (height ); y++)
-    {
-        for (x = 0; x < width; x++)
-        {
-            matrix[y * width + x] = 0;
-        }
+    if (matrix_dirty) {
+	memcpy(ledstring.channel[0].leds, matrix, sizeof(ws2811_led_t) * count0);
+	if (led_count > count0)
+	    memcpy(ledstring.channel[1].leds, matrix + count0, sizeof(ws2811_led_t) * (led_count - count0));
+	matrix_dirty = 0;
+	render_pending = 1;
     }
+
+    send_ledstring();
 }
 
-int dotspos[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+void matrix_clear(void)
+{
+    memset(matrix, 0, sizeof(ws2811_led_t) * led_count);
+    matrix_dirty = 1;
+}
 
 ws2811_led_t dotcolors[] =
 {
@@ -76,37 +98,37 @@ ws2811_led_t dotcolors[] =
     0x00200010,  // pink
 };
 
-ws2811_led_t dotcolors_rgbw[] =
-{
-    0x00200000,  // red
-    0x10200000,  // red + W
-    0x00002000,  // green
-    0x10002000,  // green + W
-    0x00000020,  // blue
-    0x10000020,  // blue + W
-    0x00101010,  // white
-    0x10101010,  // white + W
+// category char ('V','M','I','L', anything else is no data) to the color we send for it.
+// Live and replay both light leds through this one table.
+ws2811_led_t category_colors[256];
 
-};
+void init_category_colors(void)
+{
+    for (int i = 0; i < 256; i++)
+	category_colors[i] = dotcolors[NO_AIRPORT_DATA];
+    category_colors['V'] = dotcolors[VFR];
+    category_colors['M'] = dotcolors[MVFR];
+    category_colors['I'] = dotcolors[IFR];
+    category_colors['L'] = dotcolors[LIFR];
+}
 
 void clear_ledstring(void) {
-    int x, y;
-
-    for (x = 0; x < width; x++)
-    {
-        for (y = 0; y < height; y++)
-        {
-            ledstring.channel[0].leds[(y * width) + x] = 0;
-        }
-    }
+    memset(ledstring.channel[0].leds, 0, sizeof(ws2811_led_t) * count0);
+    if (led_count > count0)
+	memset(ledstring.channel[1].leds, 0, sizeof(ws2811_led_t) * (led_count - count0));
     
-    ws2811_render(&ledstring);
+    double tStart = MetricsNow();
+    output->render(&ledstring);
+    metrics.renderSecondsTotal += MetricsNow() - tStart;
+    renders_issued++;
+    matrix_dirty = 1;	// the string no longer shows the matrix
 }
 
 ws2811_return_t init_led_string(void)
 {
     
-    matrix = malloc(sizeof(ws2811_led_t) * width * height);
+    matrix = calloc(led_count, sizeof(ws2811_led_t));
+    init_category_colors();
     
 /*
  * PWM0, which can be set to use GPIOs 12, 18, 40, and 52.
@@ -124,20 +146,80 @@ ws2811_return_t init_led_string(void)
 
     ledstring.channel[0].gpionum = gpio;
     ledstring.channel[0].invert= invert;
-    ledstring.channel[0].count = width * height;
     ledstring.dmanum = dma;
 	ledstring.channel[0].strip_type = strip;
+
+    // a second string on its own pin takes the tail of the matrix, the library
+    // clocks both channels out of the same dma transfer
+    count0 = led_count;
+    if (gpio2) {
+	count0 = led_count - count2;
+	ledstring.channel[1].gpionum = gpio2;
+	ledstring.channel[1].invert = invert;
+	ledstring.channel[1].count = count2;
+	ledstring.channel[1].brightness = 255;
+	ledstring.channel[1].strip_type = strip;
+    }
+    ledstring.channel[0].count = count0;
     
-    return ws2811_init(&ledstring);
+    return output->init(&ledstring);
 }
 
 void finish_led_string()
 {
-    ws2811_fini(&ledstring);	
+    printf("renders: %lu issued, %lu skipped as unchanged\n", renders_issued, renders_skipped);
+    output->fini(&ledstring);	
     free(matrix);
 }
 
-void SetMatrixPixel(int pixnum, int iColorIndex)
+void SetMatrixCategory(int pixnum, char cCond)
+{
+    ws2811_led_t color = category_colors[(unsigned char)cCond];
+
+    if (matrix[pixnum] != color) {
+	matrix[pixnum] = color;
+	matrix_dirty = 1;
+    }
+}
+
+// takes effect on the next render, which we make sure there is
+void matrix_set_brightness(int brightness)
+{
+    ledstring.channel[0].brightness = brightness;
+    if (ledstring.channel[1].count > 0)
+	ledstring.channel[1].brightness = brightness;
+    render_pending = 1;
+}
+
+int matrix_get_brightness(void)
+{
+    return ledstring.channel[0].brightness;
+}
+
+// put just the leds that changed since the last frame into the matrix and the
+// led buffer - no walk over the whole matrix
+void matrix_set_changes(const struct FrameChange *changes, int numChanges)
+{
+    ws2811_led_t *leds0 = ledstring.channel[0].leds;
+    ws2811_led_t *leds1 = ledstring.channel[1].leds;
+
+    for (int i = 0; i < numChanges; i++) {
+	int led = changes[i].led;
+
+	matrix[led] = changes[i].color;
+	if (led < count0)
+	    leds0[led] = changes[i].color;
+	else
+	    leds1[led - count0] = changes[i].color;
+    }
+    if (numChanges > 0)
+	render_pending = 1;
+}
+
+// and send them, unless there weren't any. If something else touched the
+// matrix since the last render the whole thing goes.
+void matrix_render_changes(const struct FrameChange *changes, int numChanges)
 {
-    matrix[pixnum] = dotcolors[iColorIndex];
+    matrix_set_changes(changes, numChanges);
+    matrix_render();
 }
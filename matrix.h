@@ -7,12 +7,32 @@ extern int led_count;
 extern int strip;
 extern int dma;
 extern int gpio;
+extern int gpio2;
+extern int count2;
 extern int invert;
 
+extern ws2811_led_t *matrix;
+extern const struct OutputBackend *output;
+extern ws2811_led_t category_colors[256];
+extern unsigned long renders_issued;
+extern unsigned long renders_skipped;
+
+// one led that changes color going into a frame
+struct FrameChange {
+    uint16_t led;
+    ws2811_led_t color;
+};
+
 void matrix_render(void);
 void matrix_clear(void);
+void matrix_mark_dirty(void);
 void clear_ledstring(void);
 ws2811_return_t init_led_string(void);
 void finish_led_string(void);
-void SetMatrixPixel(int pixnum, int iColorIndex);
+void SetMatrixCategory(int pixnum, char cCond);
+void init_category_colors(void);
+void matrix_set_brightness(int brightness);
+int matrix_get_brightness(void);
+void matrix_set_changes(const struct FrameChange *changes, int numChanges);
+void matrix_render_changes(const struct FrameChange *changes, int numChanges);
 
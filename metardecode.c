@@ -0,0 +1,227 @@
+/**********************************************************************
+* Filename    : metardecode.c
+* Description : Flight category from a METAR's raw_text, for stations
+*               the response has no <flight_category> for
+*
+* One pass over the text, a group at a time, straight out of the
+* response buffer - nothing is copied or allocated, so it's just as
+* happy going through years of archived METARs. Groups are classified
+* by their shape rather than their position, since AUTO, COR and
+* missing groups move everything along. Everything after RMK or the
+* start of a TEMPO/BECMG trend is forecast or remarks and is skipped.
+**********************************************************************/
+#include <string.h>
+
+#include "METARmap.h"
+#include "metardecode.h"
+
+#define VIS_P6SM (6 * 16 + 1)	// more than 6 miles
+#define METERS_PER_SM 1609.344
+
+static int IsDigit(char c)
+{
+    return (unsigned)(c - '0') <= 9;
+}
+
+// the number in the n characters at p, -1 if any of them isn't a digit
+static int Number(const char *p, size_t n)
+{
+    int v = 0;
+
+    if (n == 0)
+	return -1;
+    for (size_t i = 0; i < n; i++) {
+	if (!IsDigit(p[i]))
+	    return -1;
+	v = v * 10 + p[i] - '0';
+    }
+    return v;
+}
+
+static int Is(const char *p, size_t n, const char *sWord)
+{
+    size_t len = strlen(sWord);
+    return n == len && memcmp(p, sWord, len) == 0;
+}
+
+static int EndsWith(const char *p, size_t n, const char *sEnd)
+{
+    size_t len = strlen(sEnd);
+    return n > len && memcmp(p + n - len, sEnd, len) == 0;
+}
+
+// dddff(f)(Gff(f))KT or VRBffKT, knots only - MPS stations are converted
+static int Wind(const char *p, size_t n, struct MetarObs *obs)
+{
+    int mps = EndsWith(p, n, "MPS");
+
+    if (!mps && !EndsWith(p, n, "KT"))
+	return FALSE;
+    n -= mps ? 3 : 2;
+    if (n < 5)
+	return FALSE;
+
+    int dir = -1;
+    if (!Is(p, 3, "VRB") && (dir = Number(p, 3)) < 0)
+	return FALSE;
+
+    const char *g = memchr(p + 3, 'G', n - 3);
+    size_t speedLen = (g != NULL ? (size_t)(g - p) : n) - 3;
+    int speed = Number(p + 3, speedLen);
+    int gust = g != NULL ? Number(g + 1, n - (g + 1 - p)) : 0;
+    if (speed < 0 || gust < 0)
+	return FALSE;
+
+    obs->windDir = dir;
+    obs->windKt = mps ? speed * 2 : speed;	// 1.94 kt to the m/s is close enough for this
+    obs->gustKt = mps ? gust * 2 : gust;
+    return TRUE;
+}
+
+// [M|P]n SM, [M]n/d SM or the fraction half of "1 1/2SM" with the whole miles already seen
+static int Visibility(const char *p, size_t n, int wholeMiles, struct MetarObs *obs)
+{
+    int less = FALSE, more = FALSE;
+
+    if (!EndsWith(p, n, "SM"))
+	return FALSE;
+    n -= 2;
+    if (*p == 'M' || *p == 'P') {
+	less = (*p == 'M');
+	more = (*p == 'P');
+	p++;
+	n--;
+    }
+
+    const char *slash = memchr(p, '/', n);
+    int vis;
+    if (slash != NULL) {
+	int num = Number(p, slash - p);
+	int den = Number(slash + 1, n - (slash + 1 - p));
+	if (num < 0 || den <= 0)
+	    return FALSE;
+	vis = num * 16 / den + (wholeMiles > 0 ? wholeMiles * 16 : 0);
+    } else {
+	int miles = Number(p, n);
+	if (miles < 0)
+	    return FALSE;
+	vis = miles * 16;
+    }
+
+    obs->visSixteenths = more ? vis + 1 : vis;
+    obs->visLessThan = less;
+    return TRUE;
+}
+
+// FEWhhh SCThhh BKNhhh OVChhh VVhhh, hundreds of feet, CB/TCU after it ignored
+static int Sky(const char *p, size_t n, struct MetarObs *obs)
+{
+    if (Is(p, n, "CLR") || Is(p, n, "SKC") || Is(p, n, "NSC") || Is(p, n, "NCD")) {
+	obs->haveSky = TRUE;
+	return TRUE;
+    }
+
+    int cover = n >= 5 && p[0] == 'V' && p[1] == 'V' ? 2
+	: n >= 6 && (memcmp(p, "FEW", 3) == 0 || memcmp(p, "SCT", 3) == 0
+		     || memcmp(p, "BKN", 3) == 0 || memcmp(p, "OVC", 3) == 0) ? 3 : 0;
+    if (cover == 0)
+	return FALSE;
+    obs->haveSky = TRUE;
+    if (cover == 3 && (p[0] == 'F' || p[0] == 'S'))
+	return TRUE;	// few and scattered aren't a ceiling
+
+    int height = Number(p + cover, 3);
+    if (height < 0) {
+	if (cover == 2 && memcmp(p + 2, "///", 3) == 0)
+	    height = 0;	// sky obscured, height not known - as low as it gets
+	else
+	    return TRUE;	// BKN/// from an automated station, no height to go on
+    }
+    if (obs->ceilingFt == CEILING_NONE || height * 100 < obs->ceilingFt)
+	obs->ceilingFt = height * 100;
+    return TRUE;
+}
+
+/*
+ * Fill in obs from the report. FALSE if there was nothing in it to go on -
+ * no visibility and no sky - which is what a NIL report or an empty
+ * raw_text gives.
+ */
+int MetarDecode(const char *sRaw, size_t len, struct MetarObs *obs)
+{
+    const char *p = sRaw;
+    const char *pEnd = sRaw + len;
+    int haveWind = FALSE;
+    int wholeMiles = -1;	// a bare 1 or 2 that could be the start of "1 1/2SM"
+
+    obs->visSixteenths = VIS_UNKNOWN;
+    obs->visLessThan = FALSE;
+    obs->ceilingFt = CEILING_NONE;
+    obs->haveSky = FALSE;
+    obs->windDir = -1;
+    obs->windKt = 0;
+    obs->gustKt = 0;
+
+    while (p < pEnd) {
+	while (p < pEnd && *p == ' ')
+	    p++;
+	const char *pGroup = p;
+	while (p < pEnd && *p != ' ')
+	    p++;
+	size_t n = p - pGroup;
+	if (n == 0)
+	    break;
+
+	if (Is(pGroup, n, "RMK") || Is(pGroup, n, "TEMPO") || Is(pGroup, n, "BECMG")
+	    || Is(pGroup, n, "NOSIG"))
+	    break;
+
+	int whole = wholeMiles;
+	wholeMiles = -1;
+
+	if (Is(pGroup, n, "CAVOK")) {
+	    obs->visSixteenths = VIS_P6SM;
+	    obs->haveSky = TRUE;
+	} else if (!haveWind && Wind(pGroup, n, obs))
+	    haveWind = TRUE;
+	else if (Visibility(pGroup, n, whole, obs))
+	    ;
+	else if (Sky(pGroup, n, obs))
+	    ;
+	else if (n <= 2 && Number(pGroup, n) >= 0)
+	    wholeMiles = Number(pGroup, n);
+	else if (n == 4 && haveWind && obs->visSixteenths == VIS_UNKNOWN && !obs->haveSky
+		 && Number(pGroup, 4) >= 0) {
+	    // outside the US, meters - 9999 is 10 km or more
+	    int meters = Number(pGroup, 4);
+	    obs->visSixteenths = meters == 9999 ? VIS_P6SM : (int)(meters * 16 / METERS_PER_SM);
+	}
+    }
+
+    return obs->visSixteenths != VIS_UNKNOWN || obs->haveSky;
+}
+
+/*
+ * The FAA categories, whichever of ceiling and visibility is worse:
+ *   LIFR  ceiling below 500 ft or visibility below 1 mile
+ *   IFR   ceiling 500 to below 1000 ft or visibility 1 to below 3 miles
+ *   MVFR  ceiling 1000 to 3000 ft or visibility 3 to 5 miles
+ *   VFR   ceiling above 3000 ft and visibility above 5 miles
+ * A visibility that wasn't reported doesn't count against it.
+ */
+char MetarCategory(const struct MetarObs *obs)
+{
+    int vis = obs->visSixteenths;
+    int ceil = obs->ceilingFt;
+
+    if (obs->visLessThan && vis > 0)
+	vis--;	// M1/4SM is less than a quarter mile
+
+    if ((ceil != CEILING_NONE && ceil < 500) || (vis != VIS_UNKNOWN && vis < 16))
+	return 'L';
+    if ((ceil != CEILING_NONE && ceil < 1000) || (vis != VIS_UNKNOWN && vis < 3 * 16))
+	return 'I';
+    if ((ceil != CEILING_NONE && ceil <= 3000) || (vis != VIS_UNKNOWN && vis <= 5 * 16))
+	return 'M';
+    return 'V';
+}
@@ -0,0 +1,22 @@
+#include <stddef.h>
+
+#define VIS_UNKNOWN -1		// no visibility group
+#define CEILING_NONE -1		// no BKN, OVC or VV layer
+
+/*
+ * What raw_text says about the things the flight category comes from.
+ * Visibility is kept in sixteenths of a statute mile so 1/16 through 15/16
+ * and "1 1/2" are exact; P6SM and CAVOK are stored as just over the limit.
+ */
+struct MetarObs {
+    int visSixteenths;		// VIS_UNKNOWN if not reported
+    int visLessThan;		// M1/4SM - below what's given
+    int ceilingFt;		// lowest BKN, OVC or VV, CEILING_NONE if there isn't one
+    int haveSky;		// any cloud group at all, CLR and SKC included
+    int windDir;		// degrees, -1 for VRB or none
+    int windKt;
+    int gustKt;			// 0 if none
+};
+
+int MetarDecode(const char *sRaw, size_t len, struct MetarObs *obs);
+char MetarCategory(const struct MetarObs *obs);
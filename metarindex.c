@@ -0,0 +1,288 @@
+/**********************************************************************
+* Filename    : metarindex.c
+* Description : Split the aviation wx response into <METAR> records in one
+*               pass and find each airport's record with a perfect hash
+*
+* Every record is found once, front to back, and only the four tags we use
+* (station_id, raw_text, flight_category, observation_time) are kept as
+* pointer/length views into the response buffer. No copies are made, so the
+* index is only good as long as that buffer is.
+**********************************************************************/
+#define _GNU_SOURCE	// memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "METARmap.h"
+#include "metarindex.h"
+
+#define MAX_SEED_TRIES 65535
+
+static uint32_t Mix32(uint32_t h)
+{
+    // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t BucketOf(const struct StationTable *table, uint32_t key)
+{
+    return Mix32(key) % (uint32_t)table->numBuckets;
+}
+
+static uint32_t SlotOf(const struct StationTable *table, uint32_t key, uint16_t seed)
+{
+    return Mix32(key ^ (seed * 0x9e3779b9u)) & table->mask;
+}
+
+// station codes are at most 4 characters so they pack into one word
+uint32_t StationKey(const char *sCode, size_t len)
+{
+    uint32_t key = 0;
+
+    for (size_t i = 0; i < len && i < 4 && sCode[i] != 0; i++)
+	key |= (uint32_t)(unsigned char)sCode[i] << (i * 8);
+    return key;
+}
+
+int StationTableBuild(struct StationTable *table, const struct stAirport *airports, int numAirports)
+{
+    uint32_t size = 1;
+    uint32_t *uniqueKeys = malloc(sizeof(uint32_t) * (numAirports + 1));
+    int numUnique = 0;
+
+    memset(table, 0, sizeof(*table));
+    if (uniqueKeys == NULL)
+	return FALSE;
+
+    // the same airport can be on the list twice, it only needs one slot
+    for (int i = 0; i < numAirports; i++) {
+	uint32_t key = StationKey(airports[i].sAirportCode, sizeof(airports[i].sAirportCode));
+	int j;
+	for (j = 0; j < numUnique && uniqueKeys[j] != key; j++)
+	    ;
+	if (j == numUnique && key != 0)
+	    uniqueKeys[numUnique++] = key;
+    }
+
+    while (size < (uint32_t)numUnique * 2)	// half full keeps the seed search short
+	size <<= 1;
+    table->numKeys = numUnique;
+    table->numBuckets = numUnique / 2 + 1;
+    table->mask = size - 1;
+    table->seeds = calloc(table->numBuckets, sizeof(uint16_t));
+    table->keys = calloc(size, sizeof(uint32_t));
+    int *bucketOf = malloc(sizeof(int) * (numUnique + 1));
+    int *order = malloc(sizeof(int) * (table->numBuckets + 1));
+    int *bucketSize = calloc(table->numBuckets, sizeof(int));
+
+    if (table->seeds == NULL || table->keys == NULL || bucketOf == NULL || order == NULL || bucketSize == NULL) {
+	free(bucketOf);
+	free(order);
+	free(bucketSize);
+	free(uniqueKeys);
+	StationTableFree(table);
+	return FALSE;
+    }
+
+    for (int i = 0; i < numUnique; i++) {
+	bucketOf[i] = BucketOf(table, uniqueKeys[i]);
+	bucketSize[bucketOf[i]]++;
+    }
+
+    // place the crowded buckets first while the table is still empty
+    for (int b = 0; b < table->numBuckets; b++)
+	order[b] = b;
+    for (int i = 1; i < table->numBuckets; i++) {
+	int b = order[i];
+	int j = i;
+	while (j > 0 && bucketSize[order[j-1]] < bucketSize[b]) {
+	    order[j] = order[j-1];
+	    j--;
+	}
+	order[j] = b;
+    }
+
+    int iRet = TRUE;
+    for (int o = 0; o < table->numBuckets && iRet; o++) {
+	int b = order[o];
+	int seed;
+
+	if (bucketSize[b] == 0)
+	    break;
+	uint32_t slots[bucketSize[b]];	// not before the check, a zero length VLA is undefined
+
+	for (seed = 0; seed < MAX_SEED_TRIES; seed++) {
+	    int n = 0;
+	    int ok = TRUE;
+	    for (int i = 0; i < numUnique && ok; i++) {
+		if (bucketOf[i] != b)
+		    continue;
+		uint32_t slot = SlotOf(table, uniqueKeys[i], (uint16_t)seed);
+		if (table->keys[slot] != 0)
+		    ok = FALSE;
+		for (int k = 0; k < n && ok; k++)
+		    if (slots[k] == slot)
+			ok = FALSE;
+		slots[n++] = slot;
+	    }
+	    if (ok)
+		break;
+	}
+	if (seed == MAX_SEED_TRIES) {
+	    fprintf(stderr, "couldn't build the station table\n");
+	    iRet = FALSE;
+	    break;
+	}
+
+	table->seeds[b] = (uint16_t)seed;
+	for (int i = 0; i < numUnique; i++)
+	    if (bucketOf[i] == b)
+		table->keys[SlotOf(table, uniqueKeys[i], (uint16_t)seed)] = uniqueKeys[i];
+    }
+
+    free(bucketOf);
+    free(order);
+    free(bucketSize);
+    free(uniqueKeys);
+    if (!iRet)
+	StationTableFree(table);
+    return iRet;
+}
+
+// slot for this station or -1 if it isn't one of ours
+int StationTableLookup(const struct StationTable *table, uint32_t key)
+{
+    if (table->keys == NULL || key == 0)
+	return -1;
+    uint32_t slot = SlotOf(table, key, table->seeds[BucketOf(table, key)]);
+    return table->keys[slot] == key ? (int)slot : -1;
+}
+
+void StationTableFree(struct StationTable *table)
+{
+    free(table->seeds);
+    free(table->keys);
+    table->seeds = NULL;
+    table->keys = NULL;
+}
+
+int MetarIndexInit(struct MetarIndex *index, const struct StationTable *table)
+{
+    memset(index, 0, sizeof(*index));
+    index->table = table;
+    index->records = calloc(table->mask + 1, sizeof(struct MetarRecord));
+    return index->records != NULL;
+}
+
+static const char *FindText(const char *sStart, const char *sEnd, const char *sText, size_t len)
+{
+    if (sEnd - sStart < (ptrdiff_t)len)
+	return NULL;
+    return memmem(sStart, sEnd - sStart, sText, len);
+}
+
+#define TAG(s) s, sizeof(s) - 1
+
+// value of <tag>value</tag> if p points just past the '<' of an opening tag we want
+static int TagValue(const char *p, const char *sEnd, const char *sTag, size_t tagLen, struct TextView *view)
+{
+    if (sEnd - p <= (ptrdiff_t)tagLen || memcmp(p, sTag, tagLen) != 0)
+	return FALSE;
+    p += tagLen;
+    const char *sClose = memchr(p, '<', sEnd - p);
+    if (sClose == NULL)
+	return FALSE;
+    view->ptr = p;
+    view->len = sClose - p;
+    return TRUE;
+}
+
+void MetarIndexReset(struct MetarIndex *index)
+{
+    memset(index->records, 0, sizeof(struct MetarRecord) * (index->table->mask + 1));
+    index->numRecords = 0;
+    index->numMatched = 0;
+}
+
+/*
+ * The next <METAR> record at or after p, its tags as views into the buffer.
+ * Returns where to look for the one after, NULL when there are no more.
+ */
+const char *MetarNextRecord(const char *p, const char *sEnd, struct MetarRecord *rec)
+{
+    if ((p = FindText(p, sEnd, TAG("<METAR>"))) == NULL)
+	return NULL;
+
+    const char *sRecEnd = FindText(p, sEnd, TAG("</METAR>"));
+    if (sRecEnd == NULL)
+	sRecEnd = sEnd;	// truncated response, take what is there
+    memset(rec, 0, sizeof(*rec));
+
+    // walk the tags in this record only
+    for (const char *q = p + 1; q < sRecEnd; q++) {
+	q = memchr(q, '<', sRecEnd - q);
+	if (q == NULL)
+	    break;
+	q++;
+	if (TagValue(q, sRecEnd, TAG("station_id>"), &rec->station_id)
+	    || TagValue(q, sRecEnd, TAG("raw_text>"), &rec->raw_text)
+	    || TagValue(q, sRecEnd, TAG("flight_category>"), &rec->flight_category)
+	    || TagValue(q, sRecEnd, TAG("observation_time>"), &rec->observation_time))
+	    continue;	// got one, on to the next tag
+    }
+    return sRecEnd;
+}
+
+// add one response's records to what the index has - batched requests go in one after another
+int MetarIndexAdd(struct MetarIndex *index, const char *sData, size_t len)
+{
+    const char *p = sData;
+    const char *sEnd = sData + len;
+    int numRecords = 0;
+    struct MetarRecord rec;
+
+    while ((p = MetarNextRecord(p, sEnd, &rec)) != NULL) {
+	index->numRecords++;
+	numRecords++;
+
+	int slot = StationTableLookup(index->table, StationKey(rec.station_id.ptr, rec.station_id.len));
+	if (rec.station_id.ptr != NULL && slot >= 0) {
+	    struct MetarRecord *pOld = &index->records[slot];
+	    // if a station shows up twice keep the newer one - iso times sort as text
+	    if (pOld->station_id.ptr == NULL) {
+		index->numMatched++;
+		*pOld = rec;
+	    } else if (rec.observation_time.len == pOld->observation_time.len
+		       && memcmp(rec.observation_time.ptr, pOld->observation_time.ptr, rec.observation_time.len) > 0) {
+		*pOld = rec;
+	    }
+	}
+    }
+
+    return numRecords;
+}
+
+int MetarIndexBuild(struct MetarIndex *index, const char *sData, size_t len)
+{
+    MetarIndexReset(index);
+    return MetarIndexAdd(index, sData, len);
+}
+
+const struct MetarRecord *MetarIndexFind(const struct MetarIndex *index, const char *sAirportCode)
+{
+    int slot = StationTableLookup(index->table, StationKey(sAirportCode, strlen(sAirportCode)));
+    if (slot < 0 || index->records[slot].station_id.ptr == NULL)
+	return NULL;
+    return &index->records[slot];
+}
+
+void MetarIndexFree(struct MetarIndex *index)
+{
+    free(index->records);
+    index->records = NULL;
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stddef.h>
+
+// a piece of the response buffer - not null terminated
+struct TextView {
+    const char *ptr;
+    size_t len;
+};
+
+// the parts of one <METAR> record we care about
+struct MetarRecord {
+    struct TextView station_id;
+    struct TextView raw_text;
+    struct TextView flight_category;
+    struct TextView observation_time;
+};
+
+// Perfect hash over the station codes in AirportList.dat. Built once at startup,
+// hash-and-displace style: a key's bucket picks a seed that sends it to its own slot.
+struct StationTable {
+    int numKeys;
+    int numBuckets;
+    uint32_t mask;		// table size - 1, table size is a power of 2
+    uint16_t *seeds;		// one per bucket
+    uint32_t *keys;		// packed station code per slot, 0 is empty
+};
+
+// one response split into records, found by station in O(1)
+struct MetarIndex {
+    const struct StationTable *table;
+    struct MetarRecord *records;	// one per table slot, station_id.ptr NULL if not in the response
+    int numRecords;		// <METAR> records seen in the response
+    int numMatched;		// of those, ones for stations in our table
+};
+
+uint32_t StationKey(const char *sCode, size_t len);
+int StationTableBuild(struct StationTable *table, const struct stAirport *airports, int numAirports);
+int StationTableLookup(const struct StationTable *table, uint32_t key);
+void StationTableFree(struct StationTable *table);
+
+const char *MetarNextRecord(const char *p, const char *sEnd, struct MetarRecord *rec);
+int MetarIndexInit(struct MetarIndex *index, const struct StationTable *table);
+void MetarIndexReset(struct MetarIndex *index);
+int MetarIndexAdd(struct MetarIndex *index, const char *sData, size_t len);
+int MetarIndexBuild(struct MetarIndex *index, const char *sData, size_t len);
+const struct MetarRecord *MetarIndexFind(const struct MetarIndex *index, const char *sAirportCode);
+void MetarIndexFree(struct MetarIndex *index);
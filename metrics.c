@@ -0,0 +1,84 @@
+/**********************************************************************
+* Filename    : metrics.c
+* Description : Per-phase timings and counters in the Prometheus text
+*               format
+*
+* The file is written next to itself and renamed over, so whatever reads
+* it never sees half of one.
+**********************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "METARmap.h"
+#include "matrix.h"
+#include "metrics.h"
+
+struct Metrics metrics;
+char metrics_file[256];		// empty - keep count but don't write them anywhere
+
+double MetricsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Metric(FILE *f, const char *sName, const char *sType, const char *sHelp, double value)
+{
+    fprintf(f, "# HELP metarmap_%s %s\n# TYPE metarmap_%s %s\n", sName, sHelp, sName, sType);
+    // counts and timestamps whole, %g would round them to 9 digits
+    if (value == (long long)value)
+	fprintf(f, "metarmap_%s %lld\n", sName, (long long)value);
+    else
+	fprintf(f, "metarmap_%s %.9g\n", sName, value);
+}
+
+void MetricsPrint(FILE *f)
+{
+    const struct Metrics *m = &metrics;
+
+    Metric(f, "refreshes_total", "counter", "Weather refreshes done.", m->refreshes);
+    Metric(f, "fetch_errors_total", "counter", "Refreshes where no batch got an answer.", m->fetchErrors);
+    Metric(f, "fetch_not_modified_total", "counter", "Refreshes where every batch was a 304.", m->fetchNotModified);
+    Metric(f, "fetch_batches", "gauge", "Requests the airport list is split into.", m->fetchBatches);
+    Metric(f, "fetch_seconds", "gauge", "Last refresh's fetch, first request sent to last one done.", m->fetchSecondsLast);
+    Metric(f, "fetch_seconds_total", "counter", "Time spent fetching.", m->fetchSecondsTotal);
+    Metric(f, "fetch_wire_bytes_total", "counter", "Bytes received, compressed as sent.", m->fetchWireBytes);
+    Metric(f, "fetch_body_bytes_total", "counter", "Bytes received after decompression.", m->fetchBodyBytes);
+    Metric(f, "parse_seconds", "gauge", "Last refresh's indexing and categorizing.", m->parseSecondsLast);
+    Metric(f, "parse_seconds_total", "counter", "Time spent indexing and categorizing.", m->parseSecondsTotal);
+    Metric(f, "stations_found", "gauge", "Airports with a current METAR last refresh.", m->stationsFound);
+    Metric(f, "stations_missing", "gauge", "Airports not in last refresh's response.", m->stationsMissing);
+    Metric(f, "stations_stale", "gauge", "Airports whose METAR was out of date last refresh.", m->stationsStale);
+    Metric(f, "renders_total", "counter", "Frames sent to the output.", renders_issued);
+    Metric(f, "renders_skipped_total", "counter", "Renders skipped because nothing changed.", renders_skipped);
+    Metric(f, "render_seconds_total", "counter", "Time spent in the output's render.", m->renderSecondsTotal);
+    Metric(f, "history_seconds", "gauge", "Last refresh's history append.", m->historySecondsLast);
+    Metric(f, "history_seconds_total", "counter", "Time spent appending history.", m->historySecondsTotal);
+    Metric(f, "history_bytes_total", "counter", "Bytes appended to the history ring.", m->historyBytes);
+    Metric(f, "last_refresh_timestamp_seconds", "gauge", "Unix time of the last refresh.", m->lastRefresh);
+}
+
+int MetricsWrite(void)
+{
+    char sTmp[sizeof(metrics_file) + 8];
+
+    if (metrics_file[0] == '\0')
+	return TRUE;
+
+    snprintf(sTmp, sizeof(sTmp), "%s.tmp", metrics_file);
+    FILE *f = fopen(sTmp, "w");
+    if (f == NULL) {
+	perror(sTmp);
+	return FALSE;
+    }
+    MetricsPrint(f);
+
+    if (fclose(f) != 0 || rename(sTmp, metrics_file) != 0) {
+	perror(metrics_file);
+	remove(sTmp);
+	return FALSE;
+    }
+    return TRUE;
+}
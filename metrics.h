@@ -0,0 +1,33 @@
+/*
+ * What each refresh cost and what came of it. Filled in as we go - a few
+ * clock reads and adds a refresh - and written out with MetricsWrite in the
+ * Prometheus text format, for node_exporter's textfile collector or anything
+ * else that wants to cat it. "last" values are for the most recent refresh.
+ */
+struct Metrics {
+    unsigned long refreshes;
+    unsigned long fetchErrors;		// refreshes where nothing came back
+    unsigned long fetchNotModified;	// refreshes where every batch was a 304
+    int fetchBatches;
+    double fetchSecondsLast;		// all batches, first sent to last done
+    double fetchSecondsTotal;
+    unsigned long long fetchWireBytes;
+    unsigned long long fetchBodyBytes;
+    double parseSecondsLast;		// indexing the responses and categorizing our airports
+    double parseSecondsTotal;
+    int stationsFound;			// last refresh, current and lit
+    int stationsMissing;		// not in the response
+    int stationsStale;			// in it but older than stale_minutes
+    double renderSecondsTotal;		// in the output backend's render
+    double historySecondsLast;		// the append, msync included
+    double historySecondsTotal;
+    unsigned long long historyBytes;	// appended to the ring
+    time_t lastRefresh;			// wall clock, for "how long since it worked"
+};
+
+extern struct Metrics metrics;
+extern char metrics_file[256];
+
+double MetricsNow(void);
+void MetricsPrint(FILE *f);
+int MetricsWrite(void);
@@ -0,0 +1,187 @@
+/**********************************************************************
+* Filename    : output.c
+* Description : Output backends - the ws2811 string, an in-memory
+*               framebuffer and a frame recorder
+*
+* The framebuffer and recorder need no Pi and no root, so live and replay
+* can be run and profiled anywhere. The framebuffer folds every frame into
+* a hash so two runs can be compared, the recorder keeps the frames
+* themselves with when they were sent.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "METARmap.h"
+#include "output.h"
+
+char output_file[256] = "frames.rec";
+
+static int LedCount(const ws2811_t *ledstring)
+{
+    return ledstring->channel[0].count + ledstring->channel[1].count;
+}
+
+// what ws2811_init would do for the leds buffers, for backends without the driver
+static ws2811_return_t AllocChannels(ws2811_t *ledstring)
+{
+    for (int i = 0; i < RPI_PWM_CHANNELS; i++) {
+	ledstring->channel[i].leds = NULL;
+	if (ledstring->channel[i].count == 0)
+	    continue;
+	ledstring->channel[i].leds = calloc(ledstring->channel[i].count, sizeof(ws2811_led_t));
+	if (ledstring->channel[i].leds == NULL)
+	    return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    return WS2811_SUCCESS;
+}
+
+static void FreeChannels(ws2811_t *ledstring)
+{
+    for (int i = 0; i < RPI_PWM_CHANNELS; i++) {
+	free(ledstring->channel[i].leds);
+	ledstring->channel[i].leds = NULL;
+    }
+}
+
+/*
+ * the real thing
+ */
+static ws2811_return_t Ws2811Init(ws2811_t *ledstring)
+{
+    return ws2811_init(ledstring);
+}
+
+static ws2811_return_t Ws2811Render(ws2811_t *ledstring)
+{
+    return ws2811_render(ledstring);
+}
+
+static void Ws2811Fini(ws2811_t *ledstring)
+{
+    ws2811_fini(ledstring);
+}
+
+const struct OutputBackend ws2811_output = { "ws2811", Ws2811Init, Ws2811Render, Ws2811Fini };
+
+/*
+ * framebuffer - the last frame sent, both channels end to end
+ */
+static ws2811_led_t *fbFrame;
+static int fbLedCount;
+static unsigned long fbFrames;
+static uint64_t fbHash;
+
+static ws2811_return_t FramebufferInit(ws2811_t *ledstring)
+{
+    fbLedCount = LedCount(ledstring);
+    fbFrames = 0;
+    fbHash = 14695981039346656037ULL;	// FNV-1a offset basis
+    fbFrame = calloc(fbLedCount, sizeof(ws2811_led_t));
+    if (fbFrame == NULL)
+	return WS2811_ERROR_OUT_OF_MEMORY;
+    return AllocChannels(ledstring);
+}
+
+static ws2811_return_t FramebufferRender(ws2811_t *ledstring)
+{
+    int count0 = ledstring->channel[0].count;
+
+    memcpy(fbFrame, ledstring->channel[0].leds, sizeof(ws2811_led_t) * count0);
+    if (fbLedCount > count0)
+	memcpy(fbFrame + count0, ledstring->channel[1].leds, sizeof(ws2811_led_t) * (fbLedCount - count0));
+
+    const uint8_t *p = (const uint8_t *)fbFrame;
+    for (size_t i = 0; i < sizeof(ws2811_led_t) * fbLedCount; i++)
+	fbHash = (fbHash ^ p[i]) * 1099511628211ULL;
+    fbFrames++;
+    return WS2811_SUCCESS;
+}
+
+static void FramebufferFini(ws2811_t *ledstring)
+{
+    printf("framebuffer: %lu frames of %d leds, hash %016llx\n", fbFrames, fbLedCount, (unsigned long long)fbHash);
+    FreeChannels(ledstring);
+    free(fbFrame);
+    fbFrame = NULL;
+}
+
+const ws2811_led_t *FramebufferFrame(int *pLedCount, unsigned long *pFrames)
+{
+    *pLedCount = fbLedCount;
+    *pFrames = fbFrames;
+    return fbFrame;
+}
+
+const struct OutputBackend framebuffer_output = { "fb", FramebufferInit, FramebufferRender, FramebufferFini };
+
+/*
+ * recorder - every frame sent, stamped, to output_file
+ */
+static FILE *fRecording;
+static unsigned long recFrames;
+
+static ws2811_return_t RecorderInit(ws2811_t *ledstring)
+{
+    struct RecordingHeader hdr = {
+	.magic = RECORDING_MAGIC,
+	.version = RECORDING_VERSION,
+	.ledCount = LedCount(ledstring),
+	.count0 = ledstring->channel[0].count,
+    };
+
+    fRecording = fopen(output_file, "wb");
+    if (fRecording == NULL) {
+	perror(output_file);
+	return WS2811_ERROR_GENERIC;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fRecording) != 1) {
+	fclose(fRecording);
+	fRecording = NULL;
+	return WS2811_ERROR_GENERIC;
+    }
+    recFrames = 0;
+    return AllocChannels(ledstring);
+}
+
+static ws2811_return_t RecorderRender(ws2811_t *ledstring)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (fwrite(&ns, sizeof(ns), 1, fRecording) != 1)
+	return WS2811_ERROR_GENERIC;
+    for (int i = 0; i < RPI_PWM_CHANNELS; i++) {
+	size_t count = ledstring->channel[i].count;
+	if (count > 0 && fwrite(ledstring->channel[i].leds, sizeof(ws2811_led_t), count, fRecording) != count)
+	    return WS2811_ERROR_GENERIC;
+    }
+    recFrames++;
+    return WS2811_SUCCESS;
+}
+
+static void RecorderFini(ws2811_t *ledstring)
+{
+    if (fRecording != NULL) {
+	fclose(fRecording);
+	fRecording = NULL;
+	printf("recorded %lu frames to %s\n", recFrames, output_file);
+    }
+    FreeChannels(ledstring);
+}
+
+const struct OutputBackend recorder_output = { "record", RecorderInit, RecorderRender, RecorderFini };
+
+const struct OutputBackend *OutputByName(const char *name)
+{
+    static const struct OutputBackend *backends[] = { &ws2811_output, &framebuffer_output, &recorder_output };
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+	if (!strcmp(backends[i]->name, name))
+	    return backends[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,34 @@
+#include "ws2811.h"
+
+/*
+ * Where rendered frames go. matrix.c fills ledstring.channel[].leds the same way
+ * for every backend and hands the ledstring to one of these, so live and replay
+ * run the same on a build box as on the Pi.
+ */
+struct OutputBackend {
+    const char *name;
+    ws2811_return_t (*init)(ws2811_t *ledstring);	// allocates channel[].leds
+    ws2811_return_t (*render)(ws2811_t *ledstring);
+    void (*fini)(ws2811_t *ledstring);
+};
+
+extern const struct OutputBackend ws2811_output;	// the real string
+extern const struct OutputBackend framebuffer_output;	// keeps the frame in memory
+extern const struct OutputBackend recorder_output;	// timestamped frames to output_file
+
+extern char output_file[256];
+
+// recorder file: this header, then per frame a uint64_t CLOCK_MONOTONIC ns
+// followed by ledCount ws2811_led_t, channel 0 then channel 1
+#define RECORDING_MAGIC 0x464d4d4d	// "MMMF"
+#define RECORDING_VERSION 1
+
+struct RecordingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ledCount;
+    uint32_t count0;		// leds on channel 0, the rest are on channel 1
+};
+
+const struct OutputBackend *OutputByName(const char *name);
+const ws2811_led_t *FramebufferFrame(int *pLedCount, unsigned long *pFrames);
@@ -0,0 +1,274 @@
+/**********************************************************************
+* Filename    : replay.c
+* Description : Play back the history ring on the leds
+*
+* Records come off the history cursor a window at a time and are compiled
+* into per-frame change lists through category_colors, then the frame loop
+* only has to hand the changes to the led string.
+**********************************************************************/
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+#include "METARmap.h"
+#include "matrix.h"
+#include "history.h"
+#include "replay.h"
+#include "blend.h"
+#include "sched.h"
+#include "control.h"
+#include "http.h"
+#include "livestate.h"
+
+int FrameWindowInit(struct FrameWindow *w, int ledCount)
+{
+    memset(w, 0, sizeof(*w));
+    w->ledCount = ledCount;
+    w->maxChanges = REPLAY_WINDOW * REPLAY_CHANGES_PER_FRAME;
+    if (w->maxChanges < ledCount * 2)
+	w->maxChanges = ledCount * 2;	// always room for at least one full frame
+    w->changes = malloc(sizeof(struct FrameChange) * w->maxChanges);
+    w->state = malloc(sizeof(ws2811_led_t) * ledCount);
+    w->sShown = malloc(ledCount);
+    if (w->changes == NULL || w->state == NULL || w->sShown == NULL) {
+	FrameWindowFree(w);
+	return FALSE;
+    }
+
+    // the first frame is a diff against whatever is showing now
+    memcpy(w->state, matrix, sizeof(ws2811_led_t) * ledCount);
+    return TRUE;
+}
+
+// the frames go from tFrom, the record showing then is the newest up to REPLAY_GAP_SECS before it
+void FrameWindowStart(struct FrameWindow *w, struct HistoryCursor *c, time_t tFrom)
+{
+    w->c = c;
+    w->tFrame = tFrom;
+    w->tShown = 0;
+    memset(w->sShown, 'E', w->ledCount);
+    HistoryCursorSeekTime(c, tFrom - REPLAY_GAP_SECS);
+    w->sNext = HistoryCursorNext(c);
+}
+
+// compile the next maxFrames frames, up to a window full, returns how many we got
+int FrameWindowCompile(struct FrameWindow *w, int maxFrames)
+{
+    int numChanges = 0;
+
+    w->numFrames = 0;
+    w->firstChange[0] = 0;
+    while (w->numFrames < REPLAY_WINDOW && w->numFrames < maxFrames
+	   && w->maxChanges - numChanges >= w->ledCount) {
+	// catch up to this frame's time
+	while (w->sNext != NULL && (time_t)w->c->tRecord <= w->tFrame) {
+	    memcpy(w->sShown, w->sNext, w->ledCount);
+	    w->tShown = w->c->tRecord;
+	    w->sNext = HistoryCursorNext(w->c);
+	}
+	int isGap = (w->tShown == 0 || w->tFrame - w->tShown > REPLAY_GAP_SECS);
+
+	for (int j = 0; j < w->ledCount; j++) {
+	    ws2811_led_t color = category_colors[isGap ? 'E' : (unsigned char)w->sShown[j]];
+	    if (color != w->state[j]) {
+		w->changes[numChanges].led = j;
+		w->changes[numChanges].color = color;
+		numChanges++;
+		w->state[j] = color;
+	    }
+	}
+	w->numFrames++;
+	w->firstChange[w->numFrames] = numChanges;
+	w->tFrame += REPLAY_STEP_SECS;
+    }
+
+    return w->numFrames;
+}
+
+void FrameWindowFree(struct FrameWindow *w)
+{
+    free(w->changes);
+    free(w->state);
+    free(w->sShown);
+    w->changes = NULL;
+    w->state = NULL;
+    w->sShown = NULL;
+}
+
+// A command came in while we were replaying. The ones that change the map
+// end the replay and are left in control_pending for the daemon.
+static int ReplayInterrupted(const struct pollfd *pfds)
+{
+    if (!ControlTake(&control_pending, pfds) || ControlAnswer(&control_pending)) {
+	control_pending.cmd = CMD_NONE;
+	return FALSE;
+    }
+    ControlReply(&control_pending, "ok");
+    return TRUE;
+}
+
+void Replay(void)
+{
+    struct History history;
+
+    if (!HistoryOpen(&history, HistoryFileName(), HistorySegmentsFor(led_count), led_count, FALSE)) {
+	fprintf(stderr, "Can't do replay right now. File not available %d\n", errno);
+	return;
+    }
+
+    // the last num_replay_hours, or --from/--to, cut to the history there is
+    time_t tFirst, tLast;
+    if (!HistoryTimeRange(&history, &tFirst, &tLast)) {
+	printf("no history to replay\n");
+	HistoryClose(&history);
+	return;
+    }
+    time_t tTo = replay_to != 0 ? replay_to : time(NULL);
+    time_t tFrom = replay_from != 0 ? replay_from : tTo - (time_t)num_replay_hours * 3600;
+    char sFrom[32], sTo[32];
+    struct tm stTime;
+    if (tFrom < tFirst)
+	tFrom = tFirst;
+    if (tTo > tLast)
+	tTo = tLast;
+    if (tTo < tFrom) {
+	strftime(sFrom, sizeof(sFrom), "%Y-%m-%d %H:%M", localtime_r(&tFirst, &stTime));
+	strftime(sTo, sizeof(sTo), "%Y-%m-%d %H:%M", localtime_r(&tLast, &stTime));
+	printf("no history between those times, there is %s to %s\n", sFrom, sTo);
+	HistoryClose(&history);
+	return;
+    }
+    int num_recs_to_play = (int)((tTo - tFrom) / REPLAY_STEP_SECS) + 1;
+
+    strftime(sFrom, sizeof(sFrom), "%Y-%m-%d %H:%M", localtime_r(&tFrom, &stTime));
+    strftime(sTo, sizeof(sTo), "%Y-%m-%d %H:%M", localtime_r(&tTo, &stTime));
+    printf("replaying %s to %s, %d frames\n", sFrom, sTo, num_recs_to_play);
+
+    /* ****************************************************************************************
+     * No matter how many recs we replay, we want to do it over the course of a minute or less.
+     * In the future, we may allow the user to change this, but for now, it's a minute, which
+     * means that we want to make our sleep interval a function of the number of recs that we
+     * are displaying.
+     * 5 frames per seconds is one day (now 288 recs). usleep with 1000000 is one second
+     * *****************************************************************************************/
+    long int interval;
+
+    if (num_recs_to_play < 60) {
+	interval = SLOWEST_WE_GO;
+    } else {
+	if (test_mode == TRUE)
+	    interval = 500000l / (long int)(num_recs_to_play / 60);	// go fast for test
+	else
+	    interval = 1000000l / (long int)(num_recs_to_play / 60);
+    }
+
+    if (interval > SLOWEST_WE_GO)
+	interval = SLOWEST_WE_GO;
+
+    // stream the frames out of the ring from tFrom, a window at a time
+    struct HistoryCursor cursor;
+    struct FrameWindow window;
+    int ledCount = led_count;
+
+    if (!HistoryCursorInit(&cursor, &history)) {
+	HistoryClose(&history);
+	return;
+    }
+    if (!FrameWindowInit(&window, ledCount)) {
+	HistoryCursorFree(&cursor);
+	HistoryClose(&history);
+	return;
+    }
+    FrameWindowStart(&window, &cursor, tFrom);
+
+    // for smooth replay - where the leds are now and where this record takes them
+    ws2811_led_t from[ledCount];
+    ws2811_led_t to[ledCount];
+    memcpy(from, matrix, sizeof(from));
+
+    // every record gets smooth_frames + 1 frame slots, the last one shows the record itself
+    struct FrameScheduler sched;
+    int framesPerRecord = smooth_frames + 1;
+    int toDrop = 0;
+    SchedStart(&sched, interval * 1000LL / framesPerRecord);
+
+    int framesLeft = num_recs_to_play;
+    int frameNo = 0;		// from tFrom, for the time each one shows
+    int stopped = FALSE;	// by a command on the control socket
+    struct pollfd pfds[CONTROL_NUM_FDS];
+    replaying = TRUE;
+    HttpMode();
+    while (framesLeft > 0 && running && !stopped) {
+	if (FrameWindowCompile(&window, framesLeft) == 0)
+	    break;
+	framesLeft -= window.numFrames;
+
+	for (int i = 0; i < window.numFrames; i++) {		//loop through all metar map recs
+	    if (running == 0 || stopped)
+		break;
+	    printf(".");
+	    fflush(stdout);
+
+	    const struct FrameChange *changes = &window.changes[window.firstChange[i]];
+	    int numChanges = window.firstChange[i+1] - window.firstChange[i];
+
+	    if (smooth_frames > 0 && numChanges > 0) {
+		memcpy(to, from, sizeof(to));
+		for (int k = 0; k < numChanges; k++)
+		    to[changes[k].led] = changes[k].color;
+	    }
+
+	    for (int k = 1; k <= framesPerRecord && running && !stopped; k++) {
+		int isRecord = (k == framesPerRecord);
+		if (toDrop > 0) {	// behind schedule - skip the show, keep the state
+		    toDrop--;
+		    if (isRecord)
+			matrix_set_changes(changes, numChanges);
+		    continue;
+		}
+		for (;;) {	// the set changes as control clients come and go
+		    ControlFds(pfds);
+		    if ((toDrop = SchedWaitFds(&sched, pfds, CONTROL_NUM_FDS)) != SCHED_FD_READY
+			|| (stopped = ReplayInterrupted(pfds)))
+			break;
+		}
+		if (toDrop < 0)
+		    break;	// told to stop
+		if (isRecord) {
+		    matrix_render_changes(changes, numChanges);
+		    HttpFrame(tFrom + (time_t)frameNo * REPLAY_STEP_SECS);
+		    LiveStatePublish(tFrom + (time_t)frameNo * REPLAY_STEP_SECS);
+		} else if (numChanges > 0) {	// fade across the record
+		    BlendFrames(matrix, from, to, ledCount, (uint32_t)(k * BLEND_ONE / framesPerRecord));
+		    matrix_mark_dirty();
+		    matrix_render();
+		}
+		SchedFrameDone(&sched);
+	    }
+
+	    for (int k = 0; k < numChanges; k++)
+		from[changes[k].led] = changes[k].color;
+	    frameNo++;
+	}
+    }
+    if (running && !stopped && toDrop == 0)
+	SchedWait(&sched);	// let the last record have its time on the map
+    replaying = FALSE;
+    HttpMode();
+    FrameWindowFree(&window);
+    HistoryCursorFree(&cursor);
+    HistoryClose(&history);
+
+    // blink the lights so we'll know that replay is done
+    clear_ledstring();
+
+    usleep(1000000 / 5);  //  1/5 of a second for the blink
+    matrix_render();
+
+    printf("X\n");
+    SchedReport(&sched, "replay");
+
+}
@@ -0,0 +1,30 @@
+#define REPLAY_WINDOW 256		// frames compiled ahead of the display at a time
+#define REPLAY_CHANGES_PER_FRAME 16	// room for this many changes per frame on average
+#define REPLAY_STEP_SECS REFRESH_INTERVAL_SECS	// history time per frame
+#define REPLAY_GAP_SECS (2 * REFRESH_INTERVAL_SECS)	// a frame with no record newer than this is a gap
+
+/*
+ * A run of replay frames compiled ahead of time. Each frame is just the list of
+ * leds whose color differs from the frame before, already turned into the color
+ * we send, so showing a frame costs what changed rather than the whole string.
+ * Frames are REPLAY_STEP_SECS of history apart and show the newest record at
+ * their time, or no data where the map wasn't recording.
+ */
+struct FrameWindow {
+    int ledCount;
+    int numFrames;
+    int firstChange[REPLAY_WINDOW + 1];	// frame i is changes[firstChange[i]] up to firstChange[i+1]
+    struct FrameChange *changes;
+    int maxChanges;
+    ws2811_led_t *state;		// colors as of the last compiled frame
+    struct HistoryCursor *c;
+    const char *sNext;			// next record off the cursor, NULL when there are no more
+    time_t tFrame;			// history time of the next frame
+    char *sShown;			// newest record at or before it
+    time_t tShown;			// and when that was taken, 0 for none yet
+};
+
+int FrameWindowInit(struct FrameWindow *w, int ledCount);
+void FrameWindowStart(struct FrameWindow *w, struct HistoryCursor *c, time_t tFrom);
+int FrameWindowCompile(struct FrameWindow *w, int maxFrames);
+void FrameWindowFree(struct FrameWindow *w);
@@ -0,0 +1,143 @@
+/**********************************************************************
+* Filename    : sched.c
+* Description : Absolute deadline frame scheduler with jitter and
+*               dropped frame counts
+*
+* Used by replay to hold a frame rate and by the daemon for its refresh
+* cycle. clock_nanosleep with TIMER_ABSTIME means the time spent rendering
+* comes out of the sleep instead of being added to it.
+**********************************************************************/
+#define _GNU_SOURCE	// ppoll
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+
+#include "METARmap.h"
+#include "sched.h"
+
+// upper edge of each latency bucket in microseconds, the last one catches the rest
+static const long schedBucketUs[SCHED_BUCKETS] = { 100, 250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 0 };
+
+static long long TimespecNs(const struct timespec *ts)
+{
+    return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static long long NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return TimespecNs(&ts);
+}
+
+static long long DeadlineNs(const struct FrameScheduler *s, long long frame)
+{
+    return TimespecNs(&s->tsStart) + frame * s->periodNs;
+}
+
+// the first frame is due right away
+void SchedStart(struct FrameScheduler *s, long long periodNs)
+{
+    memset(s, 0, sizeof(*s));
+    s->periodNs = periodNs > 0 ? periodNs : 1;
+    clock_gettime(CLOCK_MONOTONIC, &s->tsStart);
+}
+
+/*
+ * Sleep until the next frame is due. Returns how many frames after this one
+ * are already overdue - the caller drops that many - or -1 if we were told
+ * to stop while waiting.
+ */
+int SchedWait(struct FrameScheduler *s)
+{
+    long long deadline = DeadlineNs(s, s->frame);
+    struct timespec tsDeadline;
+    int ret;
+
+    tsDeadline.tv_sec = deadline / 1000000000LL;
+    tsDeadline.tv_nsec = deadline % 1000000000LL;
+    while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tsDeadline, NULL)) == EINTR) {
+	if (!running)
+	    return -1;
+    }
+
+    s->deadlineNs = deadline;
+    long long wake = NowNs() - deadline;
+    if (wake < 0)
+	wake = 0;
+    s->sumWakeNs += wake;
+    s->sumWakeSqNs += (double)wake * wake;
+    if (wake > s->maxWakeNs)
+	s->maxWakeNs = wake;
+
+    // the frames whose deadlines went by while we were late get dropped
+    int late = (int)(wake / s->periodNs);
+    s->frame += 1 + late;
+    s->framesDropped += late;
+    return late;
+}
+
+/*
+ * SchedWait that also comes back early, with SCHED_FD_READY, if any of the
+ * fds has something to read - their revents say which. Negative fds are
+ * left out. The frame is still due when we're called again.
+ */
+int SchedWaitFds(struct FrameScheduler *s, struct pollfd *pfds, int numFds)
+{
+    long long deadline = DeadlineNs(s, s->frame);
+    long long left;
+    int haveFd = FALSE;
+
+    for (int i = 0; i < numFds; i++) {
+	pfds[i].events = POLLIN;
+	pfds[i].revents = 0;
+	haveFd |= pfds[i].fd >= 0;
+    }
+    while (haveFd && (left = deadline - NowNs()) > 0) {
+	struct timespec tsLeft = { left / 1000000000LL, left % 1000000000LL };
+
+	int n = ppoll(pfds, numFds, &tsLeft, NULL);
+	if (n > 0)
+	    return SCHED_FD_READY;
+	if (n < 0 && errno == EINTR && !running)
+	    return -1;
+    }
+    return SchedWait(s);	// due now, this just does the bookkeeping
+}
+
+// call once the frame is out, so the histogram covers the render as well
+void SchedFrameDone(struct FrameScheduler *s)
+{
+    long long latency = NowNs() - s->deadlineNs;	// frame - 1 would be a dropped one after a drop
+    int b;
+
+    for (b = 0; b < SCHED_BUCKETS - 1; b++)
+	if (latency < schedBucketUs[b] * 1000LL)
+	    break;
+    s->latencyHist[b]++;
+    if (latency > s->maxLatencyNs)
+	s->maxLatencyNs = latency;
+    s->framesShown++;
+}
+
+void SchedReport(const struct FrameScheduler *s, const char *sWhat)
+{
+    long long numWakes = s->frame - s->framesDropped;
+    double avgWake = numWakes > 0 ? s->sumWakeNs / numWakes : 0.0;
+    double varWake = numWakes > 0 ? s->sumWakeSqNs / numWakes - avgWake * avgWake : 0.0;
+
+    printf("%s: %lld frames shown, %lld dropped, period %.3fms\n", sWhat,
+	   s->framesShown, s->framesDropped, s->periodNs / 1e6);
+    printf("%s: wake jitter avg %.1fus sd %.1fus max %.1fus, max latency %.1fus\n", sWhat,
+	   avgWake / 1e3, sqrt(varWake > 0.0 ? varWake : 0.0) / 1e3, s->maxWakeNs / 1e3, s->maxLatencyNs / 1e3);
+    printf("%s: latency", sWhat);
+    for (int b = 0; b < SCHED_BUCKETS; b++) {
+	if (b < SCHED_BUCKETS - 1)
+	    printf(" <%ldus:%lld", schedBucketUs[b], s->latencyHist[b]);
+	else
+	    printf(" more:%lld", s->latencyHist[b]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,32 @@
+#include <time.h>
+
+struct pollfd;
+
+#define SCHED_BUCKETS 10	// latency histogram buckets, see schedBucketUs in sched.c
+#define SCHED_FD_READY -2	// SchedWaitFds woke up for one of its fds, not the frame
+
+/*
+ * Frame pacing against absolute deadlines on CLOCK_MONOTONIC - frame n is due
+ * at start + n * period no matter how long the frames before it took, so
+ * nothing adds up. If we wake up more than a period late the frames whose
+ * deadlines have already gone by are dropped rather than shown late.
+ */
+struct FrameScheduler {
+    struct timespec tsStart;
+    long long periodNs;
+    long long frame;		// next frame to wait for
+    long long deadlineNs;	// of the frame SchedWait last waited for, the one being shown
+    long long framesShown;
+    long long framesDropped;
+    long long latencyHist[SCHED_BUCKETS];	// deadline to frame done
+    long long maxLatencyNs;
+    double sumWakeNs;		// how late we woke up, for jitter
+    double sumWakeSqNs;
+    long long maxWakeNs;
+};
+
+void SchedStart(struct FrameScheduler *s, long long periodNs);
+int SchedWait(struct FrameScheduler *s);
+int SchedWaitFds(struct FrameScheduler *s, struct pollfd *pfds, int numFds);
+void SchedFrameDone(struct FrameScheduler *s);
+void SchedReport(const struct FrameScheduler *s, const char *sWhat);
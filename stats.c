@@ -0,0 +1,360 @@
+/**********************************************************************
+* Filename    : stats.c
+* Description : Per station history from the column store - time in
+*               each category, how often it changed and the longest
+*               IFR or worse spell
+*
+* A station's records in a block are one run of bytes, so the scans
+* take them 8 at a time in a uint64_t, the lanes trick blend.c uses:
+* comparing a byte is an xor and a zero test that can't carry into the
+* next lane, and counts pile up a lane at a time, added across only
+* every 255 words. No SIMD instructions needed, so the Pi Zero gets the
+* same code as everything else. Years of refreshes take milliseconds.
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "METARmap.h"
+#include "columns.h"
+#include "metrics.h"
+#include "stats.h"
+
+#define LANES_ONES 0x0101010101010101ULL
+#define LANES_LOW7 0x7f7f7f7f7f7f7f7fULL
+#define LANES_HIGH 0x8080808080808080ULL
+#define LANES_EVEN 0x00ff00ff00ff00ffULL
+#define LANE_MAX_WORDS 255	// words a byte lane can count before it has to be added up
+
+static const uint8_t sCategories[STATS_NUM_COUNTS - 1] = { 'V', 'M', 'I', 'L' };
+
+// little endian lanes whatever the machine, so byte i of p is lane i and a shift moves a lane along
+static uint64_t Load8(const uint8_t *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// the high bit of each byte of w that is c
+static uint64_t LanesEqual(uint64_t w, uint8_t c)
+{
+    uint64_t x = w ^ (LANES_ONES * c);
+    return ~(((x & LANES_LOW7) + LANES_LOW7) | x | LANES_LOW7);
+}
+
+// byte lanes of up to 255 each, added up
+static uint64_t SumLanes(uint64_t acc)
+{
+    acc = (acc & LANES_EVEN) + ((acc >> 8) & LANES_EVEN);
+    return (acc * 0x0001000100010001ULL) >> 48;
+}
+
+static int IsCategory(uint8_t c)
+{
+    return c == 'V' || c == 'M' || c == 'I' || c == 'L';
+}
+
+static void EndSpell(struct StationStats *st)
+{
+    if (st->runLast == 0)
+	return;
+    if (st->bestLast == 0 || st->runLast - st->runFirst > st->bestLast - st->bestFirst) {
+	st->bestFirst = st->runFirst;
+	st->bestLast = st->runLast;
+    }
+    st->runLast = 0;
+}
+
+// one record: its category, a change from the one before and the IFR spell
+static void ScanByte(const uint8_t *p, const uint32_t *times, size_t i, struct StationStats *st)
+{
+    uint8_t c = p[i];
+
+    for (int k = 0; k < STATS_NUM_COUNTS - 1; k++)
+	st->counts[k] += c == sCategories[k];
+    st->changes += c != st->last && IsCategory(c) && IsCategory(st->last);
+    st->last = c;
+    if (c == 'I' || c == 'L') {
+	if (st->runLast == 0)
+	    st->runFirst = times[i];
+	st->runLast = times[i];
+    } else
+	EndSpell(st);
+}
+
+/*
+ * Records [s, e) of one station's column, which have no gaps between them.
+ * A word at a time: the four category compares feed the counts, the same
+ * word shifted along a lane is the record before each one for the
+ * changes, and I or L in all or none of the lanes carries the spell on or
+ * ends it. Only a word the spell starts or ends in goes a byte at a time.
+ */
+static void ScanRun(const uint8_t *p, const uint32_t *times, size_t s, size_t e, struct StationStats *st)
+{
+    size_t i = s;
+
+    if (st->runLast != 0 && times[s] - st->runLast > STATS_GAP_SECS)
+	EndSpell(st);
+
+    while (e - i >= 8) {
+	uint64_t acc[STATS_NUM_COUNTS] = { 0 };	// V M I L then changes
+	uint64_t prev = st->last;
+	uint64_t prevCat = IsCategory(st->last) ? 0x80 : 0;
+
+	for (int w = 0; w < LANE_MAX_WORDS && e - i >= 8; w++, i += 8) {
+	    uint64_t word = Load8(p + i);
+	    uint64_t v = LanesEqual(word, 'V');
+	    uint64_t m = LanesEqual(word, 'M');
+	    uint64_t ifr = LanesEqual(word, 'I');
+	    uint64_t lifr = LanesEqual(word, 'L');
+	    uint64_t cat = v | m | ifr | lifr;
+	    uint64_t before = (word << 8) | prev;
+
+	    acc[0] += v >> 7;
+	    acc[1] += m >> 7;
+	    acc[2] += ifr >> 7;
+	    acc[3] += lifr >> 7;
+	    acc[4] += (~LanesEqual(word ^ before, 0) & cat & ((cat << 8) | prevCat)) >> 7;
+	    prev = word >> 56;
+	    prevCat = cat >> 56;
+
+	    ifr |= lifr;
+	    if (ifr == 0)		// the usual case
+		EndSpell(st);
+	    else if (ifr == LANES_HIGH) {	// all 8, the spell goes on
+		if (st->runLast == 0)
+		    st->runFirst = times[i];
+		st->runLast = times[i + 7];
+	    } else {
+		for (int j = 0; j < 8; j++) {
+		    if (ifr & (0x80ULL << (8 * j))) {
+			if (st->runLast == 0)
+			    st->runFirst = times[i + j];
+			st->runLast = times[i + j];
+		    } else
+			EndSpell(st);
+		}
+	    }
+	}
+	for (int k = 0; k < STATS_NUM_COUNTS - 1; k++)
+	    st->counts[k] += SumLanes(acc[k]);
+	st->changes += SumLanes(acc[4]);
+	st->last = (uint8_t)prev;
+    }
+    for (; i < e; i++)
+	ScanByte(p, times, i, st);
+}
+
+// first of the n sorted times at or after t
+static size_t LowerBound(const uint32_t *times, size_t n, uint64_t t)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (times[mid] < t)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static int FindStats(struct StationStats **pStats, int *pNumStats, int *pCapacity, const char *sCode)
+{
+    for (int i = 0; i < *pNumStats; i++)
+	if (strncmp((*pStats)[i].sCode, sCode, COLUMNS_CODE_LEN) == 0)
+	    return i;
+
+    if (*pNumStats == *pCapacity) {
+	int capacity = *pCapacity ? *pCapacity * 2 : 64;
+	struct StationStats *stats = realloc(*pStats, sizeof(struct StationStats) * capacity);
+	if (stats == NULL)
+	    return -1;
+	*pStats = stats;
+	*pCapacity = capacity;
+    }
+    struct StationStats *st = &(*pStats)[*pNumStats];
+    memset(st, 0, sizeof(*st));
+    memcpy(st->sCode, sCode, COLUMNS_CODE_LEN);
+    return (*pNumStats)++;
+}
+
+static int Wanted(const char *sCode, const char **sStations, int numStations)
+{
+    if (numStations == 0)
+	return TRUE;
+    for (int i = 0; i < numStations; i++)
+	if (strncmp(sStations[i], sCode, COLUMNS_CODE_LEN) == 0)
+	    return TRUE;
+    return FALSE;
+}
+
+/*
+ * Stats for every station in the store with records from tFrom to tTo (0 for
+ * no end), or just sStations if there are any. Returns how many, the array is the
+ * caller's to free.
+ */
+int StatsScan(const struct Columns *c, time_t tFrom, time_t tTo, const char **sStations, int numStations,
+	      struct StationStats **pStats)
+{
+    struct StationStats *stats = NULL;
+    int numStats = 0, capacity = 0;
+    int *statOf = NULL;			// stats entry for each column of the block, -1 to skip it
+    const struct ColumnsBlock *bMapped = NULL;	// block statOf was worked out for
+    size_t segs[COLUMNS_BLOCK_RECS + 1];	// starts of the runs of records without a gap
+    uint8_t tail[COLUMNS_TAIL_RECS];	// a station's records not in its column yet
+    uint64_t tEnd = tTo != 0 ? (uint64_t)tTo + 1 : (uint64_t)UINT32_MAX + 1;
+
+    for (const struct ColumnsBlock *b = ColumnsFirstBlock(c); b != NULL; b = ColumnsNextBlock(c, b)) {
+	uint32_t numRecs = __atomic_load_n(&b->numRecs, __ATOMIC_ACQUIRE);
+	if (numRecs == 0 || numRecs > c->hdr->blockRecs || numRecs > COLUMNS_BLOCK_RECS)
+	    continue;
+	const uint32_t *times = ColumnsTimes(b);
+	size_t i0 = LowerBound(times, numRecs, tFrom);
+	size_t i1 = LowerBound(times, numRecs, tEnd);
+	size_t iTail = ColumnsTailStart(c, numRecs);
+	if (i0 >= i1)
+	    continue;
+
+	// the same airport list as the block before keeps the same columns
+	if (bMapped == NULL || bMapped->numStations != b->numStations
+	    || memcmp(ColumnsCode(bMapped, 0), ColumnsCode(b, 0), (size_t)b->numStations * COLUMNS_CODE_LEN) != 0) {
+	    int *map = realloc(statOf, sizeof(int) * b->numStations);
+	    if (map == NULL)
+		break;
+	    statOf = map;
+	    for (uint32_t k = 0; k < b->numStations; k++)
+		statOf[k] = Wanted(ColumnsCode(b, k), sStations, numStations)
+		    ? FindStats(&stats, &numStats, &capacity, ColumnsCode(b, k)) : -1;
+	}
+	bMapped = b;
+
+	size_t numSegs = 0;
+	segs[numSegs++] = i0;
+	for (size_t i = i0 + 1; i < i1; i++)
+	    if (times[i] - times[i - 1] > STATS_GAP_SECS)
+		segs[numSegs++] = i;
+	segs[numSegs] = i1;
+
+	for (uint32_t k = 0; k < b->numStations; k++) {
+	    if (statOf[k] < 0)
+		continue;
+	    struct StationStats *st = &stats[statOf[k]];
+	    const uint8_t *p = ColumnsColumn(c, b, k);
+
+	    uint64_t numBefore = 0;
+	    for (int j = 0; j < STATS_NUM_COUNTS - 1; j++)
+		numBefore += st->counts[j];
+	    if (i1 > iTail)
+		ColumnsTail(c, b, k, numRecs, tail);
+	    for (size_t s = 0; s < numSegs; s++) {
+		size_t e = segs[s + 1] < iTail ? segs[s + 1] : iTail;
+		if (segs[s] < e)
+		    ScanRun(p, times, segs[s], e, st);
+		size_t sTail = segs[s] > iTail ? segs[s] : iTail;
+		if (sTail < segs[s + 1])	// the same run carries on into the tail
+		    ScanRun(tail, times + iTail, sTail - iTail, segs[s + 1] - iTail, st);
+	    }
+	    uint64_t numCategories = 0;
+	    for (int j = 0; j < STATS_NUM_COUNTS - 1; j++)
+		numCategories += st->counts[j];
+	    st->counts[STATS_NUM_COUNTS - 1] += (i1 - i0) - (numCategories - numBefore);
+	}
+    }
+    free(statOf);
+
+    for (int i = 0; i < numStats; i++)
+	EndSpell(&stats[i]);
+    *pStats = stats;
+    return numStats;
+}
+
+// most changes first, that's what most of the questions are
+static int ByChanges(const void *a, const void *b)
+{
+    const struct StationStats *sa = a, *sb = b;
+
+    if (sa->changes != sb->changes)
+	return sa->changes < sb->changes ? 1 : -1;
+    return strcmp(sa->sCode, sb->sCode);
+}
+
+static void FormatSpell(char *s, size_t len, const struct StationStats *st)
+{
+    char sWhen[32];
+    struct tm stTime;
+    time_t tFirst = st->bestFirst;
+    uint32_t minutes = (st->bestLast - st->bestFirst + REFRESH_INTERVAL_SECS) / 60;
+
+    if (st->bestLast == 0) {
+	snprintf(s, len, "-");
+	return;
+    }
+    strftime(sWhen, sizeof(sWhen), "%Y-%m-%d %H:%M", localtime_r(&tFirst, &stTime));
+    snprintf(s, len, "%uh%02um from %s", minutes / 60, minutes % 60, sWhen);
+}
+
+/*
+ * METARmap stats [station ...], with -F and -T for the time range. Reads
+ * the column store the live refreshes keep, so it doesn't need the
+ * semaphore and can run while the daemon does.
+ */
+int StatsCommand(int argc, char **argv)
+{
+    struct Columns c;
+    struct StationStats *stats;
+    const char *sStations[argc > 0 ? argc : 1];
+    char sSpell[64];
+
+    for (int i = 0; i < argc; i++) {
+	for (char *p = argv[i]; *p != '\0'; p++)
+	    *p = toupper((unsigned char)*p);
+	sStations[i] = argv[i];
+    }
+
+    if (!ColumnsOpen(&c, ColumnsFileName(), FALSE)) {
+	fprintf(stderr, "no %s yet, the next refresh fills it in from the history\n", ColumnsFileName());
+	return 1;
+    }
+
+    double tStart = MetricsNow();
+    int numStats = StatsScan(&c, replay_from, replay_to, sStations, argc, &stats);
+    double secs = MetricsNow() - tStart;
+
+    qsort(stats, numStats, sizeof(struct StationStats), ByChanges);
+    printf("station    hours   VFR%%  MVFR%%   IFR%%  LIFR%%  none%%  changes  longest IFR or worse\n");
+    uint64_t numScanned = 0;
+    for (int i = 0; i < numStats; i++) {
+	const struct StationStats *st = &stats[i];
+	uint64_t total = 0;
+	for (int j = 0; j < STATS_NUM_COUNTS; j++)
+	    total += st->counts[j];
+	numScanned += total;
+	if (total == 0)
+	    continue;
+	FormatSpell(sSpell, sizeof(sSpell), st);
+	printf("%-6s %9.1f", st->sCode, total * (double)REFRESH_INTERVAL_SECS / 3600);
+	for (int j = 0; j < STATS_NUM_COUNTS; j++)
+	    printf(" %6.1f", 100.0 * st->counts[j] / total);
+	printf(" %8llu  %s\n", (unsigned long long)st->changes, sSpell);
+    }
+    for (int i = 0; i < argc; i++) {
+	int found = FALSE;
+	for (int j = 0; j < numStats && !found; j++)
+	    found = strncmp(stats[j].sCode, sStations[i], COLUMNS_CODE_LEN) == 0;
+	if (!found)
+	    printf("%s: no history\n", sStations[i]);
+    }
+    printf("%llu station records scanned in %.2f ms\n", (unsigned long long)numScanned, secs * 1000);
+
+    free(stats);
+    ColumnsClose(&c);
+    return 0;
+}
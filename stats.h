@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_GAP_SECS (2 * REFRESH_INTERVAL_SECS)	// records further apart are a gap, as replay shows them
+#define STATS_NUM_COUNTS 5	// V M I L and everything else
+
+// what the stats command says about one station over the time asked for
+struct StationStats {
+    char sCode[COLUMNS_CODE_LEN + 1];
+    uint64_t counts[STATS_NUM_COUNTS];	// records in each category
+    uint64_t changes;		// between two categories, no data doesn't count
+    uint8_t last;		// category of the newest record scanned, to carry a change across blocks
+    uint32_t runFirst;		// IFR or worse spell going now, times of its first and last records
+    uint32_t runLast;
+    uint32_t bestFirst;		// and the longest one, bestLast 0 for none
+    uint32_t bestLast;
+};
+
+struct Columns;
+
+int StatsScan(const struct Columns *c, time_t tFrom, time_t tTo, const char **sStations, int numStations,
+	      struct StationStats **pStats);
+int StatsCommand(int argc, char **argv);
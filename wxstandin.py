@@ -0,0 +1,101 @@
+""" A stand-in for the aviation wx dataserver, for testing and benchmarking
+without hitting the real one.
+
+Serves recorded METAR xml - one file, or a directory of them in name order,
+a new one per request - on any path. It can be made slow, make requests fail
+and cut responses short, and it answers If-None-Match with a 304 so the
+refresh path that skips the parse gets exercised too.
+
+	python3 wxstandin.py responses/ --port 8080 --latency 200 --errors 0.1
+	sudo ./METARmap -D -u 'http://localhost:8080/?stationString='
+"""
+import argparse
+import hashlib
+import os
+import random
+import re
+import threading
+import time
+from datetime import datetime, timezone
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+parser = argparse.ArgumentParser(description='serve recorded METAR xml')
+parser.add_argument('source', help='a recorded response, or a directory of them')
+parser.add_argument('--host', default='127.0.0.1')
+parser.add_argument('--port', type=int, default=8080)
+parser.add_argument('--latency', type=float, default=0, help='ms before answering')
+parser.add_argument('--jitter', type=float, default=0, help='up to this many ms more, at random')
+parser.add_argument('--errors', type=float, default=0, help='fraction of requests answered 503')
+parser.add_argument('--truncate', type=float, default=0, help='fraction of responses cut off partway')
+parser.add_argument('--hold', type=int, default=1, help='requests each response is served for')
+parser.add_argument('--keep-times', action='store_true',
+		    help="leave observation_time alone, otherwise it's rewritten to now")
+parser.add_argument('--seed', type=int, default=None, help='for repeatable errors and truncation')
+args = parser.parse_args()
+
+if os.path.isdir(args.source):
+	files = sorted(os.path.join(args.source, f) for f in os.listdir(args.source) if not f.startswith('.'))
+else:
+	files = [args.source]
+responses = [open(f, 'rb').read() for f in files]
+print('serving {} recorded responses from {}'.format(len(responses), args.source))
+
+rng = random.Random(args.seed)
+lock = threading.Lock()
+num_requests = 0
+
+obs_time = re.compile(rb'<observation_time>[^<]*</observation_time>')
+
+class StandIn(BaseHTTPRequestHandler):
+	""" Every GET gets the next recorded response, whatever the path
+	"""
+	def do_GET(self):
+		global num_requests
+		with lock:
+			n = num_requests
+			num_requests += 1
+			fail = rng.random() < args.errors
+			cut = rng.random() < args.truncate
+			delay = args.latency + rng.random() * args.jitter
+		body = responses[(n // args.hold) % len(responses)]
+		if not args.keep_times:
+			# to the minute, so a refresh within the same minute still gets its 304
+			now = datetime.now(timezone.utc).strftime('%Y-%m-%dT%H:%M:00Z').encode()
+			body = obs_time.sub(b'<observation_time>' + now + b'</observation_time>', body)
+		# of what's sent, so new times are a new body and a kept 304 can't go stale
+		etag = '"{}"'.format(hashlib.md5(body).hexdigest())
+
+		if delay > 0:
+			time.sleep(delay / 1000.0)
+		if fail:
+			self.send_error(503, 'stand-in error')
+			return
+		if self.headers.get('If-None-Match') == etag:
+			self.send_response(304)
+			self.send_header('ETag', etag)
+			self.end_headers()
+			return
+
+		self.send_response(200)
+		self.send_header('Content-type', 'text/xml')
+		self.send_header('Content-Length', str(len(body)))
+		self.send_header('ETag', etag)
+		self.end_headers()
+		if cut:
+			# say it's all coming then hang up partway
+			self.wfile.write(body[:rng.randrange(len(body))])
+			self.close_connection = True
+			return
+		self.wfile.write(body)
+
+	def log_message(self, format, *a):
+		print('{} {}'.format(self.address_string(), format % a))
+
+if __name__ == '__main__':
+	server = ThreadingHTTPServer((args.host, args.port), StandIn)
+	print('listening on {}:{}'.format(args.host, args.port))
+	try:
+		server.serve_forever()
+	except KeyboardInterrupt:
+		pass
+	server.server_close()